@@ -34,6 +34,9 @@
 #include "kvm/guest_compat.h"
 #include "kvm/kvm-ipc.h"
 #include "kvm/builtin-debug.h"
+#ifdef RSLD
+#include "kvm/pmm.h"
+#endif
 
 #include <linux/types.h>
 #include <linux/err.h>
@@ -111,9 +114,38 @@ void kvm_run_set_wrapper_sandbox(void)
 	OPT_U64('\0', "shmem-addr", &(cfg)->hvl_shmem_phys_addr, "Shared memory"	\
 		" physical address"),					\
 	OPT_U64('\0', "shmem-size", &(cfg)->hvl_shmem_size, "Shared memory size"), \
+	OPT_CALLBACK('\0', "shmem-region", kvm, "[dev=]size[:align|:huge]",	\
+			"Size and alignment of the shared memory region of"	\
+			" the devices", pmm__shm_region_parser, kvm),	\
+	OPT_CALLBACK('\0', "shmem-bufs", kvm, "[dev=]nr[:size]",	\
+			"Pool of data buffers shared with the driver of the"	\
+			" devices", pmm__shm_bufs_parser, kvm),		\
+	OPT_CALLBACK('\0', "shmem-window", kvm,			\
+			"addr:size[:uio=dev.map][:node=n][:cpus=list]",	\
+			"Additional shared memory window",		\
+			pmm__shm_window_parser, kvm),			\
+	OPT_CALLBACK('\0', "shmem-bind", kvm, "[dev=]window",		\
+			"Shared memory window to carve the regions of the"	\
+			" devices from", pmm__shm_bind_parser, kvm),	\
+	OPT_INTEGER('\0', "shmem-clear", &(cfg)->pmm_shmem_clear,	\
+			"Zero the unused part of the shared memory with <n>"	\
+			" threads at startup"),				\
 	OPT_BOOLEAN('\0', "vproxy", &(cfg)->vproxy,	"vhost proxy mode"), \
 	OPT_BOOLEAN('\0', "no-dtb", &(cfg)->no_dtb,	"Don't populate PMM device" \
-        " tree in shared memory"),
+        " tree in shared memory"),					\
+	OPT_STRING('\0', "pmm-loopback", &(cfg)->pmm_loopback, "path",	\
+			"Back the shared memory with a memfd and serve it and"	\
+			" eventfd mailboxes to a local frontend on this socket"), \
+	OPT_INTEGER('\0', "pmm-poll", &(cfg)->pmm_poll, "Busy-poll the"	\
+			" shared memory queues, back to mailbox kicks after"	\
+			" <n> idle usecs"),				\
+	OPT_CALLBACK('\0', "pmm-worker", kvm, "[dev=]cpus|any",	\
+			"Service the devices on a thread of their own,"	\
+			" pinned to the given CPUs", pmm__worker_parser, kvm),	\
+	OPT_CALLBACK('\0', "pmm-coalesce", kvm, "[dev=]usecs[:frames]",	\
+			"Merge the notifications of shared memory devices"	\
+			" raised within usecs, or up to frames of them, into"	\
+			" a single one", pmm__coalesce_parser, kvm),
 #else
 #define OPT_PMM(...)
 #endif
@@ -142,6 +174,9 @@ void kvm_run_set_wrapper_sandbox(void)
 		     " guest", virtio_9p_rootdir_parser, kvm),		\
 	OPT_STRING('\0', "console", &(cfg)->console, "serial, virtio or"\
 			" hv", "Console to use"),			\
+	OPT_BOOLEAN('\0', "virtio-modern", &(cfg)->virtio_modern,	\
+			"Expose virtio-mmio devices as virtio 1.x (version"	\
+			" 2) devices"),					\
 	OPT_U64('\0', "vsock", &(cfg)->guest_cid, "Use vsockets"	\
 		" <cid for quest>"),				\
 	OPT_STRING('\0', "dev", &(cfg)->dev, "device_file",		\
@@ -194,6 +229,9 @@ void kvm_run_set_wrapper_sandbox(void)
 			"Delay IO by millisecond"),			\
 	OPT_BOOLEAN('\0', "debug-nohostfs", &(cfg)->nohostfs_debug,	\
 			"Don't attach 9p host file system"),		\
+	OPT_BOOLEAN('\0', "virtio-trace", &(cfg)->virtio_trace,		\
+			"Time the virtqueue requests, see lkvm stat"	\
+			" --virtio-trace"),				\
 									\
     OPT_PMM(RUN, cfg)                    \
 	OPT_ARCH(RUN, cfg)						\
@@ -236,24 +274,12 @@ static void kvm_pmm_signal_handler(int signum)
 	exit(signum);
 }
 
-int notify_mbox(struct kvm *kvm)
-{
-	write(kvm->notif_fd, "\n", 1);
-	return 0;
-}
-
 static void *pmm_thread(void *arg)
 {
-	char name[16];
 	struct kvm *kvm = arg;
+	char name[16];
 	int tid = 0;
-	int r = 0;
-	int fd;
-	char sval[20];
-    fd_set read_fd, write_fd;
 	sigset_t sigset;
-	struct kvm_cpu cpu = {0};
-	__u8  data[8] = {0};
 
 	sigemptyset(&sigset);
 	sigaddset(&sigset, SIGALRM);
@@ -266,39 +292,22 @@ static void *pmm_thread(void *arg)
 	signal(SIGUSR1, kvm_pmm_signal_handler);
 	signal(SIGTERM, kvm_pmm_signal_handler);
 
-
 	sprintf(name, "pmm-%d", tid);
 	kvm__set_thread_name(name);
-	cpu.kvm = kvm;
-
-    fd = open("/dev/umb", O_RDWR | O_NONBLOCK);
-    if (fd == -1)  {
-        die("open /dev/umb");
-    }
-
-    kvm->notif_fd = fd;
-
-	while(1) {
-		FD_ZERO(&read_fd);
-        FD_SET(fd, &read_fd);
-        FD_ZERO(&write_fd);
-        FD_SET(fd, &write_fd);
 
-        r = select(FD_SETSIZE, &read_fd, &write_fd, NULL, NULL);
+	/*
+	 * Mailbox notifications are dispatched from the ioeventfd epoll loop
+	 * (see pmm.c). Unless this thread is asked to busy-poll the queues,
+	 * there is nothing left to do here but to wait for the signal that
+	 * tears the PMM down.
+	 */
+	if (kvm->cfg.pmm_poll)
+		pmm__poll(kvm);
 
-        if (r < 0) {
-            if (do_debug_print)
-                printf("lx: %s:%d - select error\n", __FUNCTION__, __LINE__);
-			continue;
-		}
-
-        if (FD_ISSET(fd, &read_fd)) {
-            read(fd, &sval, sizeof(sval));
-        }
-		kvm__emulate_mmio(&cpu,	0xe0000000,	data, 1, 1);
-	}
+	for (;;)
+		pause();
 
-	return (void *) (intptr_t) 0;
+	return NULL;
 }
 #endif
 
@@ -786,6 +795,18 @@ do {} while (0);
     if (!kvm->cfg.transport) {
         kvm->cfg.transport = "";
     }
+
+	if (kvm->cfg.pmm_loopback && !kvm->cfg.pmm)
+		die("--pmm-loopback requires --pmm");
+
+	pmm__setup_windows(kvm);
+
+	if (kvm->cfg.pmm_poll < 0 || (kvm->cfg.pmm_poll && !kvm->cfg.pmm))
+		die("--pmm-poll requires --pmm and a positive idle threshold");
+
+	if (kvm->cfg.pmm_shmem_clear < 0 ||
+	    (kvm->cfg.pmm_shmem_clear && !kvm->cfg.pmm))
+		die("--shmem-clear requires --pmm and a positive thread count");
 #endif
 
 	if (init_list__init(kvm) < 0)
@@ -829,11 +850,6 @@ static void kvm_cmd_run_exit(struct kvm *kvm, int guest_ret)
 
 	init_list__exit(kvm);
 
-#ifdef RSLD
-	if (kvm->notif_fd > 0)
-		close(kvm->notif_fd);
-#endif
-
 #ifdef NO_TERSE
 	if (guest_ret == 0)
 		printf("\n  # KVM session ended normally.\n");
@@ -4,15 +4,21 @@
 #include <kvm/kvm.h>
 #include <kvm/parse-options.h>
 #include <kvm/kvm-ipc.h>
+#include <kvm/read-write.h>
+#include <kvm/virtio.h>
 
 #include <sys/select.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <signal.h>
 
 #include <linux/virtio_balloon.h>
+#include <linux/virtio_ids.h>
 
 static bool mem;
+static bool virtio;
+static bool vtrace;
 static bool all;
 static const char *instance_name;
 
@@ -24,6 +30,9 @@ static const char * const stat_usage[] = {
 static const struct option stat_options[] = {
 	OPT_GROUP("Commands options:"),
 	OPT_BOOLEAN('m', "memory", &mem, "Display memory statistics"),
+	OPT_BOOLEAN('\0', "virtio", &virtio, "Display virtio queue statistics"),
+	OPT_BOOLEAN('\0', "virtio-trace", &vtrace,
+		    "Display virtio queue latencies (lkvm run --virtio-trace)"),
 	OPT_GROUP("Instance options:"),
 	OPT_BOOLEAN('a', "all", &all, "All instances"),
 	OPT_STRING('n', "name", &instance_name, "name", "Instance name"),
@@ -97,6 +106,191 @@ static int do_memstat(const char *name, int sock)
 	return 0;
 }
 
+static const char *virtio_type_name(u32 type)
+{
+	switch (type) {
+	case VIRTIO_ID_NET:
+		return "net";
+	case VIRTIO_ID_BLOCK:
+		return "blk";
+	case VIRTIO_ID_CONSOLE:
+		return "console";
+	case VIRTIO_ID_RNG:
+		return "rng";
+	case VIRTIO_ID_BALLOON:
+		return "balloon";
+	case VIRTIO_ID_SCSI:
+		return "scsi";
+	case VIRTIO_ID_9P:
+		return "9p";
+	case VIRTIO_ID_VSOCK:
+		return "vsock";
+	}
+	return "unknown";
+}
+
+static int do_virtiostat(const char *name, int sock)
+{
+	struct virtio_vq_stat st;
+	struct virt_queue_stats *s = &st.stats;
+	u32 count, i;
+	int r;
+
+	r = kvm_ipc__send(sock, KVM_IPC_VIRTIO_STAT);
+	if (r < 0)
+		return r;
+
+	r = read_in_full(sock, &count, sizeof(count));
+	if (r != sizeof(count)) {
+		pr_err("Could not retrieve virtio stats from %s", name);
+		return -1;
+	}
+
+	printf("\n\t*** Virtio queue statistics of %s ***\n\n", name);
+	printf("%-14s %5s %10s %8s %12s %12s %10s %10s %10s %10s %8s\n",
+	       "device", "queue", "requests", "desc/req", "bytes out",
+	       "bytes in", "kicks", "no kick", "irqs", "no irq", "full");
+
+	for (i = 0; i < count; i++) {
+		r = read_in_full(sock, &st, sizeof(st));
+		if (r != sizeof(st))
+			return -1;
+
+		printf("%-10s %3u %5u %10llu %8.2f %12llu %12llu %10llu %10llu %10llu %10llu %8llu\n",
+		       virtio_type_name(st.type), st.dev, st.queue,
+		       (unsigned long long)s->requests,
+		       s->requests ? (double)s->descs / s->requests : 0,
+		       (unsigned long long)s->bytes_out,
+		       (unsigned long long)s->bytes_in,
+		       (unsigned long long)s->notify,
+		       (unsigned long long)s->notify_suppressed,
+		       (unsigned long long)s->irq,
+		       (unsigned long long)s->irq_suppressed,
+		       (unsigned long long)s->ring_full);
+	}
+	printf("\n");
+
+	return 0;
+}
+
+static const char * const virtio_trace_names[VIRTIO_TRACE_NR] = {
+	[VIRTIO_TRACE_KICK]	= "kick",
+	[VIRTIO_TRACE_NOTIFY]	= "notify",
+	[VIRTIO_TRACE_POP]	= "pop",
+	[VIRTIO_TRACE_USED]	= "used",
+	[VIRTIO_TRACE_SIGNAL]	= "signal",
+};
+
+/* What the histogram of each point measures */
+static const char * const virtio_trace_spans[VIRTIO_TRACE_NR] = {
+	[VIRTIO_TRACE_KICK]	= "kick to signal",
+	[VIRTIO_TRACE_NOTIFY]	= "kick to device",
+	[VIRTIO_TRACE_POP]	= "device to backend",
+	[VIRTIO_TRACE_USED]	= "backend processing",
+	[VIRTIO_TRACE_SIGNAL]	= "used to signal",
+};
+
+static void print_trace_hist(struct virtio_trace_hist *h)
+{
+	u64 total;
+	int p, i;
+
+	for (p = 0; p < VIRTIO_TRACE_NR; p++) {
+		total = 0;
+		for (i = 0; i < VIRTIO_TRACE_BUCKETS; i++)
+			total += h->buckets[p][i];
+		if (!total)
+			continue;
+
+		printf("%s %u queue %u, %s (%llu):\n",
+		       virtio_type_name(h->type), h->dev, h->queue,
+		       virtio_trace_spans[p], (unsigned long long)total);
+		for (i = 0; i < VIRTIO_TRACE_BUCKETS; i++) {
+			if (h->buckets[p][i])
+				printf("\t< %12llu ns: %llu\n", 1ULL << i,
+				       (unsigned long long)h->buckets[p][i]);
+		}
+	}
+}
+
+static int cmp_trace_event(const void *a, const void *b)
+{
+	const struct virtio_trace_event *ea = a, *eb = b;
+
+	return (ea->ts > eb->ts) - (ea->ts < eb->ts);
+}
+
+static int do_virtiotrace(const char *name, int sock)
+{
+	struct virtio_trace_event *events;
+	struct virtio_trace_hist h;
+	u32 count, i;
+	int r;
+
+	r = kvm_ipc__send(sock, KVM_IPC_VIRTIO_TRACE);
+	if (r < 0)
+		return r;
+
+	r = read_in_full(sock, &count, sizeof(count));
+	if (r != sizeof(count)) {
+		pr_err("Could not retrieve virtio trace from %s", name);
+		return -1;
+	}
+
+	printf("\n\t*** Virtio queue latencies of %s ***\n\n", name);
+	for (i = 0; i < count; i++) {
+		r = read_in_full(sock, &h, sizeof(h));
+		if (r != sizeof(h))
+			return -1;
+		print_trace_hist(&h);
+	}
+
+	r = read_in_full(sock, &count, sizeof(count));
+	if (r != sizeof(count))
+		return -1;
+
+	events = calloc(count, sizeof(*events));
+	if (!events)
+		return -ENOMEM;
+
+	r = read_in_full(sock, events, count * sizeof(*events));
+	if (r != (int)(count * sizeof(*events))) {
+		free(events);
+		return -1;
+	}
+
+	qsort(events, count, sizeof(*events), cmp_trace_event);
+
+	printf("\n\t*** Latest virtio events of %s ***\n\n", name);
+	for (i = 0; i < count; i++)
+		printf("%llu.%09llu [%u] %s %u queue %u: %s\n",
+		       (unsigned long long)events[i].ts / 1000000000ULL,
+		       (unsigned long long)events[i].ts % 1000000000ULL,
+		       events[i].tid, virtio_type_name(events[i].type),
+		       events[i].dev, events[i].queue,
+		       events[i].point < VIRTIO_TRACE_NR ?
+		       virtio_trace_names[events[i].point] : "?");
+	printf("\n");
+
+	free(events);
+
+	return 0;
+}
+
+static int do_stat(const char *name, int sock)
+{
+	int r = 0;
+
+	if (mem)
+		r = do_memstat(name, sock);
+	if (r == 0 && virtio)
+		r = do_virtiostat(name, sock);
+	if (r == 0 && vtrace)
+		r = do_virtiotrace(name, sock);
+
+	return r;
+}
+
 int kvm_cmd_stat(int argc, const char **argv, const char *prefix)
 {
 	int instance;
@@ -104,11 +298,11 @@ int kvm_cmd_stat(int argc, const char **argv, const char *prefix)
 
 	parse_stat_options(argc, argv);
 
-	if (!mem)
+	if (!mem && !virtio && !vtrace)
 		usage_with_options(stat_usage, stat_options);
 
-	if (mem && all)
-		return kvm__enumerate_instances(do_memstat);
+	if (all)
+		return kvm__enumerate_instances(do_stat);
 
 	if (instance_name == NULL)
 		kvm_stat_help();
@@ -118,8 +312,7 @@ int kvm_cmd_stat(int argc, const char **argv, const char *prefix)
 	if (instance <= 0)
 		die("Failed locating instance");
 
-	if (mem)
-		r = do_memstat(instance_name, instance);
+	r = do_stat(instance_name, instance);
 
 	close(instance);
 
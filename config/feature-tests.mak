@@ -167,6 +167,42 @@ int main(void)
 }
 endef
 
+define SOURCE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+
+int main(void)
+{
+	struct io_uring_sqe sqe = {
+		.opcode		= IORING_OP_READ_FIXED,
+		.len		= IORING_POLL_ADD_MULTI,
+	};
+
+	return __NR_io_uring_setup + sqe.len;
+}
+endef
+
+define SOURCE_AF_XDP
+#include <linux/bpf.h>
+#include <linux/if_xdp.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+int main(void)
+{
+	union bpf_attr attr = {
+		.link_create.attach_type	= BPF_XDP,
+	};
+	struct sockaddr_xdp sxdp = {
+		.sxdp_family	= AF_XDP,
+		.sxdp_flags	= XDP_USE_NEED_WAKEUP,
+	};
+
+	return __NR_bpf + BPF_MAP_TYPE_XSKMAP + attr.link_create.attach_type +
+	       sxdp.sxdp_family + sxdp.sxdp_flags;
+}
+endef
+
 define SOURCE_STATIC
 #include <stdlib.h>
 
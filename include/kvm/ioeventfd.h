@@ -23,11 +23,14 @@ struct ioevent {
 
 #define IOEVENTFD_FLAG_PIO		(1 << 0)
 #define IOEVENTFD_FLAG_USER_POLL	(1 << 1)
+/* The callback consumes the event itself (e.g. a non-eventfd fd) */
+#define IOEVENTFD_FLAG_NO_READ		(1 << 2)
 
 int ioeventfd__init(struct kvm *kvm);
 int ioeventfd__exit(struct kvm *kvm);
 int ioeventfd__add_event(struct ioevent *ioevent, int flags);
 int ioeventfd__del_event(u64 addr, u64 datamatch);
 int ioeventfd__add_epoll_event(struct ioevent *ioev, int event);
+void ioeventfd__del_epoll_event(struct ioevent *ioev);
 
 #endif
@@ -18,6 +18,51 @@
 #define MIN_RAM_SIZE_MB		(64ULL)
 #define MIN_RAM_SIZE_BYTE	(MIN_RAM_SIZE_MB << MB_SHIFT)
 
+#ifdef RSLD
+/* Per virtio device ID settings of the PMM, ID 0 applies to all devices */
+#define PMM_MAX_DEVICE_ID	32
+
+struct pmm_coalesce {
+	bool	set;
+	u32	usecs;
+	u32	frames;
+};
+
+struct pmm_shm_region {
+	bool	set;
+	u64	size;
+	u64	align;
+};
+
+struct pmm_shm_bufs {
+	bool	set;
+	u32	nr;
+	u32	size;
+};
+
+/* Shared memory windows, window 0 is the one of --shmem-addr/--shmem-size */
+#define PMM_MAX_WINDOWS		8
+
+struct pmm_shm_window {
+	u64		phys_addr;
+	u64		size;
+	int		uio;		/* UIO device and map backing it */
+	int		uio_map;
+	int		node;		/* NUMA node it is close to, or -1 */
+	const char	*cpus;		/* host CPUs serving it */
+};
+
+struct pmm_shm_bind {
+	bool	set;
+	u32	window;
+};
+
+struct pmm_worker_cpus {
+	bool		set;
+	const char	*cpus;		/* CPU list, NULL to leave unpinned */
+};
+#endif
+
 struct kvm_config {
 	struct kvm_config_arch arch;
 	struct disk_image_params disk_image[MAX_DISK_IMAGES];
@@ -27,6 +72,10 @@ struct kvm_config {
 	u8 num_net_devices;
 	u8 num_vfio_devices;
 	bool virtio_rng;
+	bool virtio_modern;
+	bool virtio_trace;
+	/* Guest memory is backed by files that can be passed to backends */
+	bool mem_shared;
 	int active_console;
 	int debug_iodelay;
 	int nrcpus;
@@ -74,6 +123,16 @@ struct kvm_config {
     u64 hvl_shmem_size;
     bool vproxy;
     bool no_dtb;
+	const char *pmm_loopback;
+	int pmm_poll;
+	int pmm_shmem_clear;
+	struct pmm_coalesce pmm_coalesce[PMM_MAX_DEVICE_ID];
+	struct pmm_shm_region pmm_shm[PMM_MAX_DEVICE_ID];
+	struct pmm_shm_bufs pmm_shm_bufs[PMM_MAX_DEVICE_ID];
+	struct pmm_shm_window pmm_windows[PMM_MAX_WINDOWS];
+	int nr_pmm_windows;
+	struct pmm_shm_bind pmm_shm_bind[PMM_MAX_DEVICE_ID];
+	struct pmm_worker_cpus pmm_workers[PMM_MAX_DEVICE_ID];
 #endif
 };
 
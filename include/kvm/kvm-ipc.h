@@ -13,6 +13,8 @@ enum {
 	KVM_IPC_STOP	= 6,
 	KVM_IPC_PID	= 7,
 	KVM_IPC_VMSTATE	= 8,
+	KVM_IPC_VIRTIO_STAT	= 9,
+	KVM_IPC_VIRTIO_TRACE	= 10,
 };
 
 int kvm_ipc__register_handler(u32 type, void (*cb)(struct kvm *kvm,
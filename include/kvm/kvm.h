@@ -62,6 +62,26 @@ struct kvm_mem_bank {
 	u32			slot;
 };
 
+#define KVM_MEM_MAP_MAX		64
+
+struct kvm_mem_map_entry {
+	u64			start;
+	u64			end;
+	void			*host_addr;
+};
+
+/*
+ * Banks with a host mapping, sorted by guest address, for the lockless
+ * lookups of guest_flat_to_host(). The sequence count is odd while the map
+ * is rebuilt. Past KVM_MEM_MAP_MAX banks, lookups walk mem_banks instead.
+ */
+struct kvm_mem_map {
+	u32			seq;
+	u32			nr;
+	bool			overflow;
+	struct kvm_mem_map_entry entries[KVM_MEM_MAP_MAX];
+};
+
 struct kvm {
 	struct kvm_arch		arch;
 	struct kvm_config	cfg;
@@ -78,6 +98,7 @@ struct kvm {
 	u64			ram_pagesize;
 	struct mutex		mem_banks_lock;
 	struct list_head	mem_banks;
+	struct kvm_mem_map	mem_map;
 
 	bool			nmi_disabled;
 	bool			msix_needs_devid;
@@ -96,6 +117,10 @@ struct kvm {
 	void *shmem_start;
 	pthread_t pmm_thread;
     int notif_fd;
+	int			doorbell_fd;	/* remote -> PMM mailbox */
+	/* Host mapping of each shared memory window, the first is shmem_start */
+	void			*shmem_windows[PMM_MAX_WINDOWS];
+	int			shmem_fds[PMM_MAX_WINDOWS];	/* memfds of the loopback windows */
 #endif
 };
 
@@ -161,6 +186,7 @@ bool kvm__arch_cpu_supports_vm(void);
 void kvm__arch_read_term(struct kvm *kvm);
 
 void *guest_flat_to_host(struct kvm *kvm, u64 offset);
+void *guest_flat_to_host_range(struct kvm *kvm, u64 offset, u64 len);
 u64 host_to_guest_flat(struct kvm *kvm, void *ptr);
 
 bool kvm__arch_load_kernel_image(struct kvm *kvm, int fd_kernel, int fd_initrd,
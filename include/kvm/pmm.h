@@ -0,0 +1,84 @@
+#ifndef KVM__PMM_H
+#define KVM__PMM_H
+
+#include "kvm/kvm-config.h"
+
+#include <linux/types.h>
+
+#include <sched.h>
+
+/*
+ * Writing to this address dispatches a hypervisorless notification to every
+ * virtio-mmio device backed by the shared memory pool.
+ */
+#define PMM_NOTIFY_ADDR		0xe0000000
+
+#define PMM_MBOX_DEV		"/dev/umb"
+#define PMM_UIO_DEV		"/dev/uio%d"
+/* Default buffer size of --shmem-bufs: an MTU sized frame and its header */
+#define PMM_BUF_SIZE		2048
+
+#define PMM_UIO_MAP_SIZE	"/sys/class/uio/uio%d/maps/map%d/size"
+#define PMM_NODE_CPULIST	"/sys/devices/system/node/node%d/cpulist"
+
+/*
+ * Loopback transport: a frontend connecting to the --pmm-loopback socket
+ * receives this header along with the fds (SCM_RIGHTS), in order: the memfd
+ * backing shared memory window 0, the eventfd it writes to ring the PMM
+ * doorbell, the eventfd the PMM writes to notify it, then the memfds of the
+ * other windows. Version 1 frontends only know of the first window and
+ * ignore the rest of the header.
+ */
+#define PMM_LOOPBACK_MAGIC	0x4c4d4d50	/* 'PMML' */
+#define PMM_LOOPBACK_VERSION	2
+#define PMM_LOOPBACK_NR_FDS	3
+#define PMM_LOOPBACK_MAX_FDS	(PMM_LOOPBACK_NR_FDS + PMM_MAX_WINDOWS - 1)
+
+struct pmm_loopback_info {
+	u32	magic;
+	u32	version;
+	u64	shmem_phys_addr;
+	u64	shmem_size;
+	u32	nr_windows;
+	u32	reserved;
+	struct {
+		u64	phys_addr;
+		u64	size;
+	} windows[PMM_MAX_WINDOWS];
+};
+
+/* datamatch values of the PMM ioevents, which all sit on PMM_NOTIFY_ADDR */
+enum {
+	PMM_IOEVENT_DOORBELL,
+	PMM_IOEVENT_LOOPBACK,
+	PMM_IOEVENT_COALESCE,
+};
+
+struct kvm;
+struct kvm_cpu;
+struct option;
+struct pmm_worker;
+
+int pmm__init_shmem(struct kvm *kvm);
+int pmm__init(struct kvm *kvm);
+int pmm__exit(struct kvm *kvm);
+void pmm__dispatch(struct kvm *kvm);
+void pmm__poll(struct kvm *kvm);
+void pmm__phase(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+int pmm__coalesce_parser(const struct option *opt, const char *arg, int unset);
+int pmm__shm_region_parser(const struct option *opt, const char *arg, int unset);
+int pmm__shm_bufs_parser(const struct option *opt, const char *arg, int unset);
+int pmm__shm_window_parser(const struct option *opt, const char *arg, int unset);
+int pmm__shm_bind_parser(const struct option *opt, const char *arg, int unset);
+void pmm__setup_windows(struct kvm *kvm);
+unsigned int pmm__device_window(struct kvm *kvm, u32 device_id);
+bool pmm__enter_window(struct kvm *kvm, unsigned int window, cpu_set_t *saved);
+void pmm__leave_window(cpu_set_t *saved);
+int pmm__worker_parser(const struct option *opt, const char *arg, int unset);
+struct pmm_worker *pmm__worker_new(struct kvm *kvm, u32 device_id,
+				   void (*fn)(struct kvm_cpu *vcpu, void *arg),
+				   void *arg);
+void pmm__worker_kick(struct pmm_worker *worker);
+void pmm__worker_free(struct pmm_worker *worker);
+
+#endif /* KVM__PMM_H */
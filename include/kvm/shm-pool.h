@@ -0,0 +1,98 @@
+#ifndef KVM__SHM_POOL_H
+#define KVM__SHM_POOL_H
+
+#include <linux/types.h>
+#include <linux/list.h>
+
+/*
+ * Allocator for the hypervisorless shared memory pool. Fixed carve-outs (the
+ * DTB, or the device headers with --no-dtb) sit at the low end of the pool,
+ * device regions are carved top-down below the topmost page, which publishes
+ * a map of every region to the remote side. Each shared memory window (see
+ * --shmem-window) is a pool of its own, with its own map page.
+ */
+#define SHM_POOL_PAGE_SIZE	0x1000ULL
+#define SHM_POOL_HUGE_SIZE	0x200000ULL
+
+enum shm_region_type {
+	SHM_REGION_MAP		= 1,
+	SHM_REGION_DTB		= 2,
+	SHM_REGION_HEADER	= 3,
+	SHM_REGION_DEVICE	= 4,
+	SHM_REGION_BUFFERS	= 5,
+};
+
+#define SHM_POOL_MAP_MAGIC	0x534d4d50	/* 'PMMS' */
+#define SHM_POOL_MAP_VERSION	1
+
+struct shm_pool_map_entry {
+	u64	phys;
+	u64	size;
+	u32	type;
+	u32	device_id;
+};
+
+/*
+ * The map lives in the last page of the pool. Like the device headers, it is
+ * guarded by a sequence count that is odd while an update is in progress.
+ */
+struct shm_pool_map {
+	u32	magic;
+	u32	version;
+	u32	generation;
+	u32	nr_entries;
+	struct shm_pool_map_entry entries[];
+};
+
+#define SHM_POOL_MAP_MAX_ENTRIES					\
+	((SHM_POOL_PAGE_SIZE - sizeof(struct shm_pool_map)) /		\
+	 sizeof(struct shm_pool_map_entry))
+
+/*
+ * Buffer pool of a device: nr_bufs buffers of buf_size bytes, cache line
+ * aligned, starting at bufs. Free buffers are kept on a LIFO list that the
+ * driver pops and pushes with a 64-bit compare-and-swap:
+ * free_head holds the index + 1 of the first free buffer (0 when the pool is
+ * empty) in its low half and a tag bumped by every update, against ABA, in
+ * its high half. next[i] is the index + 1 of the buffer following i.
+ *
+ * After a reset, the driver sets state to SHM_BUF_POOL_RESET and rings the
+ * doorbell. The PMM then puts every buffer back on the list, sets state to
+ * SHM_BUF_POOL_READY and notifies the driver, which must not touch the list
+ * in between.
+ */
+#define SHM_BUF_POOL_MAGIC	0x424d4d50	/* 'PMMB' */
+#define SHM_BUF_POOL_ALIGN	64
+
+enum shm_buf_pool_state {
+	SHM_BUF_POOL_READY	= 1,
+	SHM_BUF_POOL_RESET	= 2,
+};
+
+struct shm_buf_pool {
+	u32	magic;
+	u32	state;
+	u32	buf_size;
+	u32	nr_bufs;
+	u64	bufs;
+	u64	free_head;
+	u32	next[];
+};
+
+struct kvm;
+
+u64 shm_pool__alloc(struct kvm *kvm, unsigned int window, u64 size, u64 align,
+		    u32 type, u32 device_id, void *owner);
+int shm_pool__reserve(struct kvm *kvm, u64 phys, u64 size, u32 type,
+		      u32 device_id, void *owner);
+void shm_pool__release(struct kvm *kvm, void *owner);
+void *shm_pool__to_host(struct kvm *kvm, u64 phys);
+int shm_pool__clear_free(struct kvm *kvm, unsigned int nr_threads);
+int shm_pool__exit(struct kvm *kvm);
+
+struct shm_buf_pool *shm_pool__alloc_bufs(struct kvm *kvm, unsigned int window,
+					  u32 nr_bufs, u32 buf_size,
+					  u32 device_id, void *owner, u64 *phys);
+void shm_buf_pool__reset(struct shm_buf_pool *pool);
+
+#endif /* KVM__SHM_POOL_H */
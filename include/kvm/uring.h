@@ -0,0 +1,51 @@
+#ifndef KVM__URING_H
+#define KVM__URING_H
+
+#include <linux/types.h>
+#include <linux/posix_types.h>
+#include <linux/stddef.h>
+#include <linux/io_uring.h>
+
+#include <sys/uio.h>
+
+/*
+ * A bare io_uring instance, driven through the system calls since liburing
+ * is not required. Submission entries are filled with uring__get_sqe() and
+ * handed to the kernel together by uring__submit().
+ */
+struct uring {
+	int			fd;
+	unsigned int		sq_entries;
+
+	/* Submission ring, shared with the kernel */
+	unsigned int		*sq_head;
+	unsigned int		*sq_tail;
+	unsigned int		*sq_mask;
+	unsigned int		*sq_array;
+	struct io_uring_sqe	*sqes;
+	/* Entries filled but not yet submitted */
+	unsigned int		sq_pending;
+
+	/* Completion ring */
+	unsigned int		*cq_head;
+	unsigned int		*cq_tail;
+	unsigned int		*cq_mask;
+	struct io_uring_cqe	*cqes;
+
+	void			*sq_ring;
+	size_t			sq_ring_size;
+	void			*cq_ring;
+	size_t			cq_ring_size;
+	size_t			sqes_size;
+};
+
+int uring__init(struct uring *ring, unsigned int entries);
+void uring__exit(struct uring *ring);
+struct io_uring_sqe *uring__get_sqe(struct uring *ring);
+int uring__submit(struct uring *ring, unsigned int wait_nr);
+struct io_uring_cqe *uring__peek_cqe(struct uring *ring);
+void uring__cqe_seen(struct uring *ring);
+int uring__register_buffers(struct uring *ring, const struct iovec *iov,
+			    unsigned int nr);
+
+#endif /* KVM__URING_H */
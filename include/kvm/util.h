@@ -136,5 +136,6 @@ static inline int pow2_size(unsigned long x)
 struct kvm;
 void *mmap_hugetlbfs(struct kvm *kvm, const char *htlbfs_path, u64 size);
 void *mmap_anon_or_hugetlbfs(struct kvm *kvm, const char *hugetlbfs_path, u64 size);
+int mmap_shared_fd(void *addr, u64 *offset);
 
 #endif /* KVM__UTIL_H */
@@ -0,0 +1,89 @@
+#ifndef KVM__VHOST_USER_H
+#define KVM__VHOST_USER_H
+
+#include "kvm/mutex.h"
+
+#include <linux/types.h>
+#include <linux/vhost.h>
+
+struct kvm;
+struct virt_queue;
+
+/* The requests of the vhost-user protocol sent by kvmtool */
+enum vhost_user_request {
+	VHOST_USER_GET_FEATURES			= 1,
+	VHOST_USER_SET_FEATURES			= 2,
+	VHOST_USER_SET_OWNER			= 3,
+	VHOST_USER_SET_MEM_TABLE		= 5,
+	VHOST_USER_SET_VRING_NUM		= 8,
+	VHOST_USER_SET_VRING_ADDR		= 9,
+	VHOST_USER_SET_VRING_BASE		= 10,
+	VHOST_USER_GET_VRING_BASE		= 11,
+	VHOST_USER_SET_VRING_KICK		= 12,
+	VHOST_USER_SET_VRING_CALL		= 13,
+	VHOST_USER_GET_PROTOCOL_FEATURES	= 15,
+	VHOST_USER_SET_PROTOCOL_FEATURES	= 16,
+	VHOST_USER_GET_QUEUE_NUM		= 17,
+	VHOST_USER_SET_VRING_ENABLE		= 18,
+};
+
+#define VHOST_USER_VERSION		0x1
+#define VHOST_USER_FLAG_REPLY		(1 << 2)
+
+/* A virtio feature bit, which makes the rings start disabled */
+#define VHOST_USER_F_PROTOCOL_FEATURES	30
+#define VHOST_USER_PROTOCOL_F_MQ	0
+
+#define VHOST_USER_MAX_REGIONS		8
+
+struct vhost_user_region {
+	u64	guest_phys_addr;
+	u64	memory_size;
+	u64	userspace_addr;
+	u64	mmap_offset;
+};
+
+struct vhost_user_msg {
+	u32	request;
+	u32	flags;
+	/* Of the payload */
+	u32	size;
+	union {
+		u64				u64;
+		struct vhost_vring_state	state;
+		struct vhost_vring_addr		addr;
+		struct {
+			u32			nregions;
+			u32			padding;
+			struct vhost_user_region regions[VHOST_USER_MAX_REGIONS];
+		} memory;
+	} payload;
+} __attribute__((packed));
+
+#define VHOST_USER_HDR_SIZE	offsetof(struct vhost_user_msg, payload)
+
+/*
+ * The connection to a vhost-user backend, which runs the datapath of the
+ * device in its own process. The guest memory is passed as fds, so it must
+ * be shared (see kvm_config.mem_shared).
+ */
+struct vhost_user {
+	int		sock;
+	struct mutex	mutex;
+	/* Offered by the backend */
+	u64		features;
+	u64		protocol_features;
+	/* Of queue pairs, from GET_QUEUE_NUM */
+	u32		queue_num;
+};
+
+int vhost_user__init(struct vhost_user *vu, const char *path);
+void vhost_user__exit(struct vhost_user *vu);
+int vhost_user__set_features(struct vhost_user *vu, u64 features);
+int vhost_user__set_mem_table(struct vhost_user *vu, struct kvm *kvm);
+int vhost_user__start_vring(struct vhost_user *vu, u32 index,
+			    struct virt_queue *vq, int kick_fd, int call_fd);
+int vhost_user__stop_vring(struct vhost_user *vu, u32 index);
+int vhost_user__set_vring_call(struct vhost_user *vu, u32 index, int fd);
+
+#endif /* KVM__VHOST_USER_H */
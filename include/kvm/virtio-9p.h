@@ -49,7 +49,7 @@ struct p9_dev {
     u32			config_size;
     u32			mem_size;
 #endif
-	u32			features;
+	u64			features;
 
 	/* virtio queue */
 	struct virt_queue	vqs[NUM_VIRT_QUEUES];
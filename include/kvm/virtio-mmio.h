@@ -2,13 +2,57 @@
 #define KVM__VIRTIO_MMIO_H
 
 #include <linux/types.h>
+#include <linux/list.h>
+#include <stdbool.h>
 #include <linux/virtio_mmio.h>
 
 #define VIRTIO_MMIO_MAX_VQ	32
 #define VIRTIO_MMIO_MAX_CONFIG	1
 #define VIRTIO_MMIO_IO_SIZE	0x200
 
+#ifdef RSLD
+/* Driver-side sequence count guarding updates of the shared header */
+#define VIRTIO_MMIO_HVL_GENERATION	0x0c4
+/* Hypervisorless extensions offered by the device / accepted by the driver */
+#define VIRTIO_MMIO_HVL_FEATURES	0x0c8
+#define VIRTIO_MMIO_HVL_DRIVER_FEATURES	0x0cc
+/* Bitmap of the queues the driver kicked since the last doorbell */
+#define VIRTIO_MMIO_HVL_PENDING_VQS	0x0d0
+/* Physical address of the device buffer pool, see shm-pool.h */
+#define VIRTIO_MMIO_HVL_BUF_POOL	0x0d4
+/*
+ * Feature bits 32 to 63 of version 2 devices. The shared header cannot
+ * switch host_features and guest_features between words on a write to their
+ * selectors, so the upper words have slots of their own.
+ */
+#define VIRTIO_MMIO_HVL_HOST_FEATURES_HIGH	0x0dc
+#define VIRTIO_MMIO_HVL_GUEST_FEATURES_HIGH	0x0e0
+
+/* The driver sets its bit in pending_vqs before ringing the doorbell */
+#define VIRTIO_MMIO_HVL_F_DOORBELL	(1 << 0)
+/* Data buffers can be taken from the pool at buf_pool */
+#define VIRTIO_MMIO_HVL_F_BUF_POOL	(1 << 1)
+/*
+ * Queues use the packed layout (VIRTIO_F_RING_PACKED), which legacy feature
+ * bits cannot express: the descriptor ring at the queue address, followed
+ * by the driver and then the device event suppression structures.
+ */
+#define VIRTIO_MMIO_HVL_F_RING_PACKED	(1 << 2)
+
+/*
+ * Written by the device over queue_pfn or queue_ready once the queue is set
+ * up, or after a reset, and followed by a notification.
+ */
+#define HVL_CFG_ACK			0xAABBAABB
+
+/* Attempts at reading a consistent copy of the shared header */
+#define VIRTIO_MMIO_SNAPSHOT_RETRIES	16
+#endif
+
 struct kvm;
+struct kvm_cpu;
+struct shm_buf_pool;
+struct pmm_worker;
 
 struct virtio_mmio_ioevent_param {
 	struct virtio_device	*vdev;
@@ -32,20 +76,39 @@ struct virtio_mmio_hdr {
 	u32	queue_num;
 	u32	queue_align;
 	u32	queue_pfn;
-	u32	reserved_3[3];
+	u32	queue_ready;
+	u32	reserved_3[2];
 	u32	queue_notify;
 	u32	reserved_4[3];
 	u32	interrupt_state;
 	u32	interrupt_ack;
 	u32	reserved_5[2];
 	u32	status;
+	u32	reserved_6[3];
+	u32	queue_desc_low;
+	u32	queue_desc_high;
+	u32	reserved_7[2];
+	u32	queue_avail_low;
+	u32	queue_avail_high;
+	u32	reserved_8[2];
+	u32	queue_used_low;
+	u32	queue_used_high;
+	u32	reserved_9;
 #ifdef RSLD
-	u32	reserved_6[14];
 	u32	shm_sel;
 	u32	shm_len_low;
 	u32	shm_len_high;
 	u32	shm_base_low;
 	u32	shm_base_high;
+	u32	reserved_10;
+	u32	generation;	/* driver-side sequence count, odd while updating */
+	u32	hvl_features;
+	u32	hvl_driver_features;
+	u32	pending_vqs;
+	u32	buf_pool_low;
+	u32	buf_pool_high;
+	u32	host_features_high;
+	u32	guest_features_high;
 #endif
 } __attribute__((packed));
 
@@ -59,6 +122,19 @@ struct virtio_mmio {
 #ifdef RSLD
 	struct virtio_mmio_hdr	*static_hdr;
     u8 num_vqs;
+	struct virtio_device	*vdev;
+	struct list_head	hvl_list;
+	u32			hvl_generation;
+	bool			hvl_doorbell;
+	/* Avail index of each queue when the poller last kicked it */
+	u16			hvl_avail_idx[VIRTIO_MMIO_MAX_VQ];
+	/* Signal moderation, see virtio_mmio_hvl_signal() */
+	u32			hvl_coalesce_usecs;
+	u32			hvl_coalesce_frames;
+	u32			hvl_pending_signals;
+	struct shm_buf_pool	*hvl_bufs;
+	unsigned int		hvl_window;	/* shared memory window, see --shmem-bind */
+	struct pmm_worker	*hvl_worker;	/* see --pmm-worker */
 #endif
 	struct virtio_mmio_ioevent_param ioeventfds[VIRTIO_MMIO_MAX_VQ];
 };
@@ -69,4 +145,9 @@ int virtio_mmio_exit(struct kvm *kvm, struct virtio_device *vdev);
 int virtio_mmio_reset(struct kvm *kvm, struct virtio_device *vdev);
 int virtio_mmio_init(struct kvm *kvm, void *dev, struct virtio_device *vdev,
 		      int device_id, int subsys_id, int class);
+#ifdef RSLD
+void virtio_mmio_hvl_notify(struct kvm_cpu *vcpu);
+bool virtio_mmio_hvl_poll(struct kvm_cpu *vcpu);
+bool virtio_mmio_hvl_stop_polling(struct kvm_cpu *vcpu);
+#endif
 #endif
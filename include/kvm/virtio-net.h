@@ -12,6 +12,8 @@ struct virtio_net_params {
 	const char *downscript;
 	const char *trans;
 	const char *tapif;
+	const char *xdpif;
+	const char *socket;
 	char guest_mac[6];
 	char host_mac[6];
 	struct kvm *kvm;
@@ -22,6 +24,9 @@ struct virtio_net_params {
 #endif
 	int fd;
 	int mq;
+	int engine;
+	int xdp_queue;
+	int busy_poll;
 };
 
 int virtio_net__init(struct kvm *kvm);
@@ -30,7 +35,14 @@ int netdev_parser(const struct option *opt, const char *arg, int unset);
 
 enum {
 	NET_MODE_USER,
-	NET_MODE_TAP
+	NET_MODE_TAP,
+	NET_MODE_XDP,
+	NET_MODE_VHOST_USER
+};
+
+enum {
+	NET_ENGINE_THREAD,
+	NET_ENGINE_URING
 };
 
 #endif /* KVM__VIRTIO_NET_H */
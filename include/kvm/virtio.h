@@ -43,9 +43,107 @@
 /* Stop the device */
 #define VIRTIO__STATUS_STOP		(1 << 9)
 
+/*
+ * Where the driver placed the rings of a queue, as recorded by the transport
+ * before it calls init_vq()
+ */
+struct vring_addr {
+	bool			legacy;
+	union {
+		/* Legacy: a single area, laid out by vring_init() */
+		struct {
+			u32	pfn;
+			u32	align;
+			u32	pgsize;
+		};
+		/* Virtio 1.x: each part of the queue on its own */
+		struct {
+			u64	desc;
+			u64	avail;
+			u64	used;
+		};
+	};
+};
+
+/*
+ * Per-queue counters, dumped by KVM_IPC_VIRTIO_STAT. Each of them only has
+ * writers on one side of the queue, the thread that processes it or the
+ * vCPUs kicking it, so they are updated without locks and read as they are.
+ */
+struct virt_queue_stats {
+	u64	requests;		/* buffers popped */
+	u64	descs;			/* descriptors in those buffers */
+	u64	bytes_out;		/* read by the device */
+	u64	bytes_in;		/* written by the device */
+	u64	notify;			/* kicks received */
+	u64	notify_suppressed;	/* buffers that came without a kick */
+	u64	irq;			/* interrupts the driver asked for */
+	u64	irq_suppressed;		/* interrupts it did not need */
+	u64	ring_full;		/* device waited for buffers */
+};
+
+/*
+ * KVM_IPC_VIRTIO_STAT reply: a u32 count followed by that many records, one
+ * per queue of each device. dev numbers the devices in the order they were
+ * created.
+ */
+struct virtio_vq_stat {
+	u32			type;		/* VIRTIO_ID_* */
+	u32			dev;
+	u32			queue;
+	u32			pad;
+	struct virt_queue_stats	stats;
+};
+
+/*
+ * Points of the path of a request timed by --virtio-trace. The histogram of
+ * each point holds the latency from the previous one, the KICK one holds the
+ * whole kick to signal latency.
+ */
+enum virtio_trace_point {
+	VIRTIO_TRACE_KICK,	/* received: trap, eventfd, doorbell or poll */
+	VIRTIO_TRACE_NOTIFY,	/* handed to the device */
+	VIRTIO_TRACE_POP,	/* first buffer taken by the backend */
+	VIRTIO_TRACE_USED,	/* used elements published */
+	VIRTIO_TRACE_SIGNAL,	/* driver interrupted */
+	VIRTIO_TRACE_NR,
+};
+
+/* Bucket n counts latencies of less than 2^n ns */
+#define VIRTIO_TRACE_BUCKETS	32
+
+/*
+ * KVM_IPC_VIRTIO_TRACE reply: a u32 count and that many histograms, one per
+ * queue, then a u32 count and that many of the latest events of each thread.
+ */
+struct virtio_trace_hist {
+	u32	type;		/* VIRTIO_ID_* */
+	u32	dev;
+	u32	queue;
+	u32	pad;
+	u64	buckets[VIRTIO_TRACE_NR][VIRTIO_TRACE_BUCKETS];
+};
+
+struct virtio_trace_event {
+	u64	ts;		/* CLOCK_MONOTONIC ns */
+	u32	tid;
+	u32	type;
+	u32	dev;
+	u16	queue;
+	u16	point;
+};
+
+struct virtio_trace_vq;
+
+/* Where the buffer with a given ID sits in a packed ring */
+struct virt_queue_packed_buf {
+	u16	pos;		/* ring index of its first descriptor */
+	u16	ndesc;		/* descriptors it takes in the ring */
+};
+
 struct virt_queue {
 	struct vring	vring;
-	u32		pfn;
+	struct vring_addr vring_addr;
 #ifdef RSLD
 	u32		num;
 #endif
@@ -56,6 +154,45 @@ struct virt_queue {
 	u16		endian;
 	bool		use_event_idx;
 	bool		enabled;
+#ifdef RSLD
+	/* Polled by the backend, the driver was asked not to kick */
+	bool		polling;
+#endif
+	/*
+	 * Packed ring layout: descriptors and completions share desc_packed,
+	 * last_avail_idx and last_used_idx are ring indexes and the wrap
+	 * counters flip each time they wrap around. vring.num still holds the
+	 * queue size, the other vring fields are unused.
+	 */
+	bool				packed;
+	bool				avail_wrap;
+	bool				used_wrap;
+	u16				last_used_idx;
+	struct vring_packed_desc	*desc_packed;
+	struct vring_packed_desc_event	*driver_event;
+	struct vring_packed_desc_event	*device_event;
+	struct virt_queue_packed_buf	*packed_bufs;
+	/*
+	 * VIRTIO_F_IN_ORDER: buffers completed through
+	 * virt_queue__set_used_elem_in_order() since the last flush, the
+	 * descriptors they take in a packed ring and the last of them.
+	 */
+	bool				in_order;
+	u16				in_order_pending;
+	u16				in_order_ndesc;
+	u32				in_order_head;
+	u32				in_order_len;
+	/*
+	 * Used elements staged by virt_queue__used_batch_add() and not yet
+	 * published, and the ring slot of the next one in a packed ring.
+	 */
+	u16				used_batch;
+	u16				used_batch_pos;
+	/* Set by a kick, cleared by the next buffer popped */
+	bool				kicked;
+	struct virt_queue_stats		stats;
+	/* Only allocated with --virtio-trace */
+	struct virtio_trace_vq		*trace;
 };
 
 /*
@@ -117,10 +254,40 @@ static inline __u64 __virtio_h2g_u64(u16 endian, __u64 val)
 
 #endif
 
+u16 virt_queue__pop_packed(struct virt_queue *queue);
+bool virt_queue__available_packed(struct virt_queue *vq);
+
+void __virtio_trace(struct virt_queue *vq, enum virtio_trace_point point);
+void virtio_trace__init_vq(struct virt_queue *vq);
+void virtio_trace__reset(struct virt_queue *vq);
+void virtio_trace__wakeup(void);
+
+static inline void virtio_trace(struct virt_queue *vq,
+				enum virtio_trace_point point)
+{
+	if (vq->trace)
+		__virtio_trace(vq, point);
+}
+
+static inline void virt_queue__pop_stat(struct virt_queue *vq)
+{
+	virtio_trace(vq, VIRTIO_TRACE_POP);
+	vq->stats.requests++;
+	if (vq->kicked)
+		vq->kicked = false;
+	else
+		vq->stats.notify_suppressed++;
+}
+
 static inline u16 virt_queue__pop(struct virt_queue *queue)
 {
 	__u16 guest_idx;
 
+	virt_queue__pop_stat(queue);
+
+	if (queue->packed)
+		return virt_queue__pop_packed(queue);
+
 	/*
 	 * The guest updates the avail index after writing the ring entry.
 	 * Ensure that we read the updated entry once virt_queue__available()
@@ -144,7 +311,14 @@ static inline bool virt_queue__available(struct virt_queue *vq)
 	if (!vq->vring.avail)
 		return 0;
 
+	if (vq->packed)
+		return virt_queue__available_packed(vq);
+
+#ifdef RSLD
+	if (vq->use_event_idx && !vq->polling) {
+#else
 	if (vq->use_event_idx) {
+#endif
 		vring_avail_event(&vq->vring) = last_avail_idx;
 		/*
 		 * After the driver writes a new avail index, it reads the event
@@ -157,9 +331,22 @@ static inline bool virt_queue__available(struct virt_queue *vq)
 	return vq->vring.avail->idx != last_avail_idx;
 }
 
+/* The device has data for the driver but no buffer to put it in */
+static inline void virt_queue__ring_full(struct virt_queue *vq)
+{
+	vq->stats.ring_full++;
+}
+
 void virt_queue__used_idx_advance(struct virt_queue *queue, u16 jump);
+#ifdef RSLD
+void virt_queue__set_polling(struct virt_queue *vq, bool polling);
+#endif
 struct vring_used_elem * virt_queue__set_used_elem_no_update(struct virt_queue *queue, u32 head, u32 len, u16 offset);
 struct vring_used_elem *virt_queue__set_used_elem(struct virt_queue *queue, u32 head, u32 len);
+void virt_queue__used_batch_add(struct virt_queue *vq, u32 head, u32 len);
+u16 virt_queue__used_batch_flush(struct virt_queue *vq);
+void virt_queue__set_used_elem_in_order(struct virt_queue *vq, u32 head, u32 len);
+void virt_queue__used_in_order_flush(struct virt_queue *vq);
 
 bool virtio_queue__should_signal(struct virt_queue *vq);
 u16 virt_queue__get_iov(struct virt_queue *vq, struct iovec iov[],
@@ -177,11 +364,15 @@ enum virtio_trans {
 };
 
 struct virtio_device {
+	struct list_head	list;		/* in the KVM_IPC_VIRTIO_STAT dump */
+	void			*dev;
+	u32			type;		/* VIRTIO_ID_* */
 	bool			use_vhost;
+	bool			ring_packed;	/* queues use the packed layout */
 	void			*virtio;
 	struct virtio_ops	*ops;
 	u16			endian;
-	u32			features;
+	u64			features;
 	u32			status;
 };
 
@@ -191,11 +382,10 @@ struct virtio_ops {
     u32 (*get_config_size)(struct kvm *kvm, void *dev);
     u32 (*get_mem_size)(struct kvm *kvm, void *dev);
 #endif
-	u32 (*get_host_features)(struct kvm *kvm, void *dev);
-	void (*set_guest_features)(struct kvm *kvm, void *dev, u32 features);
+	u64 (*get_host_features)(struct kvm *kvm, void *dev);
+	void (*set_guest_features)(struct kvm *kvm, void *dev, u64 features);
 	int (*get_vq_count)(struct kvm *kvm, void *dev);
-	int (*init_vq)(struct kvm *kvm, void *dev, u32 vq, u32 page_size,
-		       u32 align, u32 pfn);
+	int (*init_vq)(struct kvm *kvm, void *dev, u32 vq);
 	void (*exit_vq)(struct kvm *kvm, void *dev, u32 vq);
 	int (*notify_vq)(struct kvm *kvm, void *dev, u32 vq);
 	struct virt_queue *(*get_vq)(struct kvm *kvm, void *dev, u32 vq);
@@ -215,6 +405,13 @@ struct virtio_ops {
 int __must_check virtio_init(struct kvm *kvm, void *dev, struct virtio_device *vdev,
 			     struct virtio_ops *ops, enum virtio_trans trans,
 			     int device_id, int subsys_id, int class);
+void virtio_exit_device(struct virtio_device *vdev);
+int virtio_notify_vq(struct kvm *kvm, struct virtio_device *vdev, void *dev,
+		     u32 vq);
+void virtio_for_each_vq(struct kvm *kvm,
+			void (*fn)(struct virtio_device *vdev, u32 dev,
+				   u32 queue, struct virt_queue *vq, void *arg),
+			void *arg);
 int virtio_compat_add_message(const char *device, const char *config);
 const char* virtio_trans_name(enum virtio_trans trans);
 
@@ -223,18 +420,13 @@ static inline void *virtio_get_vq(struct kvm *kvm, u32 pfn, u32 page_size)
 	return guest_flat_to_host(kvm, (u64)pfn * page_size);
 }
 
-static inline void virtio_init_device_vq(struct virtio_device *vdev,
-					 struct virt_queue *vq)
-{
-	vq->endian = vdev->endian;
-	vq->use_event_idx = (vdev->features & VIRTIO_RING_F_EVENT_IDX);
-	vq->enabled = true;
-}
+void virtio_init_device_vq(struct kvm *kvm, struct virtio_device *vdev,
+			   struct virt_queue *vq, u32 nr_descs);
 
 void virtio_exit_vq(struct kvm *kvm, struct virtio_device *vdev, void *dev,
 		    int num);
 void virtio_set_guest_features(struct kvm *kvm, struct virtio_device *vdev,
-			       void *dev, u32 features);
+			       void *dev, u64 features);
 void virtio_notify_status(struct kvm *kvm, struct virtio_device *vdev,
 			  void *dev, u8 status);
 
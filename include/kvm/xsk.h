@@ -0,0 +1,60 @@
+#ifndef KVM__XSK_H
+#define KVM__XSK_H
+
+#include "linux/types.h"
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* A ring shared with the kernel, of fill or completion addresses or descs */
+struct xsk_ring {
+	u32		*producer;
+	u32		*consumer;
+	u32		*flags;
+	void		*ring;
+	u32		size;
+	u32		mask;
+
+	void		*map;
+	size_t		map_size;
+};
+
+/*
+ * An AF_XDP socket bound to one queue of a host interface. Received frames
+ * are copied from the UMEM into the guest buffers and their frames handed
+ * back through the fill ring. Transmitted frames are copied into the UMEM
+ * frames of tx_frames, which come back through the completion ring. The
+ * receive side and the transmit side may run in two threads.
+ */
+struct xsk_info {
+	int		fd;
+	int		ifindex;
+	u32		queue;
+	/* Busy poll the interface for up to this many us instead of sleeping */
+	int		busy_poll;
+	u32		vnet_hdr_len;
+
+	void		*umem;
+	size_t		umem_size;
+	struct xsk_ring	fill;
+	struct xsk_ring	comp;
+	struct xsk_ring	rx;
+	struct xsk_ring	tx;
+
+	u64		*tx_frames;
+	u32		nr_tx_frames;
+
+	/* The XDP program redirecting the queue to the socket */
+	int		map_fd;
+	int		prog_fd;
+	int		link_fd;
+};
+
+int xsk_init(struct xsk_info *info, const char *ifname, u32 queue,
+	     int busy_poll);
+void xsk_exit(struct xsk_info *info);
+int xsk_rx(struct iovec *iov, u16 in, struct xsk_info *info);
+int xsk_tx(struct iovec *iov, u16 out, struct xsk_info *info);
+void xsk_tx_flush(struct xsk_info *info);
+
+#endif /* KVM__XSK_H */
@@ -12,6 +12,7 @@
 #include "kvm/ioeventfd.h"
 #include "kvm/kvm.h"
 #include "kvm/util.h"
+#include "kvm/virtio.h"
 
 #define IOEVENTFD_MAX_EVENTS	20
 
@@ -30,6 +31,7 @@ static void *ioeventfd__thread(void *param)
 		int nfds, i;
 
 		nfds = epoll_wait(epoll_fd, events, IOEVENTFD_MAX_EVENTS, -1);
+		virtio_trace__wakeup();
 		for (i = 0; i < nfds; i++) {
 			struct ioevent *ioevent;
 
@@ -38,7 +40,8 @@ static void *ioeventfd__thread(void *param)
 
 			ioevent = events[i].data.ptr;
 
-			if (read(ioevent->fd, &tmp, sizeof(tmp)) < 0)
+			if (!(ioevent->flags & IOEVENTFD_FLAG_NO_READ) &&
+			    read(ioevent->fd, &tmp, sizeof(tmp)) < 0)
 				die("Failed reading event");
 
 			ioevent->fn(ioevent->fn_kvm, ioevent->fn_ptr);
@@ -248,3 +251,17 @@ int ioeventfd__add_epoll_event(struct ioevent *ioev, int event)
 	return 0;
 }
 
+/*
+ * Remove an event added by ioeventfd__add_epoll_event() on its own fd. It
+ * was never registered with KVM, so there is nothing to deassign.
+ */
+void ioeventfd__del_epoll_event(struct ioevent *ioev)
+{
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, ioev->fd, NULL);
+
+	list_del(&ioev->list);
+
+	close(ioev->fd);
+	free(ioev);
+}
+
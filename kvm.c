@@ -5,6 +5,10 @@
 #include "kvm/mutex.h"
 #include "kvm/kvm-cpu.h"
 #include "kvm/kvm-ipc.h"
+#include "kvm/barrier.h"
+#ifdef RSLD
+#include "kvm/pmm.h"
+#endif
 
 #include <linux/kernel.h>
 #include <linux/kvm.h>
@@ -65,9 +69,6 @@ extern struct kvm_ext kvm_req_ext[];
 static char kvm_dir[PATH_MAX];
 
 extern __thread struct kvm_cpu *current_kvm_cpu;
-#ifdef RSLD
-static unsigned int get_uio_size(char* size_file);
-#endif
 static int set_dir(const char *fmt, va_list args)
 {
 	char tmp[PATH_MAX];
@@ -187,6 +188,45 @@ int kvm__exit(struct kvm *kvm)
 }
 core_exit(kvm__exit);
 
+/* Called with mem_banks_lock held, after any change to mem_banks */
+static void kvm__update_mem_map(struct kvm *kvm)
+{
+	struct kvm_mem_map *map = &kvm->mem_map;
+	volatile u32 *seq = &map->seq;
+	struct kvm_mem_map_entry e;
+	struct kvm_mem_bank *bank;
+	u32 i;
+
+	*seq = *seq + 1;
+	wmb();
+
+	map->nr = 0;
+	map->overflow = false;
+	list_for_each_entry(bank, &kvm->mem_banks, list) {
+		if (!bank->host_addr)
+			continue;
+
+		if (map->nr == KVM_MEM_MAP_MAX) {
+			map->overflow = true;
+			break;
+		}
+
+		e = (struct kvm_mem_map_entry) {
+			.start		= bank->guest_phys_addr,
+			.end		= bank->guest_phys_addr + bank->size,
+			.host_addr	= bank->host_addr,
+		};
+
+		/* Banks are sorted by slot, insert by address */
+		for (i = map->nr++; i && map->entries[i - 1].start > e.start; i--)
+			map->entries[i] = map->entries[i - 1];
+		map->entries[i] = e;
+	}
+
+	wmb();
+	*seq = *seq + 1;
+}
+
 int kvm__destroy_mem(struct kvm *kvm, u64 guest_phys, u64 size,
 		     void *userspace_addr)
 {
@@ -230,6 +270,7 @@ int kvm__destroy_mem(struct kvm *kvm, u64 guest_phys, u64 size,
 	list_del(&bank->list);
 	free(bank);
 	kvm->mem_slots--;
+	kvm__update_mem_map(kvm);
 	ret = 0;
 
 out:
@@ -300,6 +341,7 @@ int kvm__register_mem(struct kvm *kvm, u64 guest_phys, u64 size,
 	}
 
 	if (merged) {
+		kvm__update_mem_map(kvm);
 		ret = 0;
 		goto out;
 	}
@@ -343,6 +385,7 @@ int kvm__register_mem(struct kvm *kvm, u64 guest_phys, u64 size,
 
 	list_add(&bank->list, prev_entry);
 	kvm->mem_slots++;
+	kvm__update_mem_map(kvm);
 	ret = 0;
 
 out:
@@ -350,7 +393,7 @@ out:
 	return ret;
 }
 
-void *guest_flat_to_host(struct kvm *kvm, u64 offset)
+static void *kvm__mem_bank_to_host(struct kvm *kvm, u64 offset, u64 len)
 {
 	struct kvm_mem_bank *bank;
 
@@ -358,15 +401,91 @@ void *guest_flat_to_host(struct kvm *kvm, u64 offset)
 		u64 bank_start = bank->guest_phys_addr;
 		u64 bank_end = bank_start + bank->size;
 
-		if (offset >= bank_start && offset < bank_end)
+		if (offset >= bank_start && offset < bank_end) {
+			if (!bank->host_addr || len > bank_end - offset)
+				return NULL;
 			return bank->host_addr + (offset - bank_start);
+		}
 	}
 
-	pr_warning("unable to translate guest address 0x%llx to host",
-			(unsigned long long)offset);
 	return NULL;
 }
 
+/* Index of the last entry each thread hit, most lookups land there again */
+static __thread u32 mem_map_hint;
+
+static void *kvm__mem_map_to_host(struct kvm *kvm, u64 offset, u64 len)
+{
+	struct kvm_mem_map *map = &kvm->mem_map;
+	volatile u32 *seq = &map->seq;
+	struct kvm_mem_map_entry *e;
+	u32 start, lo, hi, mid;
+	void *host;
+
+	do {
+		start = *seq;
+		rmb();
+
+		if (map->overflow) {
+			host = kvm__mem_bank_to_host(kvm, offset, len);
+			goto next;
+		}
+
+		host = NULL;
+		e = &map->entries[mem_map_hint % KVM_MEM_MAP_MAX];
+		if (mem_map_hint >= map->nr || offset < e->start ||
+		    offset >= e->end) {
+			e = NULL;
+			lo = 0;
+			hi = map->nr;
+			while (lo < hi) {
+				mid = (lo + hi) / 2;
+				if (offset < map->entries[mid].start) {
+					hi = mid;
+				} else if (offset >= map->entries[mid].end) {
+					lo = mid + 1;
+				} else {
+					e = &map->entries[mid];
+					mem_map_hint = mid;
+					break;
+				}
+			}
+		}
+
+		if (e && len <= e->end - offset)
+			host = e->host_addr + (offset - e->start);
+next:
+		rmb();
+	} while ((start & 1) || start != *seq);
+
+	return host;
+}
+
+void *guest_flat_to_host(struct kvm *kvm, u64 offset)
+{
+	void *host = kvm__mem_map_to_host(kvm, offset, 1);
+
+	if (!host)
+		pr_warning("unable to translate guest address 0x%llx to host",
+			   (unsigned long long)offset);
+	return host;
+}
+
+/*
+ * Translate a guest buffer of len bytes, which must not cross the end of
+ * the memory bank it starts in.
+ */
+void *guest_flat_to_host_range(struct kvm *kvm, u64 offset, u64 len)
+{
+	void *host = kvm__mem_map_to_host(kvm, offset, len);
+
+	if (!host)
+		pr_warning("unable to translate guest range 0x%llx-0x%llx to host",
+			   (unsigned long long)offset,
+			   (unsigned long long)offset + len);
+	return host;
+}
+
 u64 host_to_guest_flat(struct kvm *kvm, void *ptr)
 {
 	struct kvm_mem_bank *bank;
@@ -436,64 +555,13 @@ int kvm__max_cpus(struct kvm *kvm)
 	return ret;
 }
 
-#ifdef RSLD
-static unsigned int get_uio_size(char* size_file)
-{
-    int uio_size = 0;
-    char size_str[20] = {0};
-    FILE* f;
-
-    f = fopen(size_file, "r");
-    if (f == NULL)
-        return 0;
-
-    fscanf(f, "%s", size_str);
-    sscanf(size_str, "%x", &uio_size);
-    fclose(f);
-
-    return uio_size;
-}
-#endif
 
 int kvm__init(struct kvm *kvm)
 {
 	int ret;
 #ifdef RSLD
-	if (kvm->cfg.pmm) {
-		//shared memory setup
-		if (kvm->cfg.hvl_shmem_size != 0) {
-			int uiofd;
-			unsigned long shmem_size;
-			char *mptr;
-
-			uiofd = open("/dev/uio0", O_RDWR);
-			if (uiofd < 0) {
-				perror("uio open: ");
-				return errno;
-			}
-
-			shmem_size = get_uio_size((char *)"/sys/class/uio/uio0/maps/map0/size");
-			if (kvm->cfg.hvl_shmem_size > shmem_size) {
-				die("Requested shared memory size %lld is unavailable (UIO dev size = %ld)\n", kvm->cfg.hvl_shmem_size, shmem_size);
-			}
-			mptr = mmap(NULL, kvm->cfg.hvl_shmem_size, PROT_READ|PROT_WRITE, MAP_SHARED, uiofd, 0);
-			memset(mptr, 0, kvm->cfg.hvl_shmem_size);
-			if (mptr == MAP_FAILED) {
-				perror("mmap: ");
-				close(uiofd);
-				return errno;
-			}
-			kvm->shmem_start = mptr;
-
-			close(uiofd);
-
-			kvm->shmem_size = kvm->cfg.hvl_shmem_size;
-			INIT_LIST_HEAD(&kvm->mem_banks);
-			kvm__register_mem(kvm, kvm->cfg.hvl_shmem_phys_addr, kvm->shmem_size, kvm->shmem_start, KVM_MEM_TYPE_RAM);
-		}
-
-		return 0;
-	}
+	if (kvm->cfg.pmm)
+		return pmm__init_shmem(kvm);
 #endif
 
 	if (!kvm__arch_cpu_supports_vm()) {
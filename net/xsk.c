@@ -0,0 +1,414 @@
+/*
+ * AF_XDP backend of virtio-net (mode=xdp).
+ *
+ * A small XDP program redirects one queue of the host interface to the
+ * socket, so that its frames skip the host stack. There is no libbpf: the
+ * program, its XSKMAP and the link attaching it are set up with bpf(2).
+ */
+#include "kvm/xsk.h"
+
+#include "kvm/barrier.h"
+#include "kvm/iovec.h"
+#include "kvm/util.h"
+
+#include <linux/bpf.h>
+#include <linux/if_xdp.h>
+#include <linux/kernel.h>
+#include <linux/virtio_net.h>
+
+#include <errno.h>
+#include <net/if.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+/* Without offloads every frame fits in one of them */
+#define XSK_FRAME_SIZE		2048
+#define XSK_NR_FRAMES		4096
+/* Half of the frames are lent to the kernel for receiving, half are sent */
+#define XSK_RING_SIZE		(XSK_NR_FRAMES / 2)
+/* Waits of 10ms for the queue to be released by its previous socket */
+#define XSK_BIND_RETRIES	100
+
+/* Headers of received frames, which come without offloads */
+static unsigned char xsk_vnet_hdr[sizeof(struct virtio_net_hdr_mrg_rxbuf)];
+
+/* Entries the kernel produced on a ring, which may be read once returned */
+static u32 xsk_ring__ready(struct xsk_ring *r)
+{
+	u32 n = *(volatile u32 *)r->producer - *r->consumer;
+
+	rmb();
+
+	return n;
+}
+
+static void xsk_ring__consume(struct xsk_ring *r, u32 n)
+{
+	/* The entries were read before the kernel may reuse them */
+	mb();
+	*r->consumer += n;
+}
+
+static void xsk_ring__produce(struct xsk_ring *r, u32 n)
+{
+	/* The entries must be visible before the producer that publishes them */
+	wmb();
+	*r->producer += n;
+}
+
+static int xsk__map_ring(struct xsk_info *info, struct xsk_ring *r,
+			 struct xdp_ring_offset *off, size_t entry, off_t pgoff)
+{
+	r->map_size = off->desc + XSK_RING_SIZE * entry;
+	r->map = mmap(NULL, r->map_size, PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_POPULATE, info->fd, pgoff);
+	if (r->map == MAP_FAILED) {
+		r->map = NULL;
+		return -errno;
+	}
+
+	r->producer	= r->map + off->producer;
+	r->consumer	= r->map + off->consumer;
+	r->flags	= r->map + off->flags;
+	r->ring		= r->map + off->desc;
+	r->size		= XSK_RING_SIZE;
+	r->mask		= XSK_RING_SIZE - 1;
+
+	return 0;
+}
+
+static int xsk__bpf(int cmd, union bpf_attr *attr)
+{
+	return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+/* Redirect the queue to the socket, frames of other queues go on as usual */
+static int xsk__attach(struct xsk_info *info)
+{
+	struct bpf_insn prog[] = {
+		/* r2 = ctx->rx_queue_index */
+		{
+			.code		= BPF_LDX | BPF_MEM | BPF_W,
+			.dst_reg	= BPF_REG_2,
+			.src_reg	= BPF_REG_1,
+			.off		= offsetof(struct xdp_md, rx_queue_index),
+		},
+		/* r1 = the XSKMAP */
+		{
+			.code		= BPF_LD | BPF_DW | BPF_IMM,
+			.dst_reg	= BPF_REG_1,
+			.src_reg	= BPF_PSEUDO_MAP_FD,
+			.imm		= info->map_fd,
+		},
+		{ },
+		/* r3 = XDP_PASS, returned when the queue has no socket */
+		{
+			.code		= BPF_ALU64 | BPF_MOV | BPF_K,
+			.dst_reg	= BPF_REG_3,
+			.imm		= XDP_PASS,
+		},
+		{
+			.code		= BPF_JMP | BPF_CALL,
+			.imm		= BPF_FUNC_redirect_map,
+		},
+		{
+			.code		= BPF_JMP | BPF_EXIT,
+		},
+	};
+	union bpf_attr attr;
+	u32 key = info->queue;
+	int fd = info->fd;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type		= BPF_MAP_TYPE_XSKMAP;
+	attr.key_size		= sizeof(key);
+	attr.value_size		= sizeof(fd);
+	attr.max_entries	= info->queue + 1;
+	info->map_fd = xsk__bpf(BPF_MAP_CREATE, &attr);
+	if (info->map_fd < 0)
+		return -errno;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd		= info->map_fd;
+	attr.key		= (unsigned long)&key;
+	attr.value		= (unsigned long)&fd;
+	if (xsk__bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0)
+		return -errno;
+
+	prog[1].imm = info->map_fd;
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type		= BPF_PROG_TYPE_XDP;
+	attr.expected_attach_type = BPF_XDP;
+	attr.insns		= (unsigned long)prog;
+	attr.insn_cnt		= ARRAY_SIZE(prog);
+	attr.license		= (unsigned long)"GPL";
+	info->prog_fd = xsk__bpf(BPF_PROG_LOAD, &attr);
+	if (info->prog_fd < 0)
+		return -errno;
+
+	/* The program stays attached as long as the link is open */
+	memset(&attr, 0, sizeof(attr));
+	attr.link_create.prog_fd	= info->prog_fd;
+	attr.link_create.target_ifindex	= info->ifindex;
+	attr.link_create.attach_type	= BPF_XDP;
+	info->link_fd = xsk__bpf(BPF_LINK_CREATE, &attr);
+	if (info->link_fd < 0)
+		return -errno;
+
+	return 0;
+}
+
+static void xsk__busy_poll(struct xsk_info *info)
+{
+	int val = info->busy_poll;
+
+	if (setsockopt(info->fd, SOL_SOCKET, SO_BUSY_POLL, &val, sizeof(val)) < 0)
+		pr_warning("xsk: SO_BUSY_POLL failed");
+
+#if defined(SO_PREFER_BUSY_POLL) && defined(SO_BUSY_POLL_BUDGET)
+	val = 1;
+	if (setsockopt(info->fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &val,
+		       sizeof(val)) < 0)
+		pr_warning("xsk: SO_PREFER_BUSY_POLL failed");
+
+	val = 64;
+	if (setsockopt(info->fd, SOL_SOCKET, SO_BUSY_POLL_BUDGET, &val,
+		       sizeof(val)) < 0)
+		pr_warning("xsk: SO_BUSY_POLL_BUDGET failed");
+#endif
+}
+
+int xsk_init(struct xsk_info *info, const char *ifname, u32 queue,
+	     int busy_poll)
+{
+	struct xdp_umem_reg reg;
+	struct xdp_mmap_offsets off;
+	struct sockaddr_xdp sxdp;
+	socklen_t optlen = sizeof(off);
+	int size = XSK_RING_SIZE;
+	u64 *fill;
+	u32 i;
+	int r;
+
+	memset(info, 0, sizeof(*info));
+	info->fd = info->map_fd = info->prog_fd = info->link_fd = -1;
+	info->queue = queue;
+	info->busy_poll = busy_poll;
+
+	info->ifindex = if_nametoindex(ifname);
+	if (!info->ifindex)
+		return -errno;
+
+	info->fd = socket(AF_XDP, SOCK_RAW, 0);
+	if (info->fd < 0)
+		return -errno;
+
+	info->umem_size = XSK_NR_FRAMES * XSK_FRAME_SIZE;
+	info->umem = mmap(NULL, info->umem_size, PROT_READ | PROT_WRITE,
+			  MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (info->umem == MAP_FAILED) {
+		info->umem = NULL;
+		r = -errno;
+		goto err;
+	}
+
+	info->tx_frames = calloc(XSK_RING_SIZE, sizeof(*info->tx_frames));
+	if (!info->tx_frames) {
+		r = -ENOMEM;
+		goto err;
+	}
+
+	reg = (struct xdp_umem_reg) {
+		.addr		= (unsigned long)info->umem,
+		.len		= info->umem_size,
+		.chunk_size	= XSK_FRAME_SIZE,
+	};
+	if (setsockopt(info->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) < 0 ||
+	    setsockopt(info->fd, SOL_XDP, XDP_UMEM_FILL_RING, &size, sizeof(size)) < 0 ||
+	    setsockopt(info->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &size, sizeof(size)) < 0 ||
+	    setsockopt(info->fd, SOL_XDP, XDP_RX_RING, &size, sizeof(size)) < 0 ||
+	    setsockopt(info->fd, SOL_XDP, XDP_TX_RING, &size, sizeof(size)) < 0 ||
+	    getsockopt(info->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) < 0) {
+		r = -errno;
+		goto err;
+	}
+
+	r = xsk__map_ring(info, &info->fill, &off.fr, sizeof(u64),
+			  XDP_UMEM_PGOFF_FILL_RING);
+	if (!r)
+		r = xsk__map_ring(info, &info->comp, &off.cr, sizeof(u64),
+				  XDP_UMEM_PGOFF_COMPLETION_RING);
+	if (!r)
+		r = xsk__map_ring(info, &info->rx, &off.rx,
+				  sizeof(struct xdp_desc), XDP_PGOFF_RX_RING);
+	if (!r)
+		r = xsk__map_ring(info, &info->tx, &off.tx,
+				  sizeof(struct xdp_desc), XDP_PGOFF_TX_RING);
+	if (r)
+		goto err;
+
+	/* The first half of the UMEM receives, the second half sends */
+	fill = info->fill.ring;
+	for (i = 0; i < XSK_RING_SIZE; i++) {
+		fill[i] = (u64)i * XSK_FRAME_SIZE;
+		info->tx_frames[i] = (u64)(XSK_RING_SIZE + i) * XSK_FRAME_SIZE;
+	}
+	info->nr_tx_frames = XSK_RING_SIZE;
+	xsk_ring__produce(&info->fill, XSK_RING_SIZE);
+
+	sxdp = (struct sockaddr_xdp) {
+		.sxdp_family	= AF_XDP,
+		.sxdp_flags	= XDP_USE_NEED_WAKEUP,
+		.sxdp_ifindex	= info->ifindex,
+		.sxdp_queue_id	= queue,
+	};
+	/*
+	 * The kernel releases the UMEM of a closed socket asynchronously, so
+	 * the queue may still be busy for a moment after a previous user quit.
+	 */
+	for (i = 0; bind(info->fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) < 0; i++) {
+		r = -errno;
+		if (r != -EBUSY || i == XSK_BIND_RETRIES)
+			goto err;
+		usleep(10000);
+	}
+
+	if (busy_poll)
+		xsk__busy_poll(info);
+
+	r = xsk__attach(info);
+	if (r)
+		goto err;
+
+	return 0;
+
+err:
+	xsk_exit(info);
+	return r;
+}
+
+void xsk_exit(struct xsk_info *info)
+{
+	struct xsk_ring *rings[] = { &info->fill, &info->comp, &info->rx, &info->tx };
+	unsigned int i;
+
+	/* Closing the link detaches the program from the interface */
+	if (info->link_fd >= 0)
+		close(info->link_fd);
+	if (info->prog_fd >= 0)
+		close(info->prog_fd);
+	if (info->map_fd >= 0)
+		close(info->map_fd);
+
+	for (i = 0; i < ARRAY_SIZE(rings); i++)
+		if (rings[i]->map)
+			munmap(rings[i]->map, rings[i]->map_size);
+
+	if (info->fd >= 0)
+		close(info->fd);
+	if (info->umem)
+		munmap(info->umem, info->umem_size);
+	free(info->tx_frames);
+
+	memset(info, 0, sizeof(*info));
+	info->fd = info->map_fd = info->prog_fd = info->link_fd = -1;
+}
+
+int xsk_rx(struct iovec *iov, u16 in, struct xsk_info *info)
+{
+	struct pollfd pfd = { .fd = info->fd, .events = POLLIN };
+	struct xdp_desc *desc;
+	u64 *fill, addr;
+	int len;
+
+	while (!xsk_ring__ready(&info->rx)) {
+		/* Without waiting, recvfrom() runs the driver in this thread */
+		if (info->busy_poll)
+			recvfrom(info->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+		else if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+			return -errno;
+	}
+
+	desc = info->rx.ring;
+	desc += *info->rx.consumer & info->rx.mask;
+	addr = desc->addr;
+	len = min_t(int, desc->len, iov_size(iov, in) - info->vnet_hdr_len);
+
+	memcpy_toiovecend(iov, xsk_vnet_hdr, 0, info->vnet_hdr_len);
+	memcpy_toiovecend(iov, info->umem + addr, info->vnet_hdr_len, len);
+	xsk_ring__consume(&info->rx, 1);
+
+	/* There are no more frames than the fill ring holds */
+	fill = info->fill.ring;
+	fill[*info->fill.producer & info->fill.mask] = addr & ~(u64)(XSK_FRAME_SIZE - 1);
+	xsk_ring__produce(&info->fill, 1);
+
+	return info->vnet_hdr_len + len;
+}
+
+/* Take back the frames the kernel is done sending */
+static void xsk__complete(struct xsk_info *info)
+{
+	u64 *comp = info->comp.ring;
+	u32 i, n = xsk_ring__ready(&info->comp);
+
+	for (i = 0; i < n; i++)
+		info->tx_frames[info->nr_tx_frames++] =
+			comp[(*info->comp.consumer + i) & info->comp.mask];
+
+	xsk_ring__consume(&info->comp, n);
+}
+
+static void xsk__kick(struct xsk_info *info)
+{
+	/* EAGAIN, EBUSY or ENOBUFS only mean that the frames are sent later */
+	sendto(info->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+}
+
+/* Queue a frame for sending, xsk_tx_flush() sends all those queued */
+int xsk_tx(struct iovec *iov, u16 out, struct xsk_info *info)
+{
+	struct pollfd pfd = { .fd = info->fd, .events = POLLOUT };
+	int len = iov_size(iov, out) - info->vnet_hdr_len;
+	struct xdp_desc *desc;
+	u64 addr;
+
+	/* The device offers no segmentation, such a frame is malformed */
+	if (len <= 0 || len > XSK_FRAME_SIZE)
+		return iov_size(iov, out);
+
+	xsk__complete(info);
+	while (!info->nr_tx_frames) {
+		xsk__kick(info);
+		if (poll(&pfd, 1, 1) < 0 && errno != EINTR)
+			return -errno;
+		xsk__complete(info);
+	}
+
+	/* A free frame is not on the tx ring, which then has room for it */
+	addr = info->tx_frames[--info->nr_tx_frames];
+	memcpy_fromiovecend(info->umem + addr, iov, info->vnet_hdr_len, len);
+
+	desc = info->tx.ring;
+	desc += *info->tx.producer & info->tx.mask;
+	*desc = (struct xdp_desc) {
+		.addr	= addr,
+		.len	= len,
+	};
+	xsk_ring__produce(&info->tx, 1);
+
+	return info->vnet_hdr_len + len;
+}
+
+void xsk_tx_flush(struct xsk_info *info)
+{
+	if (info->busy_poll ||
+	    (*(volatile u32 *)info->tx.flags & XDP_RING_NEED_WAKEUP))
+		xsk__kick(info);
+}
@@ -0,0 +1,1032 @@
+#include "kvm/pmm.h"
+
+#include "kvm/devices.h"
+#include "kvm/ioeventfd.h"
+#include "kvm/kvm-cpu.h"
+#include "kvm/mutex.h"
+#include "kvm/parse-options.h"
+#include "kvm/shm-pool.h"
+#include "kvm/strbuf.h"
+#include "kvm/util.h"
+#include "kvm/virtio-mmio.h"
+#include "kvm/virtio.h"
+#include "kvm/kvm.h"
+
+#include <linux/mempolicy.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/err.h>
+#include <linux/virtio_ids.h>
+
+static DEFINE_MUTEX(pmm_lock);
+static struct kvm_cpu pmm_cpu;
+static struct ioevent *pmm_doorbell;
+static struct ioevent *pmm_listener;
+
+/* Upper bound of the backoff between two empty polling passes */
+#define PMM_POLL_BACKOFF_MAX	1024
+
+static DEFINE_MUTEX(pmm_poll_lock);
+static pthread_cond_t pmm_poll_cond = PTHREAD_COND_INITIALIZER;
+static bool pmm_polling = true;
+
+static u64 pmm_start_ns;
+
+/* Host CPUs serving each shared memory window, empty when not pinned */
+static cpu_set_t pmm_window_cpus[PMM_MAX_WINDOWS];
+
+static u64 pmm__now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Report how long after the shared pool was first touched a phase ended */
+void pmm__phase(const char *fmt, ...)
+{
+	u64 elapsed = pmm__now_ns() - pmm_start_ns;
+	char phase[64];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(phase, sizeof(phase), fmt, ap);
+	va_end(ap);
+
+	pr_debug("PMM: %-28s +%llu.%03llu ms", phase,
+		 elapsed / 1000000, (elapsed / 1000) % 1000);
+}
+
+static unsigned long pmm__uio_size(int uio, int map)
+{
+	unsigned long uio_size = 0;
+	char size_file[PATH_MAX];
+	FILE *f;
+
+	snprintf(size_file, sizeof(size_file), PMM_UIO_MAP_SIZE, uio, map);
+	f = fopen(size_file, "r");
+	if (f == NULL)
+		return 0;
+
+	if (fscanf(f, "%lx", &uio_size) != 1)
+		uio_size = 0;
+	fclose(f);
+
+	return uio_size;
+}
+
+static void *pmm__map_uio(struct kvm *kvm, unsigned int window)
+{
+	struct pmm_shm_window *w = &kvm->cfg.pmm_windows[window];
+	unsigned long shmem_size;
+	char dev[PATH_MAX];
+	int uiofd;
+	char *mptr;
+
+	snprintf(dev, sizeof(dev), PMM_UIO_DEV, w->uio);
+	uiofd = open(dev, O_RDWR);
+	if (uiofd < 0) {
+		perror("uio open: ");
+		return MAP_FAILED;
+	}
+
+	shmem_size = pmm__uio_size(w->uio, w->uio_map);
+	if (w->size > shmem_size) {
+		die("Requested shared memory size %lld is unavailable (UIO dev size = %ld)\n", w->size, shmem_size);
+	}
+	/*
+	 * The pool is not cleared here: touching all of it over a slow window
+	 * dominated startup. The pool allocator zeroes what it hands out, and
+	 * --shmem-clear takes care of the rest when asked to. UIO selects the
+	 * map to expose with the page offset.
+	 */
+	mptr = mmap(NULL, w->size, PROT_READ|PROT_WRITE, MAP_SHARED, uiofd,
+		    (off_t)w->uio_map * getpagesize());
+	if (mptr == MAP_FAILED)
+		perror("mmap: ");
+
+	close(uiofd);
+
+	return mptr;
+}
+
+/*
+ * The windows of the loopback transport are anonymous, zero-filled memory,
+ * kept on the node of the window when there is one.
+ */
+static void *pmm__map_memfd(struct kvm *kvm, unsigned int window)
+{
+	struct pmm_shm_window *w = &kvm->cfg.pmm_windows[window];
+	unsigned long nodemask;
+	void *mptr;
+	int fd;
+
+	fd = memfd_create("lkvm-pmm-shmem", MFD_CLOEXEC);
+	if (fd < 0) {
+		perror("memfd_create: ");
+		return MAP_FAILED;
+	}
+
+	if (ftruncate(fd, w->size) < 0) {
+		perror("ftruncate: ");
+		close(fd);
+		return MAP_FAILED;
+	}
+
+	mptr = mmap(NULL, w->size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (mptr == MAP_FAILED) {
+		perror("mmap: ");
+		close(fd);
+		return MAP_FAILED;
+	}
+
+	if (w->node >= 0 && w->node < (int)sizeof(nodemask) * 8) {
+		nodemask = 1UL << w->node;
+		if (syscall(__NR_mbind, mptr, w->size, MPOL_BIND, &nodemask,
+			    sizeof(nodemask) * 8, 0) < 0)
+			pr_warning("PMM: unable to bind window %u to node %d: %s",
+				   window, w->node, strerror(errno));
+	}
+
+	kvm->shmem_fds[window] = fd;
+
+	return mptr;
+}
+
+int pmm__init_shmem(struct kvm *kvm)
+{
+	struct pmm_shm_window *w;
+	unsigned int i;
+	void *mptr;
+	int r;
+
+	if (kvm->cfg.hvl_shmem_size == 0)
+		return 0;
+
+	pmm_start_ns = pmm__now_ns();
+	INIT_LIST_HEAD(&kvm->mem_banks);
+
+	for (i = 0; i < (unsigned int)kvm->cfg.nr_pmm_windows; i++) {
+		w = &kvm->cfg.pmm_windows[i];
+
+		if (kvm->cfg.pmm_loopback)
+			mptr = pmm__map_memfd(kvm, i);
+		else
+			mptr = pmm__map_uio(kvm, i);
+
+		if (mptr == MAP_FAILED)
+			return -errno;
+
+		kvm->shmem_windows[i] = mptr;
+		r = kvm__register_mem(kvm, w->phys_addr, w->size, mptr,
+				      KVM_MEM_TYPE_RAM);
+		if (r < 0)
+			return r;
+	}
+
+	pmm__phase("shared pool mapped");
+
+	kvm->shmem_start = kvm->shmem_windows[0];
+	kvm->shmem_size = kvm->cfg.hvl_shmem_size;
+
+	return 0;
+}
+
+int notify_mbox(struct kvm *kvm)
+{
+	u64 val = 1;
+	ssize_t r;
+
+	if (kvm->cfg.pmm_loopback)
+		r = write(kvm->notif_fd, &val, sizeof(val));
+	else
+		r = write(kvm->notif_fd, "\n", 1);
+
+	if (r < 0 && do_debug_print)
+		pr_warning("PMM: mailbox write failed: %s", strerror(errno));
+
+	return 0;
+}
+
+/*
+ * Walk the shared memory devices and let each of them pick up whatever the
+ * remote side published. Doorbells are serialised so that the initial pass
+ * done at init time cannot race with the first mailbox notification.
+ */
+void pmm__dispatch(struct kvm *kvm)
+{
+	virtio_trace__wakeup();
+	mutex_lock(&pmm_lock);
+	virtio_mmio_hvl_notify(&pmm_cpu);
+	mutex_unlock(&pmm_lock);
+}
+
+static void pmm__doorbell_callback(struct kvm *kvm, void *param)
+{
+	char sval[20];
+
+	/*
+	 * The mailbox only becomes readable once the remote side rang the
+	 * doorbell. Drain it: the mailbox driver reports a pending count as a
+	 * string, the loopback eventfd a 64-bit counter. Neither is needed
+	 * since every dispatch processes all published state.
+	 */
+	if (read(kvm->doorbell_fd, sval, sizeof(sval)) < 0 && errno != EAGAIN)
+		pr_warning("PMM: mailbox read failed: %s", strerror(errno));
+
+	pmm__dispatch(kvm);
+
+	/* The driver only kicks once the poller went idle: wake it up */
+	if (kvm->cfg.pmm_poll) {
+		mutex_lock(&pmm_poll_lock);
+		pmm_polling = true;
+		pthread_cond_signal(&pmm_poll_cond);
+		mutex_unlock(&pmm_poll_lock);
+	}
+}
+
+static inline void pmm__cpu_relax(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+	asm volatile("pause" ::: "memory");
+#elif defined(__aarch64__) || defined(__arm__)
+	asm volatile("yield" ::: "memory");
+#else
+	asm volatile("" ::: "memory");
+#endif
+}
+
+static bool pmm__poll_once(void)
+{
+	bool work;
+
+	/* A pass finding new buffers stands for their kicks */
+	virtio_trace__wakeup();
+	mutex_lock(&pmm_lock);
+	work = virtio_mmio_hvl_poll(&pmm_cpu);
+	mutex_unlock(&pmm_lock);
+
+	return work;
+}
+
+/*
+ * Busy-poll the shared memory queues on the calling thread, with an
+ * exponential backoff between empty passes. Once nothing showed up for
+ * --pmm-poll microseconds the drivers are asked to kick again, and the next
+ * doorbell resumes polling.
+ */
+void pmm__poll(struct kvm *kvm)
+{
+	u64 idle_ns = (u64)kvm->cfg.pmm_poll * 1000;
+	unsigned int backoff, i;
+	u64 last_work;
+	bool work;
+
+	for (;;) {
+		mutex_lock(&pmm_poll_lock);
+		while (!pmm_polling)
+			pthread_cond_wait(&pmm_poll_cond, &pmm_poll_lock.mutex);
+		mutex_unlock(&pmm_poll_lock);
+
+		last_work = pmm__now_ns();
+		backoff = 1;
+
+		for (;;) {
+			if (pmm__poll_once()) {
+				last_work = pmm__now_ns();
+				backoff = 1;
+				continue;
+			}
+
+			if (pmm__now_ns() - last_work >= idle_ns)
+				break;
+
+			for (i = 0; i < backoff; i++)
+				pmm__cpu_relax();
+			if (backoff < PMM_POLL_BACKOFF_MAX)
+				backoff <<= 1;
+		}
+
+		/*
+		 * A doorbell rung once the drivers may kick again sets the
+		 * flag, which must survive the outcome of the last check.
+		 */
+		mutex_lock(&pmm_poll_lock);
+		pmm_polling = false;
+		mutex_unlock(&pmm_poll_lock);
+
+		mutex_lock(&pmm_lock);
+		work = virtio_mmio_hvl_stop_polling(&pmm_cpu);
+		mutex_unlock(&pmm_lock);
+
+		mutex_lock(&pmm_poll_lock);
+		pmm_polling |= work;
+		mutex_unlock(&pmm_poll_lock);
+	}
+}
+
+static const struct {
+	const char	*name;
+	int		id;
+} pmm_devices[] = {
+	{ "net",	VIRTIO_ID_NET },
+	{ "blk",	VIRTIO_ID_BLOCK },
+	{ "console",	VIRTIO_ID_CONSOLE },
+	{ "rng",	VIRTIO_ID_RNG },
+	{ "balloon",	VIRTIO_ID_BALLOON },
+	{ "scsi",	VIRTIO_ID_SCSI },
+	{ "9p",		VIRTIO_ID_9P },
+	{ "vsock",	VIRTIO_ID_VSOCK },
+};
+
+/*
+ * Split a "[<device>=]<value>" option argument. Returns the virtio device ID,
+ * 0 when no device is named, and points *val at the value.
+ */
+static int pmm__parse_device(const char *arg, const char **val)
+{
+	const char *eq = strchr(arg, '=');
+	unsigned int i;
+
+	*val = arg;
+	if (!eq)
+		return 0;
+
+	*val = eq + 1;
+	for (i = 0; i < ARRAY_SIZE(pmm_devices); i++) {
+		if (strlen(pmm_devices[i].name) == (size_t)(eq - arg) &&
+		    !strncmp(arg, pmm_devices[i].name, eq - arg))
+			return pmm_devices[i].id;
+	}
+
+	die("Unknown device in '%s'", arg);
+}
+
+/* --pmm-coalesce [<device>=]<usecs>[:<frames>] */
+int pmm__coalesce_parser(const struct option *opt, const char *arg, int unset)
+{
+	struct kvm *kvm = opt->ptr;
+	struct pmm_coalesce *c;
+	const char *val;
+	char *end;
+
+	c = &kvm->cfg.pmm_coalesce[pmm__parse_device(arg, &val)];
+	c->set = true;
+	c->frames = 0;
+	c->usecs = strtoul(val, &end, 0);
+	if (*end == ':')
+		c->frames = strtoul(end + 1, &end, 0);
+	if (end == val || *end)
+		die("Invalid --pmm-coalesce value '%s'", arg);
+
+	/* Without a time bound, the tail of a burst would never be signalled */
+	if (!c->usecs && c->frames)
+		die("--pmm-coalesce needs usecs for a frame count in '%s'", arg);
+
+	return 0;
+}
+
+/* --shmem-region [<device>=]<size>[:<align>|:huge] */
+int pmm__shm_region_parser(const struct option *opt, const char *arg, int unset)
+{
+	struct kvm *kvm = opt->ptr;
+	struct pmm_shm_region *region;
+	const char *val;
+	char *end;
+
+	region = &kvm->cfg.pmm_shm[pmm__parse_device(arg, &val)];
+	region->set = true;
+	region->align = SHM_POOL_PAGE_SIZE;
+	region->size = strtoull(val, &end, 0);
+	if (end == val || !region->size)
+		die("Invalid --shmem-region size in '%s'", arg);
+
+	if (*end == ':') {
+		val = end + 1;
+		if (!strcmp(val, "huge")) {
+			region->align = SHM_POOL_HUGE_SIZE;
+			end = (char *)val + strlen(val);
+		} else {
+			region->align = strtoull(val, &end, 0);
+		}
+	}
+
+	if (*end || !region->align || (region->align & (region->align - 1)))
+		die("Invalid --shmem-region alignment in '%s'", arg);
+
+	return 0;
+}
+
+/* --shmem-bufs [<device>=]<nr>[:<size>] */
+int pmm__shm_bufs_parser(const struct option *opt, const char *arg, int unset)
+{
+	struct kvm *kvm = opt->ptr;
+	struct pmm_shm_bufs *bufs;
+	const char *val;
+	char *end;
+
+	bufs = &kvm->cfg.pmm_shm_bufs[pmm__parse_device(arg, &val)];
+	bufs->set = true;
+	bufs->size = PMM_BUF_SIZE;
+	bufs->nr = strtoul(val, &end, 0);
+	if (*end == ':')
+		bufs->size = strtoul(end + 1, &end, 0);
+	if (end == val || *end || !bufs->size)
+		die("Invalid --shmem-bufs value '%s'", arg);
+
+	return 0;
+}
+
+/*
+ * --shmem-window <addr>:<size>[:uio=<dev>[.<map>]][:node=<node>][:cpus=<list>]
+ */
+int pmm__shm_window_parser(const struct option *opt, const char *arg, int unset)
+{
+	struct kvm *kvm = opt->ptr;
+	struct pmm_shm_window *w;
+	char *end, *next;
+
+	if (kvm->cfg.nr_pmm_windows == PMM_MAX_WINDOWS)
+		die("Too many shared memory windows, at most %d", PMM_MAX_WINDOWS);
+
+	w = &kvm->cfg.pmm_windows[kvm->cfg.nr_pmm_windows++];
+	*w = (struct pmm_shm_window) {
+		.uio		= -1,
+		.node		= -1,
+	};
+
+	w->phys_addr = strtoull(arg, &end, 0);
+	if (*end != ':')
+		die("Invalid --shmem-window '%s'", arg);
+	w->size = strtoull(end + 1, &end, 0);
+	if (!w->size || (*end && *end != ':'))
+		die("Invalid --shmem-window size in '%s'", arg);
+
+	while (*end == ':') {
+		next = end + 1;
+		if (!strncmp(next, "uio=", 4)) {
+			w->uio = strtoul(next + 4, &end, 0);
+			if (*end == '.')
+				w->uio_map = strtoul(end + 1, &end, 0);
+		} else if (!strncmp(next, "node=", 5)) {
+			w->node = strtoul(next + 5, &end, 0);
+		} else if (!strncmp(next, "cpus=", 5)) {
+			w->cpus = strdup(next + 5);
+			end = (char *)next + strlen(next);
+			if (!w->cpus)
+				die("Out of memory");
+		} else {
+			break;
+		}
+	}
+
+	if (*end)
+		die("Invalid --shmem-window option in '%s'", arg);
+
+	return 0;
+}
+
+/* --shmem-bind [<device>=]<window> */
+int pmm__shm_bind_parser(const struct option *opt, const char *arg, int unset)
+{
+	struct kvm *kvm = opt->ptr;
+	struct pmm_shm_bind *bind;
+	const char *val;
+	char *end;
+
+	bind = &kvm->cfg.pmm_shm_bind[pmm__parse_device(arg, &val)];
+	bind->set = true;
+	bind->window = strtoul(val, &end, 0);
+	if (end == val || *end)
+		die("Invalid --shmem-bind value '%s'", arg);
+
+	return 0;
+}
+
+/* Parse a "0-3,8" style CPU list */
+static int pmm__parse_cpus(const char *list, cpu_set_t *cpus)
+{
+	unsigned long first, last;
+	char *end;
+
+	CPU_ZERO(cpus);
+	while (*list) {
+		first = last = strtoul(list, &end, 10);
+		if (end == list)
+			return -EINVAL;
+		if (*end == '-') {
+			list = end + 1;
+			last = strtoul(list, &end, 10);
+			if (end == list || last < first)
+				return -EINVAL;
+		}
+		if (last >= CPU_SETSIZE)
+			return -EINVAL;
+
+		for (; first <= last; first++)
+			CPU_SET(first, cpus);
+
+		list = end;
+		if (*list == ',')
+			list++;
+		else if (*list && *list != '\n')
+			return -EINVAL;
+		else
+			break;
+	}
+
+	return CPU_COUNT(cpus) ? 0 : -EINVAL;
+}
+
+/* CPUs of a window: its cpus= list, or else those of its node */
+static int pmm__window_cpus(struct pmm_shm_window *w, cpu_set_t *cpus)
+{
+	char path[PATH_MAX], list[4096];
+	ssize_t n;
+	int fd;
+
+	if (w->cpus)
+		return pmm__parse_cpus(w->cpus, cpus);
+
+	if (w->node < 0)
+		return -ENOENT;
+
+	snprintf(path, sizeof(path), PMM_NODE_CPULIST, w->node);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+
+	n = read(fd, list, sizeof(list) - 1);
+	close(fd);
+	if (n <= 0)
+		return -EINVAL;
+	list[n] = '\0';
+
+	return pmm__parse_cpus(list, cpus);
+}
+
+/*
+ * Lay out the shared memory windows: window 0 is --shmem-addr/--shmem-size,
+ * or else the first --shmem-window, and is backed by map 0 of the first UIO
+ * device. Other windows default to the next maps of that device.
+ */
+void pmm__setup_windows(struct kvm *kvm)
+{
+	struct kvm_config *cfg = &kvm->cfg;
+	struct pmm_shm_window *w, *o;
+	int i, j;
+
+	if (cfg->nr_pmm_windows && !cfg->pmm)
+		die("--shmem-window requires --pmm");
+
+	if (cfg->hvl_shmem_size) {
+		if (cfg->nr_pmm_windows == PMM_MAX_WINDOWS)
+			die("Too many shared memory windows, at most %d",
+			    PMM_MAX_WINDOWS);
+
+		memmove(&cfg->pmm_windows[1], &cfg->pmm_windows[0],
+			sizeof(*w) * cfg->nr_pmm_windows++);
+		cfg->pmm_windows[0] = (struct pmm_shm_window) {
+			.phys_addr	= cfg->hvl_shmem_phys_addr,
+			.size		= cfg->hvl_shmem_size,
+			.uio		= -1,
+			.node		= -1,
+		};
+	} else if (cfg->nr_pmm_windows) {
+		cfg->hvl_shmem_phys_addr = cfg->pmm_windows[0].phys_addr;
+		cfg->hvl_shmem_size = cfg->pmm_windows[0].size;
+	}
+
+	for (i = 0; i < cfg->nr_pmm_windows; i++) {
+		w = &cfg->pmm_windows[i];
+		if (w->uio < 0) {
+			w->uio = 0;
+			w->uio_map = i;
+		}
+
+		for (j = 0; j < i; j++) {
+			o = &cfg->pmm_windows[j];
+			if (w->phys_addr < o->phys_addr + o->size &&
+			    o->phys_addr < w->phys_addr + w->size)
+				die("Shared memory windows %d and %d overlap", j, i);
+		}
+
+		if (pmm__window_cpus(w, &pmm_window_cpus[i]) == -EINVAL)
+			die("Invalid CPUs for shared memory window %d", i);
+	}
+
+	for (i = 0; i < PMM_MAX_DEVICE_ID; i++) {
+		if (cfg->pmm_shm_bind[i].set &&
+		    cfg->pmm_shm_bind[i].window >= (u32)max(cfg->nr_pmm_windows, 1))
+			die("No shared memory window %u to bind devices to",
+			    cfg->pmm_shm_bind[i].window);
+	}
+}
+
+/* Shared memory window the regions of a device are carved from */
+unsigned int pmm__device_window(struct kvm *kvm, u32 device_id)
+{
+	struct pmm_shm_bind *bind = &kvm->cfg.pmm_shm_bind[0];
+
+	if (device_id < PMM_MAX_DEVICE_ID && kvm->cfg.pmm_shm_bind[device_id].set)
+		bind = &kvm->cfg.pmm_shm_bind[device_id];
+
+	return bind->set ? bind->window : 0;
+}
+
+/*
+ * Run the calling thread on the CPUs close to a window until
+ * pmm__leave_window(). Threads the device starts meanwhile, such as its
+ * queue workers, inherit that affinity. Returns false when the window has no
+ * CPUs of its own and the affinity was left alone.
+ */
+bool pmm__enter_window(struct kvm *kvm, unsigned int window, cpu_set_t *saved)
+{
+	if (window >= (unsigned int)kvm->cfg.nr_pmm_windows ||
+	    !CPU_COUNT(&pmm_window_cpus[window]))
+		return false;
+
+	if (pthread_getaffinity_np(pthread_self(), sizeof(*saved), saved))
+		return false;
+
+	if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+				   &pmm_window_cpus[window])) {
+		pr_warning("PMM: unable to run on the CPUs of window %u", window);
+		return false;
+	}
+
+	return true;
+}
+
+void pmm__leave_window(cpu_set_t *saved)
+{
+	pthread_setaffinity_np(pthread_self(), sizeof(*saved), saved);
+}
+
+/* --pmm-worker [<device>=]<cpus>|any */
+int pmm__worker_parser(const struct option *opt, const char *arg, int unset)
+{
+	struct kvm *kvm = opt->ptr;
+	struct pmm_worker_cpus *worker;
+	const char *val;
+	cpu_set_t cpus;
+
+	worker = &kvm->cfg.pmm_workers[pmm__parse_device(arg, &val)];
+	worker->set = true;
+	worker->cpus = NULL;
+	if (!strcmp(val, "any"))
+		return 0;
+
+	if (pmm__parse_cpus(val, &cpus) < 0)
+		die("Invalid --pmm-worker CPU list '%s'", arg);
+	worker->cpus = val;
+
+	return 0;
+}
+
+/*
+ * Dedicated thread servicing one shared memory device, so that a device
+ * stuck in a slow request does not hold up the others. It runs fn each
+ * time it is kicked through its eventfd.
+ */
+struct pmm_worker {
+	struct kvm_cpu		cpu;
+	pthread_t		thread;
+	int			efd;
+	void			(*fn)(struct kvm_cpu *vcpu, void *arg);
+	void			*arg;
+	char			name[16];
+};
+
+static void *pmm__worker_thread(void *arg)
+{
+	struct pmm_worker *worker = arg;
+	u64 data;
+
+	kvm__set_thread_name(worker->name);
+
+	for (;;) {
+		if (read(worker->efd, &data, sizeof(data)) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		virtio_trace__wakeup();
+		worker->fn(&worker->cpu, worker->arg);
+	}
+
+	return NULL;
+}
+
+/* Returns NULL when --pmm-worker gives the device no worker of its own */
+struct pmm_worker *pmm__worker_new(struct kvm *kvm, u32 device_id,
+				   void (*fn)(struct kvm_cpu *vcpu, void *arg),
+				   void *arg)
+{
+	struct pmm_worker_cpus *cfg = &kvm->cfg.pmm_workers[0];
+	struct pmm_worker *worker;
+	const char *name = NULL;
+	unsigned int i;
+	cpu_set_t cpus;
+	int r;
+
+	if (device_id < PMM_MAX_DEVICE_ID && kvm->cfg.pmm_workers[device_id].set)
+		cfg = &kvm->cfg.pmm_workers[device_id];
+	if (!kvm->cfg.pmm || !cfg->set)
+		return NULL;
+
+	worker = calloc(1, sizeof(*worker));
+	if (!worker)
+		return ERR_PTR(-ENOMEM);
+
+	for (i = 0; i < ARRAY_SIZE(pmm_devices); i++) {
+		if (pmm_devices[i].id == (int)device_id)
+			name = pmm_devices[i].name;
+	}
+	if (name)
+		snprintf(worker->name, sizeof(worker->name), "pmm-%s", name);
+	else
+		snprintf(worker->name, sizeof(worker->name), "pmm-dev%u", device_id);
+
+	worker->cpu.kvm = kvm;
+	worker->fn = fn;
+	worker->arg = arg;
+	worker->efd = eventfd(0, EFD_CLOEXEC);
+	if (worker->efd < 0) {
+		r = -errno;
+		goto err_free;
+	}
+
+	r = -pthread_create(&worker->thread, NULL, pmm__worker_thread, worker);
+	if (r)
+		goto err_close;
+
+	if (cfg->cpus && !pmm__parse_cpus(cfg->cpus, &cpus) &&
+	    pthread_setaffinity_np(worker->thread, sizeof(cpus), &cpus))
+		pr_warning("PMM: unable to pin %s to CPUs %s", worker->name,
+			   cfg->cpus);
+
+	return worker;
+
+err_close:
+	close(worker->efd);
+err_free:
+	free(worker);
+	return ERR_PTR(r);
+}
+
+void pmm__worker_kick(struct pmm_worker *worker)
+{
+	u64 data = 1;
+
+	if (write(worker->efd, &data, sizeof(data)) < 0)
+		pr_warning("PMM: unable to kick %s: %s", worker->name,
+			   strerror(errno));
+}
+
+void pmm__worker_free(struct pmm_worker *worker)
+{
+	pthread_cancel(worker->thread);
+	pthread_join(worker->thread, NULL);
+	close(worker->efd);
+	free(worker);
+}
+
+static int pmm__send_fds(int sock, void *buf, size_t len, int *fds, int nr_fds)
+{
+	char cbuf[CMSG_SPACE(sizeof(int) * PMM_LOOPBACK_MAX_FDS)];
+	struct iovec iov = {
+		.iov_base	= buf,
+		.iov_len	= len,
+	};
+	struct msghdr msg = {
+		.msg_iov	= &iov,
+		.msg_iovlen	= 1,
+		.msg_control	= cbuf,
+		.msg_controllen	= CMSG_SPACE(sizeof(int) * nr_fds),
+	};
+	struct cmsghdr *cmsg;
+
+	memset(cbuf, 0, sizeof(cbuf));
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nr_fds);
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nr_fds);
+
+	return sendmsg(sock, &msg, MSG_NOSIGNAL);
+}
+
+/* Hand the windows and both mailbox directions to a local frontend */
+static void pmm__loopback_accept(struct kvm *kvm, void *param)
+{
+	struct pmm_loopback_info info = {
+		.magic			= PMM_LOOPBACK_MAGIC,
+		.version		= PMM_LOOPBACK_VERSION,
+		.shmem_phys_addr	= kvm->cfg.hvl_shmem_phys_addr,
+		.shmem_size		= kvm->shmem_size,
+		.nr_windows		= kvm->cfg.nr_pmm_windows,
+	};
+	int fds[PMM_LOOPBACK_MAX_FDS] = {
+		kvm->shmem_fds[0],
+		kvm->doorbell_fd,
+		kvm->notif_fd,
+	};
+	int nr_fds = PMM_LOOPBACK_NR_FDS;
+	unsigned int i;
+	int sock;
+
+	for (i = 0; i < info.nr_windows; i++) {
+		info.windows[i].phys_addr = kvm->cfg.pmm_windows[i].phys_addr;
+		info.windows[i].size = kvm->cfg.pmm_windows[i].size;
+		if (i)
+			fds[nr_fds++] = kvm->shmem_fds[i];
+	}
+
+	sock = accept4(pmm_listener->fd, NULL, NULL, SOCK_CLOEXEC);
+	if (sock < 0) {
+		pr_warning("PMM: loopback accept failed: %s", strerror(errno));
+		return;
+	}
+
+	if (pmm__send_fds(sock, &info, sizeof(info), fds, nr_fds) < 0)
+		pr_warning("PMM: unable to pass the loopback fds: %s",
+			   strerror(errno));
+	else
+		pr_info("PMM: loopback frontend connected");
+
+	close(sock);
+}
+
+static int pmm__loopback_init(struct kvm *kvm)
+{
+	struct sockaddr_un addr = {
+		.sun_family	= AF_UNIX,
+	};
+	int sock, r;
+
+	if (!kvm->shmem_fds[0])
+		die("--pmm-loopback needs a shared memory pool (--shmem-size)");
+
+	kvm->doorbell_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	kvm->notif_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (kvm->doorbell_fd < 0 || kvm->notif_fd < 0)
+		die_perror("PMM: loopback eventfd");
+
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		die_perror("PMM: loopback socket");
+
+	if (strlcpy(addr.sun_path, kvm->cfg.pmm_loopback,
+		    sizeof(addr.sun_path)) >= sizeof(addr.sun_path))
+		die("PMM: loopback socket path too long");
+
+	unlink(kvm->cfg.pmm_loopback);
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(sock, 1) < 0) {
+		r = -errno;
+		goto err;
+	}
+
+	pmm_listener = malloc(sizeof(*pmm_listener));
+	if (!pmm_listener) {
+		r = -ENOMEM;
+		goto err;
+	}
+
+	*pmm_listener = (struct ioevent) {
+		.io_addr	= PMM_NOTIFY_ADDR,
+		.fn		= pmm__loopback_accept,
+		.fn_kvm		= kvm,
+		.fd		= sock,
+		.datamatch	= PMM_IOEVENT_LOOPBACK,
+		.flags		= IOEVENTFD_FLAG_USER_POLL | IOEVENTFD_FLAG_NO_READ,
+	};
+
+	return ioeventfd__add_epoll_event(pmm_listener, sock);
+
+err:
+	close(sock);
+	close(kvm->notif_fd);
+	close(kvm->doorbell_fd);
+	kvm->notif_fd = kvm->doorbell_fd = 0;
+	return r;
+}
+
+static int pmm__mbox_init(struct kvm *kvm)
+{
+	int fd;
+
+	if (kvm->cfg.pmm_loopback)
+		return pmm__loopback_init(kvm);
+
+	fd = open(PMM_MBOX_DEV, O_RDWR | O_NONBLOCK);
+	if (fd < 0)
+		die_perror("open " PMM_MBOX_DEV);
+
+	/* The mailbox char device carries both directions */
+	kvm->notif_fd = kvm->doorbell_fd = fd;
+
+	return 0;
+}
+
+int pmm__init(struct kvm *kvm)
+{
+	int r;
+
+	if (!kvm->cfg.pmm)
+		return 0;
+
+	pmm__phase("devices set up");
+
+	if (kvm->cfg.pmm_shmem_clear) {
+		r = shm_pool__clear_free(kvm, kvm->cfg.pmm_shmem_clear);
+		if (r < 0)
+			return r;
+		pmm__phase("free pool cleared");
+	}
+
+	r = pmm__mbox_init(kvm);
+	if (r < 0)
+		return r;
+
+	pmm_cpu.kvm = kvm;
+
+	/*
+	 * Pick up anything the frontend published before we started listening.
+	 * Doorbells rung in the meantime stay pending in the mailbox and are
+	 * reported as soon as the fd is added to the epoll set.
+	 */
+	pmm__dispatch(kvm);
+
+	pmm_doorbell = malloc(sizeof(*pmm_doorbell));
+	if (!pmm_doorbell)
+		return -ENOMEM;
+
+	*pmm_doorbell = (struct ioevent) {
+		.io_addr	= PMM_NOTIFY_ADDR,
+		.io_len		= sizeof(u32),
+		.fn		= pmm__doorbell_callback,
+		.fn_kvm		= kvm,
+		.fd		= kvm->doorbell_fd,
+		.datamatch	= PMM_IOEVENT_DOORBELL,
+		.flags		= IOEVENTFD_FLAG_USER_POLL | IOEVENTFD_FLAG_NO_READ,
+	};
+
+	r = ioeventfd__add_epoll_event(pmm_doorbell, kvm->doorbell_fd);
+	if (!r)
+		pmm__phase("listening for doorbells");
+
+	return r;
+}
+late_init(pmm__init);
+
+int pmm__exit(struct kvm *kvm)
+{
+	int i;
+
+	if (!kvm->cfg.pmm)
+		return 0;
+
+	/*
+	 * The ioevents were only added to the epoll set, never to KVM. Removing
+	 * them closes the doorbell fd (the mailbox, in mailbox mode) and the
+	 * loopback socket, and frees them.
+	 */
+	if (pmm_doorbell)
+		ioeventfd__del_epoll_event(pmm_doorbell);
+
+	if (pmm_listener) {
+		ioeventfd__del_epoll_event(pmm_listener);
+		unlink(kvm->cfg.pmm_loopback);
+	}
+
+	if (kvm->cfg.pmm_loopback) {
+		if (kvm->notif_fd)
+			close(kvm->notif_fd);
+		for (i = 0; i < kvm->cfg.nr_pmm_windows; i++)
+			close(kvm->shmem_fds[i]);
+	}
+
+	pmm_doorbell = pmm_listener = NULL;
+	kvm->notif_fd = kvm->doorbell_fd = 0;
+
+	return 0;
+}
+late_exit(pmm__exit);
@@ -0,0 +1,520 @@
+#include "kvm/shm-pool.h"
+
+#include "kvm/barrier.h"
+#include "kvm/fdt.h"
+#include "kvm/kvm.h"
+#include "kvm/mutex.h"
+#include "kvm/util.h"
+
+#include <linux/kernel.h>
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct shm_region {
+	struct list_head	list;
+	u64			offset;
+	u64			size;
+	u32			type;
+	u32			device_id;
+	void			*owner;
+};
+
+/* Each shared memory window is managed as a pool of its own */
+struct shm_pool {
+	struct list_head	regions;	/* sorted by offset */
+	struct shm_pool_map	*map;
+	void			*start;
+	u64			phys;
+	u64			size;
+	bool			ready;
+};
+
+static DEFINE_MUTEX(shm_pool_lock);
+static struct shm_pool shm_pools[PMM_MAX_WINDOWS];
+
+static unsigned int shm_pool__nr_windows(struct kvm *kvm)
+{
+	return max(kvm->cfg.nr_pmm_windows, 1);
+}
+
+/* Window 0 also backs the DTB when there is one */
+static struct shm_pool *shm_pool__get(struct kvm *kvm, unsigned int window)
+{
+	struct shm_pool *pool = &shm_pools[window];
+
+	if (window >= shm_pool__nr_windows(kvm))
+		return NULL;
+
+	if (!pool->ready) {
+		INIT_LIST_HEAD(&pool->regions);
+		if (window) {
+			pool->start = kvm->shmem_windows[window];
+			pool->phys = kvm->cfg.pmm_windows[window].phys_addr;
+			pool->size = kvm->cfg.pmm_windows[window].size;
+		} else {
+			pool->start = kvm->shmem_start;
+			pool->phys = kvm->cfg.hvl_shmem_phys_addr;
+			pool->size = kvm->cfg.hvl_shmem_size;
+		}
+	}
+
+	return pool;
+}
+
+/* Window holding phys, or NULL */
+static struct shm_pool *shm_pool__find(struct kvm *kvm, u64 phys)
+{
+	struct shm_pool *pool;
+	unsigned int i;
+
+	for (i = 0; i < shm_pool__nr_windows(kvm); i++) {
+		pool = shm_pool__get(kvm, i);
+		if (pool->start && phys >= pool->phys &&
+		    phys - pool->phys < pool->size)
+			return pool;
+	}
+
+	return NULL;
+}
+
+void *shm_pool__to_host(struct kvm *kvm, u64 phys)
+{
+	struct shm_pool *pool = shm_pool__find(kvm, phys);
+
+	if (!pool)
+		return NULL;
+
+	return pool->start + (phys - pool->phys);
+}
+
+/* Called with shm_pool_lock held */
+static void shm_pool__publish(struct shm_pool *pool)
+{
+	volatile u32 *gen;
+	struct shm_region *r;
+	u32 n = 0;
+
+	if (!pool->map)
+		return;
+
+	gen = &pool->map->generation;
+	*gen = *gen + 1;
+	wmb();
+
+	list_for_each_entry(r, &pool->regions, list) {
+		if (n == SHM_POOL_MAP_MAX_ENTRIES)
+			break;
+
+		pool->map->entries[n++] = (struct shm_pool_map_entry) {
+			.phys		= pool->phys + r->offset,
+			.size		= r->size,
+			.type		= r->type,
+			.device_id	= r->device_id,
+		};
+	}
+	pool->map->nr_entries = n;
+
+	wmb();
+	*gen = *gen + 1;
+}
+
+/* Called with shm_pool_lock held */
+static int shm_pool__insert(struct shm_pool *pool, u64 offset, u64 size,
+			    u32 type, u32 device_id, void *owner)
+{
+	struct shm_region *new, *r;
+	struct list_head *pos = &pool->regions;
+
+	new = malloc(sizeof(*new));
+	if (!new)
+		return -ENOMEM;
+
+	*new = (struct shm_region) {
+		.offset		= offset,
+		.size		= size,
+		.type		= type,
+		.device_id	= device_id,
+		.owner		= owner,
+	};
+
+	list_for_each_entry(r, &pool->regions, list) {
+		if (r->offset > offset) {
+			pos = &r->list;
+			break;
+		}
+	}
+	list_add_tail(&new->list, pos);
+
+	return 0;
+}
+
+/* Called with shm_pool_lock held */
+static bool shm_pool__busy(struct shm_pool *pool, u64 offset, u64 size)
+{
+	struct shm_region *r;
+
+	list_for_each_entry(r, &pool->regions, list) {
+		if (offset < r->offset + r->size && r->offset < offset + size)
+			return true;
+	}
+
+	return false;
+}
+
+/* Called with shm_pool_lock held */
+static int shm_pool__setup(struct kvm *kvm, struct shm_pool *pool)
+{
+	int r;
+
+	if (pool->ready)
+		return 0;
+
+	if (!pool->start || pool->size < 2 * SHM_POOL_PAGE_SIZE)
+		return -EINVAL;
+
+	pool->ready = true;
+
+	r = shm_pool__insert(pool, pool->size - SHM_POOL_PAGE_SIZE,
+			     SHM_POOL_PAGE_SIZE, SHM_REGION_MAP, 0, NULL);
+	if (r < 0)
+		return r;
+
+	pool->map = pool->start + pool->size - SHM_POOL_PAGE_SIZE;
+	memset(pool->map, 0, SHM_POOL_PAGE_SIZE);
+	pool->map->magic = SHM_POOL_MAP_MAGIC;
+	pool->map->version = SHM_POOL_MAP_VERSION;
+
+	/* The DTB is written to the start of the first window, see mmio.c */
+	if (pool == &shm_pools[0] && !kvm->cfg.no_dtb) {
+		r = shm_pool__insert(pool, 0, FDT_MAX_SIZE, SHM_REGION_DTB, 0,
+				     NULL);
+		memset(pool->start, 0, FDT_MAX_SIZE);
+	}
+
+	return r;
+}
+
+/* Highest placement of size bytes aligned to align within the gap */
+static bool shm_pool__fit(u64 base, u64 gap_start, u64 gap_end, u64 size,
+			  u64 align, u64 *offset)
+{
+	u64 phys;
+
+	if (gap_end < gap_start + size)
+		return false;
+
+	phys = (base + gap_end - size) & ~(align - 1);
+	if (phys < base + gap_start)
+		return false;
+
+	*offset = phys - base;
+
+	return true;
+}
+
+/*
+ * Carve size bytes out of a window, top-down, so that the fixed carve-outs
+ * at its start are left alone. align is a power of two and applies to the
+ * physical address seen by the remote side. Returns that address, or 0 if
+ * the window has no room left.
+ */
+u64 shm_pool__alloc(struct kvm *kvm, unsigned int window, u64 size, u64 align,
+		    u32 type, u32 device_id, void *owner)
+{
+	struct shm_pool *pool = shm_pool__get(kvm, window);
+	u64 gap_end, offset = 0;
+	struct shm_region *r;
+	bool found = false;
+
+	if (!pool || !pool->phys || !size)
+		return 0;
+
+	if (align < SHM_POOL_PAGE_SIZE)
+		align = SHM_POOL_PAGE_SIZE;
+	size = ALIGN(size, SHM_POOL_PAGE_SIZE);
+
+	mutex_lock(&shm_pool_lock);
+
+	if (shm_pool__setup(kvm, pool) < 0)
+		goto out;
+
+	gap_end = pool->size;
+	list_for_each_entry_reverse(r, &pool->regions, list) {
+		found = shm_pool__fit(pool->phys, r->offset + r->size, gap_end,
+				      size, align, &offset);
+		if (found)
+			break;
+		gap_end = r->offset;
+	}
+
+	if (!found)
+		found = shm_pool__fit(pool->phys, 0, gap_end, size, align,
+				      &offset);
+
+	if (found && shm_pool__insert(pool, offset, size, type, device_id,
+				      owner) < 0)
+		found = false;
+
+	/* The pool is not cleared as a whole, only what is handed out */
+	if (found) {
+		memset(pool->start + offset, 0, size);
+		shm_pool__publish(pool);
+	}
+out:
+	mutex_unlock(&shm_pool_lock);
+
+	return found ? pool->phys + offset : 0;
+}
+
+/* Claim a carve-out whose address is dictated by the layout */
+int shm_pool__reserve(struct kvm *kvm, u64 phys, u64 size, u32 type,
+		      u32 device_id, void *owner)
+{
+	struct shm_pool *pool = shm_pool__find(kvm, phys);
+	u64 offset;
+	int r;
+
+	if (!pool)
+		return -EINVAL;
+
+	offset = phys - pool->phys;
+
+	mutex_lock(&shm_pool_lock);
+
+	r = shm_pool__setup(kvm, pool);
+	if (r < 0)
+		goto out;
+
+	if (offset + size > pool->size ||
+	    shm_pool__busy(pool, offset, size)) {
+		r = -EBUSY;
+		goto out;
+	}
+
+	r = shm_pool__insert(pool, offset, size, type, device_id, owner);
+	if (!r) {
+		memset(pool->start + offset, 0, size);
+		shm_pool__publish(pool);
+	}
+out:
+	mutex_unlock(&shm_pool_lock);
+
+	return r;
+}
+
+/* Return every region of owner, in any window */
+void shm_pool__release(struct kvm *kvm, void *owner)
+{
+	struct shm_region *r, *n;
+	struct shm_pool *pool;
+	unsigned int i;
+	bool changed;
+
+	mutex_lock(&shm_pool_lock);
+
+	for (i = 0; i < PMM_MAX_WINDOWS; i++) {
+		pool = &shm_pools[i];
+		if (!pool->ready)
+			continue;
+
+		changed = false;
+		list_for_each_entry_safe(r, n, &pool->regions, list) {
+			if (r->owner != owner)
+				continue;
+
+			list_del(&r->list);
+			free(r);
+			changed = true;
+		}
+
+		if (changed)
+			shm_pool__publish(pool);
+	}
+
+	mutex_unlock(&shm_pool_lock);
+}
+
+/*
+ * Carve a buffer pool: its descriptor and free list, then the buffers
+ * themselves. Returns the descriptor, with all buffers free, and its
+ * physical address in *phys.
+ */
+struct shm_buf_pool *shm_pool__alloc_bufs(struct kvm *kvm, unsigned int window,
+					  u32 nr_bufs, u32 buf_size,
+					  u32 device_id, void *owner, u64 *phys)
+{
+	struct shm_buf_pool *pool;
+	u64 list_size;
+
+	if (!nr_bufs || !buf_size)
+		return NULL;
+
+	buf_size = ALIGN(buf_size, SHM_BUF_POOL_ALIGN);
+	list_size = ALIGN(sizeof(*pool) + sizeof(u32) * (u64)nr_bufs,
+			  SHM_BUF_POOL_ALIGN);
+
+	*phys = shm_pool__alloc(kvm, window, list_size + (u64)nr_bufs * buf_size,
+				0, SHM_REGION_BUFFERS, device_id, owner);
+	if (!*phys)
+		return NULL;
+
+	pool = shm_pool__to_host(kvm, *phys);
+	*pool = (struct shm_buf_pool) {
+		.magic		= SHM_BUF_POOL_MAGIC,
+		.buf_size	= buf_size,
+		.nr_bufs	= nr_bufs,
+		.bufs		= *phys + list_size,
+	};
+	shm_buf_pool__reset(pool);
+
+	return pool;
+}
+
+void shm_buf_pool__reset(struct shm_buf_pool *pool)
+{
+	u64 tag = (pool->free_head >> 32) + 1;
+	u32 i;
+
+	for (i = 0; i < pool->nr_bufs; i++)
+		pool->next[i] = i + 1 < pool->nr_bufs ? i + 2 : 0;
+
+	pool->free_head = tag << 32 | 1;
+
+	/* The list must be complete before the driver sees the pool ready */
+	wmb();
+	pool->state = SHM_BUF_POOL_READY;
+}
+
+struct shm_pool_chunk {
+	void	*addr;
+	u64	size;
+};
+
+struct shm_pool_clear {
+	struct shm_pool_chunk	*chunks;
+	unsigned int		nr_chunks;
+	unsigned int		next;
+};
+
+static void shm_pool__add_chunks(struct shm_pool *pool,
+				 struct shm_pool_clear *clear, u64 start, u64 end)
+{
+	u64 size;
+
+	for (; start < end; start += size) {
+		size = min(end - start, SHM_POOL_HUGE_SIZE);
+		clear->chunks[clear->nr_chunks++] = (struct shm_pool_chunk) {
+			.addr	= pool->start + start,
+			.size	= size,
+		};
+	}
+}
+
+static void *shm_pool__clear_thread(void *arg)
+{
+	struct shm_pool_clear *clear = arg;
+	unsigned int i;
+
+	while ((i = __sync_fetch_and_add(&clear->next, 1)) < clear->nr_chunks)
+		memset(clear->chunks[i].addr, 0, clear->chunks[i].size);
+
+	return NULL;
+}
+
+/*
+ * Zero whatever was not handed out yet in any window, split in
+ * SHM_POOL_HUGE_SIZE chunks that the calling thread and nr_threads - 1
+ * helpers pick up in turn.
+ */
+int shm_pool__clear_free(struct kvm *kvm, unsigned int nr_threads)
+{
+	struct shm_pool_clear clear = { };
+	unsigned int i, w, max_chunks = 0;
+	pthread_t *threads = NULL;
+	struct shm_pool *pool;
+	struct shm_region *r;
+	u64 gap_start;
+	int ret = 0;
+
+	mutex_lock(&shm_pool_lock);
+
+	/* Windows that no device was bound to are set up, and cleared, too */
+	for (w = 0; w < shm_pool__nr_windows(kvm); w++) {
+		pool = shm_pool__get(kvm, w);
+		ret = shm_pool__setup(kvm, pool);
+		if (ret < 0)
+			goto out;
+
+		max_chunks += pool->size / SHM_POOL_HUGE_SIZE + 1;
+		list_for_each_entry(r, &pool->regions, list)
+			max_chunks++;
+	}
+
+	if (!max_chunks)
+		goto out;
+
+	clear.chunks = calloc(max_chunks, sizeof(*clear.chunks));
+	threads = calloc(nr_threads, sizeof(*threads));
+	if (!clear.chunks || !threads) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+
+	for (w = 0; w < shm_pool__nr_windows(kvm); w++) {
+		pool = &shm_pools[w];
+		gap_start = 0;
+		list_for_each_entry(r, &pool->regions, list) {
+			shm_pool__add_chunks(pool, &clear, gap_start, r->offset);
+			gap_start = r->offset + r->size;
+		}
+		shm_pool__add_chunks(pool, &clear, gap_start, pool->size);
+	}
+
+	for (i = 0; i + 1 < nr_threads; i++) {
+		if (pthread_create(&threads[i], NULL, shm_pool__clear_thread, &clear)) {
+			pr_warning("shm-pool: clearing with %u threads only", i + 1);
+			break;
+		}
+	}
+
+	/* Takes over the remaining chunks if a helper could not start */
+	shm_pool__clear_thread(&clear);
+	while (i--)
+		pthread_join(threads[i], NULL);
+
+out_free:
+	free(threads);
+	free(clear.chunks);
+out:
+	mutex_unlock(&shm_pool_lock);
+
+	return ret;
+}
+
+int shm_pool__exit(struct kvm *kvm)
+{
+	struct shm_region *r, *n;
+	struct shm_pool *pool;
+	unsigned int i;
+
+	mutex_lock(&shm_pool_lock);
+
+	for (i = 0; i < PMM_MAX_WINDOWS; i++) {
+		pool = &shm_pools[i];
+		if (!pool->ready)
+			continue;
+
+		list_for_each_entry_safe(r, n, &pool->regions, list) {
+			list_del(&r->list);
+			free(r);
+		}
+		*pool = (struct shm_pool) { };
+	}
+
+	mutex_unlock(&shm_pool_lock);
+
+	return 0;
+}
+dev_exit(shm_pool__exit);
@@ -0,0 +1,211 @@
+/*
+ * Reference frontend of the PMM loopback transport (--pmm-loopback).
+ *
+ * It connects to the socket of a running lkvm, maps the shared pool and
+ * sets up the first queue of the first device found in the header slots
+ * (--no-dtb), resets the device and sets the queue up again, as a reloaded
+ * driver would. Each step is a doorbell round-trip:
+ * the frontend publishes the header and rings the doorbell, the PMM
+ * acknowledges through HVL_CFG_ACK and its notification eventfd.
+ *
+ * Usage: frontend <socket> [timeout in ms]
+ */
+#include "kvm/pmm.h"
+#include "kvm/virtio-mmio.h"
+
+#include <linux/virtio_config.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define QUEUE_NUM	16
+#define PAGE_SIZE	4096
+
+static struct pmm_loopback_info info;
+static int fds[PMM_LOOPBACK_MAX_FDS];
+static void *pool;
+static int timeout_ms = 5000;
+
+static void fail(const char *what)
+{
+	fprintf(stderr, "FAIL: %s\n", what);
+	exit(1);
+}
+
+static void loopback_connect(const char *path)
+{
+	char cbuf[CMSG_SPACE(sizeof(fds))];
+	struct sockaddr_un addr = {
+		.sun_family	= AF_UNIX,
+	};
+	struct iovec iov = {
+		.iov_base	= &info,
+		.iov_len	= sizeof(info),
+	};
+	struct msghdr msg = {
+		.msg_iov	= &iov,
+		.msg_iovlen	= 1,
+		.msg_control	= cbuf,
+		.msg_controllen	= sizeof(cbuf),
+	};
+	struct cmsghdr *cmsg;
+	int sock;
+
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		fail("connecting to the loopback socket");
+
+	if (recvmsg(sock, &msg, 0) < (ssize_t)offsetof(typeof(info), windows))
+		fail("receiving the loopback header");
+	close(sock);
+
+	if (info.magic != PMM_LOOPBACK_MAGIC || info.version < 2)
+		fail("unknown loopback header");
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS ||
+	    cmsg->cmsg_len < CMSG_LEN(sizeof(int) * PMM_LOOPBACK_NR_FDS))
+		fail("receiving the loopback fds");
+	memcpy(fds, CMSG_DATA(cmsg), cmsg->cmsg_len - CMSG_LEN(0));
+
+	pool = mmap(NULL, info.windows[0].size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED, fds[0], 0);
+	if (pool == MAP_FAILED)
+		fail("mapping the shared pool");
+}
+
+static u64 now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (u64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Ring the doorbell and wait for the notification that answers it */
+static u64 doorbell_round_trip(const char *what)
+{
+	struct pollfd pfd = {
+		.fd	= fds[2],
+		.events	= POLLIN,
+	};
+	u64 val = 1, start = now_us();
+
+	if (write(fds[1], &val, sizeof(val)) != sizeof(val))
+		fail("ringing the doorbell");
+
+	if (poll(&pfd, 1, timeout_ms) != 1) {
+		fprintf(stderr, "FAIL: no notification after %s\n", what);
+		exit(1);
+	}
+
+	if (read(fds[2], &val, sizeof(val)) != sizeof(val))
+		fail("reading the notification");
+
+	return now_us() - start;
+}
+
+/* The PMM only looks at the header while the generation is even */
+static void hdr_begin(volatile struct virtio_mmio_hdr *hdr)
+{
+	hdr->generation++;
+	__sync_synchronize();
+}
+
+static void hdr_end(volatile struct virtio_mmio_hdr *hdr)
+{
+	__sync_synchronize();
+	hdr->generation++;
+}
+
+static void setup_queue(volatile struct virtio_mmio_hdr *hdr, u64 ring)
+{
+	u32 num = hdr->queue_num_max ? hdr->queue_num_max : QUEUE_NUM;
+	u64 avail, used;
+
+	if (num > QUEUE_NUM)
+		num = QUEUE_NUM;
+
+	avail = ring + 16 * num;
+	used = (avail + 6 + 2 * num + PAGE_SIZE - 1) & ~(u64)(PAGE_SIZE - 1);
+
+	hdr_begin(hdr);
+	hdr->status = VIRTIO_CONFIG_S_ACKNOWLEDGE | VIRTIO_CONFIG_S_DRIVER;
+	hdr->queue_sel = 0;
+	hdr->queue_num = num;
+	if (hdr->version == 1) {
+		hdr->guest_page_size = PAGE_SIZE;
+		hdr->queue_align = PAGE_SIZE;
+		hdr->queue_pfn = ring / PAGE_SIZE;
+	} else {
+		hdr->queue_desc_low = ring;
+		hdr->queue_desc_high = ring >> 32;
+		hdr->queue_avail_low = avail;
+		hdr->queue_avail_high = avail >> 32;
+		hdr->queue_used_low = used;
+		hdr->queue_used_high = used >> 32;
+		hdr->queue_ready = 1;
+	}
+	hdr_end(hdr);
+}
+
+int main(int argc, char *argv[])
+{
+	volatile struct virtio_mmio_hdr *hdr;
+	u64 base, ring, us;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s <socket> [timeout in ms]\n", argv[0]);
+		return 2;
+	}
+	if (argc > 2)
+		timeout_ms = atoi(argv[2]);
+
+	loopback_connect(argv[1]);
+
+	hdr = pool;
+	if (memcmp((void *)hdr->magic, "virt", 4))
+		fail("no device header at the start of the pool (--no-dtb?)");
+
+	/* The ring goes into the region of the device, or the middle of the pool */
+	base = info.windows[0].phys_addr;
+	ring = (u64)hdr->shm_base_high << 32 | hdr->shm_base_low;
+	if (ring < base || ring + 4 * PAGE_SIZE > base + info.windows[0].size)
+		ring = base + info.windows[0].size / 2;
+
+	setup_queue(hdr, ring);
+	us = doorbell_round_trip("the queue setup");
+	if ((hdr->version == 1 ? hdr->queue_pfn : hdr->queue_ready) != HVL_CFG_ACK)
+		fail("the queue setup was not acknowledged");
+	printf("device %u: queue set up in %llu us\n", hdr->device_id,
+	       (unsigned long long)us);
+
+	hdr_begin(hdr);
+	hdr->status = 0;
+	hdr_end(hdr);
+	us = doorbell_round_trip("the reset");
+	printf("device %u: reset in %llu us\n", hdr->device_id,
+	       (unsigned long long)us);
+
+	/* A new driver instance starts over from queue 0 */
+	setup_queue(hdr, ring);
+	doorbell_round_trip("the queue setup after the reset");
+	if ((hdr->version == 1 ? hdr->queue_pfn : hdr->queue_ready) != HVL_CFG_ACK)
+		fail("the queue setup after the reset was not acknowledged");
+
+	printf("PASS\n");
+
+	return 0;
+}
@@ -0,0 +1,24 @@
+#!/bin/sh
+#
+# Start lkvm in PMM loopback mode and drive it with the reference frontend.
+# No KVM is needed, so this can run in CI.
+#
+# Usage: run.sh <lkvm> [extra lkvm run options]
+
+LKVM=${1:-./lkvm}
+[ $# -gt 0 ] && shift
+DIR=$(dirname "$0")
+SOCK=$(mktemp -u /tmp/pmm-loopback.XXXXXX)
+
+"$LKVM" run --rsld --pmm --transport mmio \
+	--shmem-addr 0x77000000 --shmem-size 0x1000000 \
+	--no-dtb --rng --pmm-loopback "$SOCK" "$@" &
+PID=$!
+trap 'kill $PID 2>/dev/null; wait $PID 2>/dev/null; rm -f "$SOCK"' EXIT
+
+for i in $(seq 50); do
+	[ -S "$SOCK" ] && break
+	sleep 0.1
+done
+
+"$DIR/frontend" "$SOCK"
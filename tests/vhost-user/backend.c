@@ -0,0 +1,381 @@
+/*
+ * Reference backend of the vhost-user frontend (virtio/vhost-user.c).
+ *
+ * It serves a single frontend on a UNIX socket and checks the order of the
+ * start and stop handshake of each ring: SET_VRING_NUM, SET_VRING_BASE,
+ * SET_VRING_ADDR and SET_VRING_CALL must come before SET_VRING_KICK, which
+ * starts the ring, and GET_VRING_BASE stops it. The guest memory is mapped
+ * from the SET_MEM_TABLE fds. A started ring has a trivial datapath: every
+ * buffer made available is put in the used ring right away, with a length
+ * of 0, and the call fd is signalled.
+ *
+ * The backend exits once the frontend hangs up, and succeeds if the
+ * protocol was followed and every ring it started was stopped.
+ *
+ * Usage: backend <socket>
+ */
+#include "kvm/vhost-user.h"
+
+#include <linux/virtio_config.h>
+#include <linux/virtio_net.h>
+#include <linux/virtio_ring.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define NR_QUEUE_PAIRS		2
+#define NR_VRINGS		(NR_QUEUE_PAIRS * 2)
+
+/* The requests that must have set a ring up before its kick */
+#define VRING_SETUP		(1 << VHOST_USER_SET_VRING_NUM |	\
+				 1 << VHOST_USER_SET_VRING_BASE |	\
+				 1 << VHOST_USER_SET_VRING_ADDR |	\
+				 1 << VHOST_USER_SET_VRING_CALL)
+
+struct region {
+	u64	uva;
+	u64	size;
+	void	*map;
+	u64	map_size;
+	void	*base;
+};
+
+struct vring_state {
+	u32			num;
+	u16			last_avail;
+	struct vhost_vring_addr	addr;
+	struct vring_desc	*desc;
+	struct vring_avail	*avail;
+	struct vring_used	*used;
+	int			kick_fd;
+	int			call_fd;
+	/* Requests received since the ring was last stopped */
+	u32			setup;
+	bool			started;
+};
+
+static struct region regions[VHOST_USER_MAX_REGIONS];
+static u32 nr_regions;
+static struct vring_state vrings[NR_VRINGS];
+static u64 features;
+static int sock;
+static u32 nr_started, nr_stopped, nr_used;
+
+static void fail(const char *what)
+{
+	fprintf(stderr, "backend: FAIL: %s\n", what);
+	exit(1);
+}
+
+/* Our mapping of a range of the frontend's address space, or NULL */
+static void *backend_map(u64 uva, u64 len)
+{
+	u32 i;
+
+	for (i = 0; i < nr_regions; i++) {
+		if (uva >= regions[i].uva &&
+		    uva + len <= regions[i].uva + regions[i].size)
+			return regions[i].base + (uva - regions[i].uva);
+	}
+
+	return NULL;
+}
+
+static void set_mem_table(struct vhost_user_msg *msg, int *fds, int nr_fds)
+{
+	struct vhost_user_region r;
+	u32 i;
+
+	for (i = 0; i < nr_regions; i++)
+		munmap(regions[i].map, regions[i].map_size);
+	nr_regions = 0;
+
+	if (msg->payload.memory.nregions != (u32)nr_fds)
+		fail("SET_MEM_TABLE without an fd per region");
+
+	for (i = 0; i < msg->payload.memory.nregions; i++) {
+		r = msg->payload.memory.regions[i];
+		regions[i] = (struct region) {
+			.uva		= r.userspace_addr,
+			.size		= r.memory_size,
+			.map_size	= r.mmap_offset + r.memory_size,
+		};
+		regions[i].map = mmap(NULL, regions[i].map_size,
+				      PROT_READ | PROT_WRITE, MAP_SHARED,
+				      fds[i], 0);
+		if (regions[i].map == MAP_FAILED)
+			fail("mapping the guest memory");
+		regions[i].base = regions[i].map + r.mmap_offset;
+		close(fds[i]);
+	}
+	nr_regions = i;
+}
+
+static struct vring_state *vring_of(u32 index)
+{
+	if (index >= NR_VRINGS)
+		fail("ring index out of range");
+
+	return &vrings[index];
+}
+
+static void vring_start(struct vring_state *vr, int kick_fd)
+{
+	struct vhost_vring_addr *addr = &vr->addr;
+
+	if ((vr->setup & VRING_SETUP) != VRING_SETUP)
+		fail("SET_VRING_KICK before the ring was set up");
+	if (vr->started)
+		fail("SET_VRING_KICK on a started ring");
+
+	vr->desc = backend_map(addr->desc_user_addr,
+			       sizeof(*vr->desc) * vr->num);
+	vr->avail = backend_map(addr->avail_user_addr,
+				sizeof(*vr->avail) + 2 * vr->num);
+	vr->used = backend_map(addr->used_user_addr,
+			       sizeof(*vr->used) +
+			       sizeof(vr->used->ring[0]) * vr->num);
+	if (!vr->desc || !vr->avail || !vr->used)
+		fail("ring outside of the memory table");
+
+	vr->kick_fd = kick_fd;
+	vr->started = true;
+	nr_started++;
+}
+
+/* Hand back every buffer that was made available, as the datapath would */
+static void vring_process(struct vring_state *vr)
+{
+	u16 avail_idx = vr->avail->idx;
+	struct vring_used_elem *elem;
+	u64 val;
+
+	if (read(vr->kick_fd, &val, sizeof(val)) < 0)
+		fail("reading the kick fd");
+
+	__sync_synchronize();
+	while (vr->last_avail != avail_idx) {
+		elem = &vr->used->ring[vr->used->idx % vr->num];
+		elem->id = vr->avail->ring[vr->last_avail % vr->num];
+		elem->len = 0;
+		__sync_synchronize();
+		vr->used->idx++;
+		vr->last_avail++;
+		nr_used++;
+	}
+
+	val = 1;
+	if (write(vr->call_fd, &val, sizeof(val)) < 0)
+		fail("writing the call fd");
+}
+
+static void reply(struct vhost_user_msg *msg, u32 size)
+{
+	msg->flags = VHOST_USER_VERSION | VHOST_USER_FLAG_REPLY;
+	msg->size = size;
+
+	if (write(sock, msg, VHOST_USER_HDR_SIZE + size) !=
+	    (ssize_t)(VHOST_USER_HDR_SIZE + size))
+		fail("sending a reply");
+}
+
+static void close_fds(int *fds, int nr_fds)
+{
+	while (nr_fds--)
+		close(fds[nr_fds]);
+}
+
+/* Returns false once the frontend hung up */
+static bool handle_request(void)
+{
+	char cbuf[CMSG_SPACE(sizeof(int) * VHOST_USER_MAX_REGIONS)];
+	int fds[VHOST_USER_MAX_REGIONS];
+	struct vhost_user_msg msg;
+	struct iovec iov = {
+		.iov_base	= &msg,
+		.iov_len	= VHOST_USER_HDR_SIZE,
+	};
+	struct msghdr mh = {
+		.msg_iov	= &iov,
+		.msg_iovlen	= 1,
+		.msg_control	= cbuf,
+		.msg_controllen	= sizeof(cbuf),
+	};
+	struct vring_state *vr;
+	struct cmsghdr *cmsg;
+	int nr_fds = 0;
+	ssize_t r;
+
+	r = recvmsg(sock, &mh, MSG_WAITALL);
+	if (r == 0)
+		return false;
+	if (r != (ssize_t)VHOST_USER_HDR_SIZE)
+		fail("receiving a request");
+
+	cmsg = CMSG_FIRSTHDR(&mh);
+	if (cmsg && cmsg->cmsg_type == SCM_RIGHTS) {
+		nr_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * nr_fds);
+	}
+
+	if ((msg.flags & 0x3) != VHOST_USER_VERSION ||
+	    msg.size > sizeof(msg.payload))
+		fail("bad request header");
+	if (msg.size &&
+	    recv(sock, &msg.payload, msg.size, MSG_WAITALL) != (ssize_t)msg.size)
+		fail("receiving a request payload");
+
+	switch (msg.request) {
+	case VHOST_USER_GET_FEATURES:
+		msg.payload.u64 = 1ULL << VIRTIO_F_VERSION_1 |
+				  1ULL << VIRTIO_NET_F_MRG_RXBUF |
+				  1ULL << VHOST_USER_F_PROTOCOL_FEATURES;
+		reply(&msg, sizeof(msg.payload.u64));
+		break;
+	case VHOST_USER_SET_FEATURES:
+		features = msg.payload.u64;
+		break;
+	case VHOST_USER_GET_PROTOCOL_FEATURES:
+		msg.payload.u64 = 1ULL << VHOST_USER_PROTOCOL_F_MQ;
+		reply(&msg, sizeof(msg.payload.u64));
+		break;
+	case VHOST_USER_GET_QUEUE_NUM:
+		msg.payload.u64 = NR_QUEUE_PAIRS;
+		reply(&msg, sizeof(msg.payload.u64));
+		break;
+	case VHOST_USER_SET_MEM_TABLE:
+		set_mem_table(&msg, fds, nr_fds);
+		nr_fds = 0;
+		break;
+	case VHOST_USER_SET_VRING_NUM:
+		vr = vring_of(msg.payload.state.index);
+		vr->num = msg.payload.state.num;
+		vr->setup |= 1 << msg.request;
+		break;
+	case VHOST_USER_SET_VRING_BASE:
+		vr = vring_of(msg.payload.state.index);
+		vr->last_avail = msg.payload.state.num;
+		vr->setup |= 1 << msg.request;
+		break;
+	case VHOST_USER_SET_VRING_ADDR:
+		vr = vring_of(msg.payload.addr.index);
+		vr->addr = msg.payload.addr;
+		vr->setup |= 1 << msg.request;
+		break;
+	case VHOST_USER_SET_VRING_CALL:
+		if (nr_fds != 1)
+			fail("SET_VRING_CALL without an fd");
+		vr = vring_of(msg.payload.u64 & 0xff);
+		if (vr->setup & 1 << msg.request)
+			close(vr->call_fd);
+		vr->call_fd = fds[0];
+		vr->setup |= 1 << msg.request;
+		nr_fds = 0;
+		break;
+	case VHOST_USER_SET_VRING_KICK:
+		if (nr_fds != 1)
+			fail("SET_VRING_KICK without an fd");
+		vring_start(vring_of(msg.payload.u64 & 0xff), fds[0]);
+		nr_fds = 0;
+		break;
+	case VHOST_USER_GET_VRING_BASE:
+		vr = vring_of(msg.payload.state.index);
+		if (!vr->started)
+			fail("GET_VRING_BASE on a stopped ring");
+
+		msg.payload.state.num = vr->last_avail;
+		close(vr->kick_fd);
+		close(vr->call_fd);
+		*vr = (struct vring_state) { };
+		reply(&msg, sizeof(msg.payload.state));
+		nr_stopped++;
+		break;
+	case VHOST_USER_SET_OWNER:
+	case VHOST_USER_SET_PROTOCOL_FEATURES:
+	case VHOST_USER_SET_VRING_ENABLE:
+		break;
+	default:
+		fprintf(stderr, "backend: unknown request %u\n", msg.request);
+		fail("unexpected request");
+	}
+
+	close_fds(fds, nr_fds);
+
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	struct sockaddr_un addr = {
+		.sun_family	= AF_UNIX,
+	};
+	struct pollfd pfds[1 + NR_VRINGS];
+	u32 i, nr;
+	int lsock;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s <socket>\n", argv[0]);
+		return 2;
+	}
+
+	strncpy(addr.sun_path, argv[1], sizeof(addr.sun_path) - 1);
+	unlink(addr.sun_path);
+
+	lsock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (lsock < 0 || bind(lsock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(lsock, 1) < 0)
+		fail("listening on the socket");
+
+	sock = accept(lsock, NULL, NULL);
+	if (sock < 0)
+		fail("accepting the frontend");
+	close(lsock);
+	unlink(addr.sun_path);
+
+	for (;;) {
+		pfds[0] = (struct pollfd) { .fd = sock, .events = POLLIN };
+		for (i = 0, nr = 1; i < NR_VRINGS; i++) {
+			if (vrings[i].started)
+				pfds[nr++] = (struct pollfd) {
+					.fd	= vrings[i].kick_fd,
+					.events	= POLLIN,
+				};
+		}
+
+		if (poll(pfds, nr, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			fail("polling");
+		}
+
+		/* Kicks first, the request may stop their ring */
+		for (i = 0, nr = 1; i < NR_VRINGS; i++) {
+			if (!vrings[i].started)
+				continue;
+			if (pfds[nr++].revents & POLLIN)
+				vring_process(&vrings[i]);
+		}
+
+		if ((pfds[0].revents & (POLLIN | POLLHUP)) && !handle_request())
+			break;
+	}
+
+	printf("backend: %u rings started, %u stopped, %u buffers used\n",
+	       nr_started, nr_stopped, nr_used);
+	if (nr_started != nr_stopped)
+		fail("rings left running when the frontend hung up");
+	if (!(features & 1ULL << VIRTIO_F_VERSION_1))
+		fail("VIRTIO_F_VERSION_1 was not acknowledged");
+
+	printf("backend: PASS\n");
+
+	return 0;
+}
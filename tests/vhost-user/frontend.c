@@ -0,0 +1,208 @@
+/*
+ * Drives the vhost-user frontend (virtio/vhost-user.c) against the reference
+ * backend, without KVM: the guest memory is a shared memfd mapping, as with
+ * a vhost-user device, and the rings are set up by hand where a driver
+ * would put them.
+ *
+ * It goes through the lifetime of a device as virtio-net drives it: the
+ * connection and feature negotiation, the memory table, starting the rings,
+ * a buffer round-trip through kick and call, switching the call fd of a
+ * running ring (a new MSI route), stopping the rings on reset and starting
+ * them again.
+ *
+ * Usage: frontend <socket>
+ */
+#include "kvm/kvm.h"
+#include "kvm/vhost-user.h"
+#include "kvm/virtio.h"
+
+#include <linux/virtio_config.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+
+#define RAM_SIZE		(1 << 20)
+#define RING_NUM		16
+#define RING_SIZE		0x4000
+#define NR_VRINGS		2
+#define TIMEOUT_MS		5000
+
+static struct kvm kvm = {
+	.cfg.mem_shared		= true,
+};
+static void *ram;
+
+struct test_vring {
+	struct virt_queue	vq;
+	int			kick_fd;
+	int			call_fd;
+};
+
+static struct test_vring vrings[NR_VRINGS];
+
+/* The RAM of the test is a single bank, there is no guest */
+int kvm__for_each_mem_bank(struct kvm *kvm, enum kvm_mem_type type,
+			   int (*fun)(struct kvm *kvm, struct kvm_mem_bank *bank, void *data),
+			   void *data)
+{
+	struct kvm_mem_bank bank = {
+		.guest_phys_addr	= 0,
+		.host_addr		= ram,
+		.size			= RAM_SIZE,
+		.type			= KVM_MEM_TYPE_RAM,
+	};
+
+	return fun(kvm, &bank, data);
+}
+
+static void check(int r, const char *what)
+{
+	if (r < 0) {
+		fprintf(stderr, "FAIL: %s: %s\n", what, strerror(-r));
+		exit(1);
+	}
+}
+
+static void fail(const char *what)
+{
+	fprintf(stderr, "FAIL: %s\n", what);
+	exit(1);
+}
+
+static int connect_backend(struct vhost_user *vu, const char *path)
+{
+	int i, r;
+
+	/* The backend may not be listening yet */
+	for (i = 0; i < 50; i++) {
+		r = vhost_user__init(vu, path);
+		if (r != -ENOENT && r != -ECONNREFUSED)
+			break;
+		usleep(100000);
+	}
+
+	return r;
+}
+
+static void start_vrings(struct vhost_user *vu)
+{
+	struct test_vring *tv;
+	u32 i;
+
+	for (i = 0; i < NR_VRINGS; i++) {
+		tv = &vrings[i];
+		memset(ram + i * RING_SIZE, 0, RING_SIZE);
+		vring_init(&tv->vq.vring, RING_NUM, ram + i * RING_SIZE, 4096);
+
+		tv->kick_fd = eventfd(0, 0);
+		tv->call_fd = eventfd(0, 0);
+		if (tv->kick_fd < 0 || tv->call_fd < 0)
+			fail("creating the eventfds");
+
+		check(vhost_user__start_vring(vu, i, &tv->vq, tv->kick_fd,
+					      tv->call_fd),
+		      "starting a ring");
+	}
+}
+
+static void stop_vrings(struct vhost_user *vu)
+{
+	u32 i;
+
+	for (i = 0; i < NR_VRINGS; i++) {
+		check(vhost_user__stop_vring(vu, i), "stopping a ring");
+		close(vrings[i].kick_fd);
+		close(vrings[i].call_fd);
+	}
+}
+
+/* Make a buffer available, kick and wait for the backend to use it */
+static void round_trip(struct test_vring *tv, u16 head)
+{
+	struct vring *vring = &tv->vq.vring;
+	struct pollfd pfd = {
+		.fd	= tv->call_fd,
+		.events	= POLLIN,
+	};
+	u16 idx = vring->avail->idx;
+	u64 val = 1;
+
+	vring->desc[head] = (struct vring_desc) {
+		.addr	= RAM_SIZE / 2,
+		.len	= 64,
+	};
+	vring->avail->ring[idx % vring->num] = head;
+	__sync_synchronize();
+	vring->avail->idx = idx + 1;
+
+	if (write(tv->kick_fd, &val, sizeof(val)) != sizeof(val))
+		fail("kicking the backend");
+
+	if (poll(&pfd, 1, TIMEOUT_MS) != 1 ||
+	    read(tv->call_fd, &val, sizeof(val)) != sizeof(val))
+		fail("no call from the backend");
+
+	__sync_synchronize();
+	if (vring->used->idx != (u16)(idx + 1) ||
+	    vring->used->ring[idx % vring->num].id != head)
+		fail("the buffer was not used");
+}
+
+int main(int argc, char *argv[])
+{
+	struct vhost_user vu;
+	int fd;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s <socket>\n", argv[0]);
+		return 2;
+	}
+
+	ram = mmap_anon_or_hugetlbfs(&kvm, NULL, RAM_SIZE);
+	if (ram == MAP_FAILED)
+		fail("allocating the shared memory");
+
+	check(connect_backend(&vu, argv[1]), "connecting to the backend");
+	if (!(vu.features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES)) ||
+	    vu.queue_num < 1)
+		fail("unexpected backend features");
+	printf("features %#llx, %u queue pairs\n",
+	       (unsigned long long)vu.features, vu.queue_num);
+
+	check(vhost_user__set_features(&vu, 1ULL << VIRTIO_F_VERSION_1),
+	      "setting the features");
+	check(vhost_user__set_mem_table(&vu, &kvm), "setting the memory table");
+
+	start_vrings(&vu);
+	round_trip(&vrings[0], 0);
+	round_trip(&vrings[1], 3);
+	printf("rings started, buffers used\n");
+
+	/* notify_vq_gsi() switches a running ring to the new irqfd */
+	fd = eventfd(0, 0);
+	if (fd < 0)
+		fail("creating an eventfd");
+	check(vhost_user__set_vring_call(&vu, 1, fd), "switching the call fd");
+	close(vrings[1].call_fd);
+	vrings[1].call_fd = fd;
+	round_trip(&vrings[1], 5);
+	printf("call fd switched\n");
+
+	/* A reset stops the rings, the next DRIVER_OK starts them from 0 */
+	stop_vrings(&vu);
+	start_vrings(&vu);
+	round_trip(&vrings[0], 1);
+	stop_vrings(&vu);
+	printf("rings restarted after a reset\n");
+
+	vhost_user__exit(&vu);
+	printf("PASS\n");
+
+	return 0;
+}
@@ -0,0 +1,18 @@
+#!/bin/sh
+#
+# Run the vhost-user frontend against the reference backend. No KVM is
+# needed, so this can run in CI.
+#
+# Usage: run.sh
+
+DIR=$(dirname "$0")
+SOCK=$(mktemp -u /tmp/vhost-user.XXXXXX)
+
+"$DIR/backend" "$SOCK" &
+PID=$!
+trap 'kill $PID 2>/dev/null; rm -f "$SOCK"' EXIT
+
+"$DIR/frontend" "$SOCK" || exit 1
+
+# The backend checks the handshake once the frontend hung up
+wait $PID
@@ -0,0 +1,23 @@
+#!/bin/sh
+#
+# Run the AF_XDP smoke test on a throwaway veth pair, with and without busy
+# polling. Creating the pair and loading the XDP program need root, so the
+# test is skipped otherwise.
+#
+# Usage: run.sh
+
+DIR=$(dirname "$0")
+IF=lkvm-xsk$$
+PEER=lkvm-xskp$$
+
+if [ "$(id -u)" != 0 ] || ! command -v ip >/dev/null; then
+	echo "SKIP: the veth smoke test needs root and ip(8)"
+	exit 0
+fi
+
+ip link add "$IF" type veth peer name "$PEER" || exit 1
+trap 'ip link del "$IF" 2>/dev/null' EXIT
+ip link set "$IF" up && ip link set "$PEER" up || exit 1
+
+timeout 10 "$DIR/veth" "$IF" "$PEER" &&
+timeout 10 "$DIR/veth" "$IF" "$PEER" 50
@@ -0,0 +1,165 @@
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "kvm/barrier.h"
+#include "kvm/uring.h"
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned int to_submit,
+			  unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+		       NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned int opcode, const void *arg,
+			     unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+int uring__init(struct uring *ring, unsigned int entries)
+{
+	struct io_uring_params p;
+	void *sq, *cq;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&p, 0, sizeof(p));
+
+	ring->fd = io_uring_setup(entries, &p);
+	if (ring->fd < 0)
+		return -errno;
+
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	sq = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		goto err;
+	ring->sq_ring = sq;
+
+	cq = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	if (cq == MAP_FAILED)
+		goto err;
+	ring->cq_ring = cq;
+
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		goto err;
+	}
+
+	ring->sq_entries	= p.sq_entries;
+	ring->sq_head		= sq + p.sq_off.head;
+	ring->sq_tail		= sq + p.sq_off.tail;
+	ring->sq_mask		= sq + p.sq_off.ring_mask;
+	ring->sq_array		= sq + p.sq_off.array;
+	ring->cq_head		= cq + p.cq_off.head;
+	ring->cq_tail		= cq + p.cq_off.tail;
+	ring->cq_mask		= cq + p.cq_off.ring_mask;
+	ring->cqes		= cq + p.cq_off.cqes;
+
+	return 0;
+
+err:
+	uring__exit(ring);
+	return -ENOMEM;
+}
+
+/* Pending requests are cancelled by the kernel when the ring goes away */
+void uring__exit(struct uring *ring)
+{
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	if (ring->sq_ring)
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	if (ring->fd >= 0)
+		close(ring->fd);
+
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = -1;
+}
+
+/* Returns a cleared submission entry, or NULL when the ring is full */
+struct io_uring_sqe *uring__get_sqe(struct uring *ring)
+{
+	unsigned int head = *(volatile unsigned int *)ring->sq_head;
+	unsigned int tail = *ring->sq_tail + ring->sq_pending;
+	unsigned int idx;
+
+	if (tail - head >= ring->sq_entries)
+		return NULL;
+
+	idx = tail & *ring->sq_mask;
+	ring->sq_array[idx] = idx;
+	ring->sq_pending++;
+	memset(&ring->sqes[idx], 0, sizeof(ring->sqes[idx]));
+
+	return &ring->sqes[idx];
+}
+
+/*
+ * Hand the pending entries to the kernel in one call, and wait until
+ * wait_nr completions are available. Entries that the kernel did not take,
+ * because a previous call failed with EBUSY or EAGAIN, are submitted again.
+ */
+int uring__submit(struct uring *ring, unsigned int wait_nr)
+{
+	unsigned int nr;
+	int r;
+
+	/* The entries must be visible before the tail that publishes them */
+	wmb();
+	*ring->sq_tail += ring->sq_pending;
+	ring->sq_pending = 0;
+	nr = *ring->sq_tail - *(volatile unsigned int *)ring->sq_head;
+
+	do {
+		r = io_uring_enter(ring->fd, nr, wait_nr,
+				   wait_nr ? IORING_ENTER_GETEVENTS : 0);
+	} while (r < 0 && errno == EINTR && !nr);
+
+	return r < 0 ? -errno : r;
+}
+
+struct io_uring_cqe *uring__peek_cqe(struct uring *ring)
+{
+	unsigned int head = *ring->cq_head;
+
+	if (head == *(volatile unsigned int *)ring->cq_tail)
+		return NULL;
+
+	/* Read the entry only after the tail that published it */
+	rmb();
+
+	return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring__cqe_seen(struct uring *ring)
+{
+	/* The entry was read before the kernel may reuse it */
+	mb();
+	(*ring->cq_head)++;
+}
+
+int uring__register_buffers(struct uring *ring, const struct iovec *iov,
+			    unsigned int nr)
+{
+	if (io_uring_register(ring->fd, IORING_REGISTER_BUFFERS, iov, nr) < 0)
+		return -errno;
+
+	return 0;
+}
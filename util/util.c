@@ -5,6 +5,7 @@
 #include "kvm/util.h"
 
 #include <kvm/kvm.h>
+#include <linux/list.h>
 #include <linux/magic.h>	/* For HUGETLBFS_MAGIC */
 #include <sys/mman.h>
 #include <sys/stat.h>
@@ -81,6 +82,54 @@ void die_perror(const char *s)
 	exit(1);
 }
 
+/* Guest memory backed by a file, which another process may map as well */
+struct mmap_shared {
+	struct list_head	list;
+	void			*addr;
+	u64			size;
+	int			fd;
+};
+
+static LIST_HEAD(mmap_shared_list);
+
+static void *mmap_shared(int fd, u64 size)
+{
+	struct mmap_shared *m;
+	void *addr;
+
+	addr = mmap(NULL, size, PROT_RW, MAP_SHARED | MAP_NORESERVE, fd, 0);
+	m = malloc(sizeof(*m));
+	if (addr == MAP_FAILED || !m) {
+		free(m);
+		close(fd);
+		return MAP_FAILED;
+	}
+
+	*m = (struct mmap_shared) {
+		.addr	= addr,
+		.size	= size,
+		.fd	= fd,
+	};
+	list_add_tail(&m->list, &mmap_shared_list);
+
+	return addr;
+}
+
+/* The file backing the memory at addr and the offset of addr in it, or -1 */
+int mmap_shared_fd(void *addr, u64 *offset)
+{
+	struct mmap_shared *m;
+
+	list_for_each_entry(m, &mmap_shared_list, list) {
+		if (addr >= m->addr && addr < m->addr + m->size) {
+			*offset = addr - m->addr;
+			return m->fd;
+		}
+	}
+
+	return -1;
+}
+
 void *mmap_hugetlbfs(struct kvm *kvm, const char *htlbfs_path, u64 size)
 {
 	char mpath[PATH_MAX];
@@ -111,6 +160,9 @@ void *mmap_hugetlbfs(struct kvm *kvm, const char *htlbfs_path, u64 size)
 	if (ftruncate(fd, size) < 0)
 		die("Can't ftruncate for mem mapping size %lld\n",
 			(unsigned long long)size);
+	if (kvm->cfg.mem_shared)
+		return mmap_shared(fd, size);
+
 	addr = mmap(NULL, size, PROT_RW, MAP_PRIVATE, fd, 0);
 	close(fd);
 
@@ -126,7 +178,15 @@ void *mmap_anon_or_hugetlbfs(struct kvm *kvm, const char *hugetlbfs_path, u64 si
 		 * if the user specifies a hugetlbfs path.
 		 */
 		return mmap_hugetlbfs(kvm, hugetlbfs_path, size);
-	else {
+	else if (kvm->cfg.mem_shared) {
+		int fd = memfd_create("lkvm-ram", MFD_CLOEXEC);
+
+		if (fd < 0 || ftruncate(fd, size) < 0)
+			die_perror("Can't create a memfd for guest memory");
+
+		kvm->ram_pagesize = getpagesize();
+		return mmap_shared(fd, size);
+	} else {
 		kvm->ram_pagesize = getpagesize();
 		return mmap(NULL, size, PROT_RW, MAP_ANON_NORESERVE, -1, 0);
 	}
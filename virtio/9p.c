@@ -1353,7 +1353,7 @@ static bool virtio_p9_do_io_request(struct kvm *kvm, struct p9_dev_job *job)
 		handler = virtio_9p_dotl_handler[cmd];
 
 	handler(p9dev, p9pdu, &len);
-	virt_queue__set_used_elem(vq, p9pdu->queue_head, len);
+	virt_queue__used_batch_add(vq, p9pdu->queue_head, len);
 	free(p9pdu);
 	return true;
 }
@@ -1364,10 +1364,11 @@ static void virtio_p9_do_io(struct kvm *kvm, void *param)
 	struct p9_dev *p9dev   = job->p9dev;
 	struct virt_queue *vq  = job->vq;
 
-	while (virt_queue__available(vq)) {
+	while (virt_queue__available(vq))
 		virtio_p9_do_io_request(kvm, job);
+
+	if (virt_queue__used_batch_flush(vq) && virtio_queue__should_signal(vq))
 		p9dev->vdev.ops->signal_vq(kvm, &p9dev->vdev, vq - p9dev->vqs);
-	}
 }
 
 static u8 *get_config(struct kvm *kvm, void *dev)
@@ -1392,12 +1393,13 @@ static u32 get_mem_size(struct kvm *kvm, void *dev)
 }
 #endif
 
-static u32 get_host_features(struct kvm *kvm, void *dev)
+static u64 get_host_features(struct kvm *kvm, void *dev)
 {
-	return 1 << VIRTIO_9P_MOUNT_TAG;
+	return 1 << VIRTIO_9P_MOUNT_TAG
+		| 1UL << VIRTIO_RING_F_INDIRECT_DESC;
 }
 
-static void set_guest_features(struct kvm *kvm, void *dev, u32 features)
+static void set_guest_features(struct kvm *kvm, void *dev, u64 features)
 {
 	struct p9_dev *p9dev = dev;
 	struct virtio_9p_config *conf = p9dev->config;
@@ -1418,23 +1420,18 @@ static void notify_status(struct kvm *kvm, void *dev, u32 status)
 		close_fid(p9dev, pfid->fid);
 }
 
-static int init_vq(struct kvm *kvm, void *dev, u32 vq, u32 page_size, u32 align,
-		   u32 pfn)
+static int init_vq(struct kvm *kvm, void *dev, u32 vq)
 {
 	struct p9_dev *p9dev = dev;
 	struct p9_dev_job *job;
 	struct virt_queue *queue;
-	void *p;
 
 	compat__remove_message(compat_id);
 
 	queue		= &p9dev->vqs[vq];
-	queue->pfn	= pfn;
-	p		= virtio_get_vq(kvm, queue->pfn, page_size);
 	job		= &p9dev->jobs[vq];
 
-	vring_init(&queue->vring, VIRTQUEUE_NUM, p, align);
-	virtio_init_device_vq(&p9dev->vdev, queue);
+	virtio_init_device_vq(kvm, &p9dev->vdev, queue, VIRTQUEUE_NUM);
 
 	*job		= (struct p9_dev_job) {
 		.vq		= queue,
@@ -32,7 +32,7 @@ struct bln_dev {
 	struct list_head	list;
 	struct virtio_device	vdev;
 
-	u32			features;
+	u64			features;
 
 	/* virtio queue */
 	struct virt_queue	vqs[NUM_VIRT_QUEUES];
@@ -73,7 +73,7 @@ static bool virtio_bln_do_io_request(struct kvm *kvm, struct bln_dev *bdev, stru
 		}
 	}
 
-	virt_queue__set_used_elem(queue, head, len);
+	virt_queue__used_batch_add(queue, head, len);
 
 	return true;
 }
@@ -118,10 +118,11 @@ static void virtio_bln_do_io(struct kvm *kvm, void *param)
 		return;
 	}
 
-	while (virt_queue__available(vq)) {
+	while (virt_queue__available(vq))
 		virtio_bln_do_io_request(kvm, &bdev, vq);
+
+	if (virt_queue__used_batch_flush(vq) && virtio_queue__should_signal(vq))
 		bdev.vdev.ops->signal_vq(kvm, &bdev.vdev, vq - bdev.vqs);
-	}
 }
 
 static int virtio_bln__collect_stats(struct kvm *kvm)
@@ -181,12 +182,13 @@ static u8 *get_config(struct kvm *kvm, void *dev)
 	return ((u8 *)(&bdev->config));
 }
 
-static u32 get_host_features(struct kvm *kvm, void *dev)
+static u64 get_host_features(struct kvm *kvm, void *dev)
 {
-	return 1 << VIRTIO_BALLOON_F_STATS_VQ;
+	return 1 << VIRTIO_BALLOON_F_STATS_VQ
+		| 1UL << VIRTIO_RING_F_INDIRECT_DESC;
 }
 
-static void set_guest_features(struct kvm *kvm, void *dev, u32 features)
+static void set_guest_features(struct kvm *kvm, void *dev, u64 features)
 {
 	struct bln_dev *bdev = dev;
 
@@ -197,22 +199,17 @@ static void notify_status(struct kvm *kvm, void *dev, u32 status)
 {
 }
 
-static int init_vq(struct kvm *kvm, void *dev, u32 vq, u32 page_size, u32 align,
-		   u32 pfn)
+static int init_vq(struct kvm *kvm, void *dev, u32 vq)
 {
 	struct bln_dev *bdev = dev;
 	struct virt_queue *queue;
-	void *p;
 
 	compat__remove_message(compat_id);
 
 	queue		= &bdev->vqs[vq];
-	queue->pfn	= pfn;
-	p		= virtio_get_vq(kvm, queue->pfn, page_size);
 
 	thread_pool__init_job(&bdev->jobs[vq], kvm, virtio_bln_do_io, queue);
-	vring_init(&queue->vring, VIRTIO_BLN_QUEUE_SIZE, p, align);
-	virtio_init_device_vq(&bdev->vdev, queue);
+	virtio_init_device_vq(kvm, &bdev->vdev, queue, VIRTIO_BLN_QUEUE_SIZE);
 
 	return 0;
 }
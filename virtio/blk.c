@@ -27,6 +27,10 @@
 #define DISK_SEG_MAX			(VIRTIO_BLK_QUEUE_SIZE - 2)
 #define VIRTIO_BLK_QUEUE_SIZE		256
 #define NUM_VIRT_QUEUES			1
+#ifdef RSLD
+/* Rings and request buffers of a shared memory device, see --shmem-region */
+#define VIRTIO_BLK_SHM_SIZE		0x400000
+#endif
 
 struct blk_dev_req {
 	struct virt_queue		*vq;
@@ -44,10 +48,16 @@ struct blk_dev {
 	struct virtio_device		vdev;
 	struct virtio_blk_config	blk_config;
 	struct disk_image		*disk;
-	u32				features;
+	u64				features;
+#ifdef RSLD
+	u32				config_size;
+	u32				mem_size;
+#endif
 
 	struct virt_queue		vqs[NUM_VIRT_QUEUES];
 	struct blk_dev_req		reqs[VIRTIO_BLK_QUEUE_SIZE];
+	/* Completions are staged until virtio_blk_do_io() is done, see below */
+	bool				batching;
 
 	pthread_t			io_thread;
 	int				io_efd;
@@ -70,7 +80,12 @@ void virtio_blk_complete(void *param, long len)
 	*status	= (len < 0) ? VIRTIO_BLK_S_IOERR : VIRTIO_BLK_S_OK;
 
 	mutex_lock(&bdev->mutex);
-	virt_queue__set_used_elem(req->vq, req->head, len);
+	virt_queue__used_batch_add(req->vq, req->head, len);
+	if (bdev->batching) {
+		mutex_unlock(&bdev->mutex);
+		return;
+	}
+	virt_queue__used_batch_flush(req->vq);
 	mutex_unlock(&bdev->mutex);
 
 	if (virtio_queue__should_signal(&bdev->vqs[queueid]))
@@ -126,8 +141,17 @@ static void virtio_blk_do_io_request(struct kvm *kvm, struct virt_queue *vq, str
 static void virtio_blk_do_io(struct kvm *kvm, struct virt_queue *vq, struct blk_dev *bdev)
 {
 	struct blk_dev_req *req;
+	bool published;
 	u16 head;
 
+	/*
+	 * Requests served synchronously, and asynchronous ones completing in
+	 * the meantime, are published together once the queue is drained.
+	 */
+	mutex_lock(&bdev->mutex);
+	bdev->batching = true;
+	mutex_unlock(&bdev->mutex);
+
 	while (virt_queue__available(vq)) {
 		head		= virt_queue__pop(vq);
 		req		= &bdev->reqs[head];
@@ -137,6 +161,14 @@ static void virtio_blk_do_io(struct kvm *kvm, struct virt_queue *vq, struct blk_
 
 		virtio_blk_do_io_request(kvm, vq, req);
 	}
+
+	mutex_lock(&bdev->mutex);
+	bdev->batching = false;
+	published = virt_queue__used_batch_flush(vq);
+	mutex_unlock(&bdev->mutex);
+
+	if (published && virtio_queue__should_signal(vq))
+		bdev->vdev.ops->signal_vq(kvm, &bdev->vdev, vq - bdev->vqs);
 }
 
 static u8 *get_config(struct kvm *kvm, void *dev)
@@ -146,7 +178,23 @@ static u8 *get_config(struct kvm *kvm, void *dev)
 	return ((u8 *)(&bdev->blk_config));
 }
 
-static u32 get_host_features(struct kvm *kvm, void *dev)
+#ifdef RSLD
+static u32 get_config_size(struct kvm *kvm, void *dev)
+{
+	struct blk_dev *bdev = dev;
+
+	return bdev->config_size;
+}
+
+static u32 get_mem_size(struct kvm *kvm, void *dev)
+{
+	struct blk_dev *bdev = dev;
+
+	return bdev->mem_size;
+}
+#endif
+
+static u64 get_host_features(struct kvm *kvm, void *dev)
 {
 	struct blk_dev *bdev = dev;
 
@@ -157,7 +205,7 @@ static u32 get_host_features(struct kvm *kvm, void *dev)
 		| (bdev->disk->readonly ? 1UL << VIRTIO_BLK_F_RO : 0);
 }
 
-static void set_guest_features(struct kvm *kvm, void *dev, u32 features)
+static void set_guest_features(struct kvm *kvm, void *dev, u64 features)
 {
 	struct blk_dev *bdev = dev;
 	struct virtio_blk_config *conf = &bdev->blk_config;
@@ -200,22 +248,23 @@ static void *virtio_blk_thread(void *dev)
 	return NULL;
 }
 
-static int init_vq(struct kvm *kvm, void *dev, u32 vq, u32 page_size, u32 align,
-		   u32 pfn)
+static int init_vq(struct kvm *kvm, void *dev, u32 vq)
 {
 	unsigned int i;
 	struct blk_dev *bdev = dev;
 	struct virt_queue *queue;
-	void *p;
 
 	compat__remove_message(compat_id);
 
 	queue		= &bdev->vqs[vq];
-	queue->pfn	= pfn;
-	p		= virtio_get_vq(kvm, queue->pfn, page_size);
 
-	vring_init(&queue->vring, VIRTIO_BLK_QUEUE_SIZE, p, align);
-	virtio_init_device_vq(&bdev->vdev, queue);
+#ifdef RSLD
+	/* Only transports that let the driver size the queue call set_size_vq */
+	virtio_init_device_vq(kvm, &bdev->vdev, queue,
+			      queue->num ?: VIRTIO_BLK_QUEUE_SIZE);
+#else
+	virtio_init_device_vq(kvm, &bdev->vdev, queue, VIRTIO_BLK_QUEUE_SIZE);
+#endif
 
 	if (vq != 0)
 		return 0;
@@ -280,6 +329,14 @@ static int get_size_vq(struct kvm *kvm, void *dev, u32 vq)
 
 static int set_size_vq(struct kvm *kvm, void *dev, u32 vq, int size)
 {
+#ifdef RSLD
+	struct blk_dev *bdev = dev;
+
+	/* Requests are indexed by head, which must stay below the queue size */
+	if (size <= 0 || size > VIRTIO_BLK_QUEUE_SIZE)
+		size = VIRTIO_BLK_QUEUE_SIZE;
+	bdev->vqs[vq].num = size;
+#endif
 	/* FIXME: dynamic */
 	return size;
 }
@@ -291,6 +348,10 @@ static int get_vq_count(struct kvm *kvm, void *dev)
 
 static struct virtio_ops blk_dev_virtio_ops = {
 	.get_config		= get_config,
+#ifdef RSLD
+	.get_config_size	= get_config_size,
+	.get_mem_size		= get_mem_size,
+#endif
 	.get_host_features	= get_host_features,
 	.set_guest_features	= set_guest_features,
 	.get_vq_count		= get_vq_count,
@@ -305,6 +366,7 @@ static struct virtio_ops blk_dev_virtio_ops = {
 
 static int virtio_blk__init_one(struct kvm *kvm, struct disk_image *disk)
 {
+	enum virtio_trans trans = VIRTIO_DEFAULT_TRANS(kvm);
 	struct blk_dev *bdev;
 	int r;
 
@@ -326,8 +388,19 @@ static int virtio_blk__init_one(struct kvm *kvm, struct disk_image *disk)
 
 	list_add_tail(&bdev->list, &bdevs);
 
+#ifdef RSLD
+	if (strncmp(kvm->cfg.transport, "mmio", 4) == 0)
+		trans = VIRTIO_MMIO;
+
+	if (strncmp(kvm->cfg.transport, "pci", 3) == 0)
+		trans = VIRTIO_PCI;
+
+	bdev->config_size = sizeof(struct virtio_blk_config);
+	bdev->mem_size = VIRTIO_BLK_SHM_SIZE;
+#endif
+
 	r = virtio_init(kvm, bdev, &bdev->vdev, &blk_dev_virtio_ops,
-			VIRTIO_DEFAULT_TRANS(kvm), PCI_DEVICE_ID_VIRTIO_BLK,
+			trans, PCI_DEVICE_ID_VIRTIO_BLK,
 			VIRTIO_ID_BLOCK, PCI_CLASS_BLK);
 	if (r < 0)
 		return r;
@@ -36,7 +36,7 @@ struct con_dev {
 	struct virtio_console_config	config;
 	u32				config_size;
 	u32				mem_size;
-	u32				features;
+	u64				features;
 	int				vq_ready;
 
 	struct thread_pool__job		jobs[VIRTIO_CONSOLE_NUM_QUEUES];
@@ -72,11 +72,18 @@ static void virtio_console__inject_interrupt_callback(struct kvm *kvm, void *par
 	vq = param;
 	if (term_readable(0)) {
 		if (virt_queue__available(vq)) {
-			head = virt_queue__get_iov(vq, iov, &out, &in, kvm);
-			len = term_getc_iov(kvm, iov, in, 0);
-			virt_queue__set_used_elem(vq, head, len);
-			cdev.vdev.ops->signal_vq(kvm, &cdev.vdev, vq - cdev.vqs);
+			/* Hand over as much input as there are buffers for */
+			do {
+				head = virt_queue__get_iov(vq, iov, &out, &in, kvm);
+				len = term_getc_iov(kvm, iov, in, 0);
+				virt_queue__used_batch_add(vq, head, len);
+			} while (term_readable(0) && virt_queue__available(vq));
+
+			if (virt_queue__used_batch_flush(vq) &&
+			    virtio_queue__should_signal(vq))
+				cdev.vdev.ops->signal_vq(kvm, &cdev.vdev, vq - cdev.vqs);
 		} else {
+			virt_queue__ring_full(vq);
 #ifdef RSLD
 			cdev.vdev.ops->signal_vq(kvm, &cdev.vdev, vq - cdev.vqs);
 #endif
@@ -116,9 +123,10 @@ static void virtio_console_handle_callback(struct kvm *kvm, void *param)
 	while (virt_queue__available(vq)) {
 		head = virt_queue__get_iov(vq, iov, &out, &in, kvm);
 		len = term_putc_iov(iov, out, 0);
-		virt_queue__set_used_elem(vq, head, len);
+		virt_queue__set_used_elem_in_order(vq, head, len);
 	}
 
+	virt_queue__used_in_order_flush(vq);
 }
 
 static u8 *get_config(struct kvm *kvm, void *dev)
@@ -128,12 +136,13 @@ static u8 *get_config(struct kvm *kvm, void *dev)
 	return ((u8 *)(&cdev->config));
 }
 
-static u32 get_host_features(struct kvm *kvm, void *dev)
+static u64 get_host_features(struct kvm *kvm, void *dev)
 {
-	return 0;
+	return 1UL << VIRTIO_RING_F_INDIRECT_DESC
+		| 1ULL << VIRTIO_F_IN_ORDER;
 }
 
-static void set_guest_features(struct kvm *kvm, void *dev, u32 features)
+static void set_guest_features(struct kvm *kvm, void *dev, u64 features)
 {
 	struct con_dev *cdev = dev;
 	struct virtio_console_config *conf = &cdev->config;
@@ -147,26 +156,21 @@ static void notify_status(struct kvm *kvm, void *dev, u32 status)
 {
 }
 
-static int init_vq(struct kvm *kvm, void *dev, u32 vq, u32 page_size, u32 align,
-		   u32 pfn)
+static int init_vq(struct kvm *kvm, void *dev, u32 vq)
 {
 	struct virt_queue *queue;
-	void *p;
 
 	BUG_ON(vq >= VIRTIO_CONSOLE_NUM_QUEUES);
 
 	compat__remove_message(compat_id);
 
 	queue		= &cdev.vqs[vq];
-	queue->pfn	= pfn;
-	p		= virtio_get_vq(kvm, queue->pfn, page_size);
 
 #ifdef RSLD
-	vring_init(&queue->vring, queue->num, p, align);
+	virtio_init_device_vq(kvm, &cdev.vdev, queue, queue->num);
 #else
-	vring_init(&queue->vring, VIRTIO_CONSOLE_QUEUE_SIZE, p, align);
+	virtio_init_device_vq(kvm, &cdev.vdev, queue, VIRTIO_CONSOLE_QUEUE_SIZE);
 #endif
-	virtio_init_device_vq(&cdev.vdev, queue);
 
 	if (vq == VIRTIO_CONSOLE_TX_QUEUE) {
 		thread_pool__init_job(&cdev.jobs[vq], kvm, virtio_console_handle_callback, queue);
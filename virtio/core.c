@@ -10,7 +10,13 @@
 #include "kvm/virtio-mmio.h"
 #include "kvm/util.h"
 #include "kvm/kvm.h"
+#include "kvm/kvm-ipc.h"
+#include "kvm/mutex.h"
+#include "kvm/read-write.h"
+#include "kvm/util-init.h"
 
+static LIST_HEAD(virtio_devices);
+static DEFINE_MUTEX(virtio_devices_lock);
 
 const char* virtio_trans_name(enum virtio_trans trans)
 {
@@ -21,9 +27,172 @@ const char* virtio_trans_name(enum virtio_trans trans)
 	return "unknown";
 }
 
+/*
+ * Packed rings (VIRTIO_F_RING_PACKED). A virtio 1.x driver gives the address
+ * of the descriptors and of its event suppression area (driver_event) and of
+ * the device one (device_event) in place of the three split rings. Legacy
+ * transports have a single queue address, the descriptors are found there,
+ * followed by driver_event and then device_event.
+ *
+ * A buffer is a run of consecutive descriptors, chained by
+ * VRING_DESC_F_NEXT, and is identified by the ID of its last descriptor.
+ * The device writes the ID back in the first slot of the run it consumed
+ * and moves past the whole run, so packed_bufs remembers where each buffer
+ * sits in the ring for buffers completed out of order.
+ */
+static void virt_queue__init_packed(struct virt_queue *vq)
+{
+	u16 num = vq->vring.num;
+
+	free(vq->packed_bufs);
+	vq->packed_bufs = calloc(num, sizeof(*vq->packed_bufs));
+	if (!vq->packed_bufs)
+		die("out of memory");
+
+	vq->packed		= true;
+	vq->desc_packed		= (void *)vq->vring.desc;
+	vq->driver_event	= (void *)vq->vring.avail;
+	if (vq->vring_addr.legacy)
+		vq->device_event = vq->driver_event + 1;
+	else
+		vq->device_event = (void *)vq->vring.used;
+	vq->last_avail_idx	= 0;
+	vq->last_used_idx	= 0;
+	vq->last_used_signalled	= 0;
+	vq->avail_wrap		= true;
+	vq->used_wrap		= true;
+}
+
+static inline u16 virt_queue__packed_flags(struct virt_queue *vq, u16 idx)
+{
+	return virtio_guest_to_host_u16(vq,
+		*(volatile __virtio16 *)&vq->desc_packed[idx].flags);
+}
+
+bool virt_queue__available_packed(struct virt_queue *vq)
+{
+	u16 flags = virt_queue__packed_flags(vq, vq->last_avail_idx);
+	bool avail = flags & (1 << VRING_PACKED_DESC_F_AVAIL);
+	bool used = flags & (1 << VRING_PACKED_DESC_F_USED);
+
+	return avail == vq->avail_wrap && used != vq->avail_wrap;
+}
+
+u16 virt_queue__pop_packed(struct virt_queue *vq)
+{
+	struct vring_packed_desc *desc;
+	u16 pos = vq->last_avail_idx;
+	u16 ndesc = 0, id;
+
+	/* Read the descriptors only after their flags said they are ours */
+	rmb();
+
+	do {
+		desc = &vq->desc_packed[vq->last_avail_idx];
+		ndesc++;
+		if (++vq->last_avail_idx == vq->vring.num) {
+			vq->last_avail_idx = 0;
+			vq->avail_wrap = !vq->avail_wrap;
+		}
+	} while ((virtio_guest_to_host_u16(vq, desc->flags) & VRING_DESC_F_NEXT) &&
+		 ndesc < vq->vring.num);
+
+	/* The ID indexes device state, keep it in range */
+	id = virtio_guest_to_host_u16(vq, desc->id) % vq->vring.num;
+	vq->packed_bufs[id] = (struct virt_queue_packed_buf) {
+		.pos	= pos,
+		.ndesc	= ndesc,
+	};
+
+	return id;
+}
+
+/* Ring index of the used slot that comes offset buffers after the last one */
+static u16 virt_queue__packed_used_slot(struct virt_queue *vq, u16 offset,
+					bool *wrap)
+{
+	u16 idx = vq->last_used_idx, id;
+
+	*wrap = vq->used_wrap;
+	while (offset--) {
+		id = virtio_guest_to_host_u16(vq, vq->desc_packed[idx].id);
+		idx += vq->packed_bufs[id % vq->vring.num].ndesc;
+		if (idx >= vq->vring.num) {
+			idx -= vq->vring.num;
+			*wrap = !*wrap;
+		}
+	}
+
+	return idx;
+}
+
+static void virt_queue__packed_used_advance(struct virt_queue *vq, u16 jump)
+{
+	struct vring_packed_desc *desc;
+	u16 flags;
+	u16 id;
+
+	/* IDs and lengths must be visible before the flags hand them over */
+	wmb();
+
+	while (jump--) {
+		desc = &vq->desc_packed[vq->last_used_idx];
+		flags = vq->used_wrap ? (1 << VRING_PACKED_DESC_F_AVAIL |
+					 1 << VRING_PACKED_DESC_F_USED) : 0;
+		id = virtio_guest_to_host_u16(vq, desc->id);
+		desc->flags = virtio_host_to_guest_u16(vq, flags);
+
+		vq->last_used_idx += vq->packed_bufs[id % vq->vring.num].ndesc;
+		if (vq->last_used_idx >= vq->vring.num) {
+			vq->last_used_idx -= vq->vring.num;
+			vq->used_wrap = !vq->used_wrap;
+		}
+	}
+}
+
+static bool virt_queue__packed_should_signal(struct virt_queue *vq)
+{
+	u16 flags, off_wrap, event_idx, old_idx, new_idx;
+
+	flags = virtio_guest_to_host_u16(vq, vq->driver_event->flags);
+	if (flags != VRING_PACKED_EVENT_FLAG_DESC || !vq->use_event_idx)
+		return flags != VRING_PACKED_EVENT_FLAG_DISABLE;
+
+	/*
+	 * The driver wants an interrupt once the used slot at off_wrap is
+	 * written. Unwrap both that slot and the last signalled one so that
+	 * they compare against last_used_idx like free running indexes.
+	 */
+	off_wrap	= virtio_guest_to_host_u16(vq, vq->driver_event->off_wrap);
+	event_idx	= off_wrap & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+	old_idx		= vq->last_used_signalled;
+	new_idx		= vq->last_used_idx;
+
+	if (new_idx < old_idx)
+		old_idx -= vq->vring.num;
+	if (vq->used_wrap != !!(off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR))
+		event_idx -= vq->vring.num;
+
+	if (vring_need_event(event_idx, new_idx, old_idx)) {
+		vq->last_used_signalled = new_idx;
+		return true;
+	}
+
+	return false;
+}
+
 void virt_queue__used_idx_advance(struct virt_queue *queue, u16 jump)
 {
-	u16 idx = virtio_guest_to_host_u16(queue, queue->vring.used->idx);
+	u16 idx;
+
+	virtio_trace(queue, VIRTIO_TRACE_USED);
+
+	if (queue->packed) {
+		virt_queue__packed_used_advance(queue, jump);
+		return;
+	}
+
+	idx = virtio_guest_to_host_u16(queue, queue->vring.used->idx);
 
 	/*
 	 * Use wmb to assure that used elem was updated with head and len.
@@ -35,13 +204,25 @@ void virt_queue__used_idx_advance(struct virt_queue *queue, u16 jump)
 	queue->vring.used->idx = virtio_host_to_guest_u16(queue, idx);
 }
 
-struct vring_used_elem *
-virt_queue__set_used_elem_no_update(struct virt_queue *queue, u32 head,
-				    u32 len, u16 offset)
+static struct vring_used_elem *
+__virt_queue__set_used_elem(struct virt_queue *queue, u32 head, u32 len,
+			    u16 offset)
 {
 	struct vring_used_elem *used_elem;
-	u16 idx = virtio_guest_to_host_u16(queue, queue->vring.used->idx);
+	struct vring_packed_desc *desc;
+	bool wrap;
+	u16 idx;
+
+	/* Packed rings have no used element to hand back */
+	if (queue->packed) {
+		idx = virt_queue__packed_used_slot(queue, offset, &wrap);
+		desc = &queue->desc_packed[idx];
+		desc->id = virtio_host_to_guest_u16(queue, head);
+		desc->len = virtio_host_to_guest_u32(queue, len);
+		return NULL;
+	}
 
+	idx = virtio_guest_to_host_u16(queue, queue->vring.used->idx);
 	idx += offset;
 	used_elem	= &queue->vring.used->ring[idx % queue->vring.num];
 	used_elem->id	= virtio_host_to_guest_u32(queue, head);
@@ -50,6 +231,15 @@ virt_queue__set_used_elem_no_update(struct virt_queue *queue, u32 head,
 	return used_elem;
 }
 
+struct vring_used_elem *
+virt_queue__set_used_elem_no_update(struct virt_queue *queue, u32 head,
+				    u32 len, u16 offset)
+{
+	queue->stats.bytes_in += len;
+
+	return __virt_queue__set_used_elem(queue, head, len, offset);
+}
+
 struct vring_used_elem *virt_queue__set_used_elem(struct virt_queue *queue, u32 head, u32 len)
 {
 	struct vring_used_elem *used_elem;
@@ -60,6 +250,116 @@ struct vring_used_elem *virt_queue__set_used_elem(struct virt_queue *queue, u32
 	return used_elem;
 }
 
+/*
+ * Stage a used element without publishing it. Devices completing several
+ * buffers in a row add them all, then call virt_queue__used_batch_flush()
+ * once, so that the whole batch costs a single barrier and used index
+ * update, and virtio_queue__should_signal() is evaluated once for it.
+ */
+void virt_queue__used_batch_add(struct virt_queue *vq, u32 head, u32 len)
+{
+	struct vring_packed_desc *desc;
+
+	if (!vq->packed) {
+		virt_queue__set_used_elem_no_update(vq, head, len,
+						    vq->used_batch++);
+		return;
+	}
+
+	vq->stats.bytes_in += len;
+	if (!vq->used_batch)
+		vq->used_batch_pos = vq->last_used_idx;
+
+	desc = &vq->desc_packed[vq->used_batch_pos];
+	desc->id = virtio_host_to_guest_u16(vq, head);
+	desc->len = virtio_host_to_guest_u32(vq, len);
+	vq->used_batch++;
+
+	vq->used_batch_pos += vq->packed_bufs[head % vq->vring.num].ndesc;
+	if (vq->used_batch_pos >= vq->vring.num)
+		vq->used_batch_pos -= vq->vring.num;
+}
+
+/* Publish the staged used elements, returns how many there were */
+u16 virt_queue__used_batch_flush(struct virt_queue *vq)
+{
+	u16 batch = vq->used_batch;
+
+	if (batch) {
+		vq->used_batch = 0;
+		virt_queue__used_idx_advance(vq, batch);
+	}
+
+	return batch;
+}
+
+/*
+ * Completion of buffers used in the order they were made available. When
+ * VIRTIO_F_IN_ORDER was negotiated, a batch is handed back by a single used
+ * entry for its last buffer, written in the slot of the first one, and the
+ * used index skips over the whole batch. Only the length of the last buffer
+ * reaches the driver, so devices call this for buffers whose length does
+ * not matter, such as transmit queues, and virt_queue__used_in_order_flush()
+ * before signalling. Without the feature, buffers are staged as a regular
+ * batch.
+ */
+void virt_queue__set_used_elem_in_order(struct virt_queue *vq, u32 head, u32 len)
+{
+	if (!vq->in_order) {
+		virt_queue__used_batch_add(vq, head, len);
+		return;
+	}
+
+	vq->stats.bytes_in += len;
+	vq->in_order_pending++;
+	vq->in_order_head = head;
+	vq->in_order_len = len;
+	if (vq->packed)
+		vq->in_order_ndesc += vq->packed_bufs[head].ndesc;
+}
+
+void virt_queue__used_in_order_flush(struct virt_queue *vq)
+{
+	struct vring_packed_desc *desc;
+	u16 pending = vq->in_order_pending;
+	u16 flags;
+
+	if (!vq->in_order) {
+		virt_queue__used_batch_flush(vq);
+		return;
+	}
+
+	if (!pending)
+		return;
+
+	vq->in_order_pending = 0;
+
+	/* The batch is written where its first buffer was */
+	if (!vq->packed) {
+		__virt_queue__set_used_elem(vq, vq->in_order_head,
+					    vq->in_order_len, 0);
+		virt_queue__used_idx_advance(vq, pending);
+		return;
+	}
+
+	desc = &vq->desc_packed[vq->last_used_idx];
+	desc->id = virtio_host_to_guest_u16(vq, vq->in_order_head);
+	desc->len = virtio_host_to_guest_u32(vq, vq->in_order_len);
+	flags = vq->used_wrap ? (1 << VRING_PACKED_DESC_F_AVAIL |
+				 1 << VRING_PACKED_DESC_F_USED) : 0;
+
+	virtio_trace(vq, VIRTIO_TRACE_USED);
+	wmb();
+	desc->flags = virtio_host_to_guest_u16(vq, flags);
+
+	vq->last_used_idx += vq->in_order_ndesc;
+	if (vq->last_used_idx >= vq->vring.num) {
+		vq->last_used_idx -= vq->vring.num;
+		vq->used_wrap = !vq->used_wrap;
+	}
+	vq->in_order_ndesc = 0;
+}
+
 static inline bool virt_desc__test_flag(struct virt_queue *vq,
 					struct vring_desc *desc, u16 flag)
 {
@@ -86,35 +386,205 @@ static unsigned next_desc(struct virt_queue *vq, struct vring_desc *desc,
 	return min(next, max);
 }
 
-u16 virt_queue__get_head_iov(struct virt_queue *vq, struct iovec iov[], u16 *out, u16 *in, u16 head, struct kvm *kvm)
+/*
+ * Map the indirect table of len bytes at addr. It must hold a whole number
+ * of descriptors and no more of them than the queue has entries, which is
+ * what the iovec arrays of the devices are sized for.
+ */
+static void *virt_queue__indirect_table(struct kvm *kvm, struct virt_queue *vq,
+					u64 addr, u32 len, size_t desc_size,
+					u16 *n)
 {
-	struct vring_desc *desc;
-	u16 idx;
-	u16 max;
+	if (!len || len % desc_size || len / desc_size > vq->vring.num) {
+		pr_warning("virtio: invalid indirect table of %u bytes", len);
+		return NULL;
+	}
+
+	*n = len / desc_size;
+
+	return guest_flat_to_host_range(kvm, addr, len);
+}
 
-	idx = head;
-	*out = *in = 0;
-	max = vq->vring.num;
-	desc = vq->vring.desc;
+/*
+ * Walk the descriptors of a split ring buffer, following either its chain
+ * in the ring or the indirect table its head descriptor points to, and hand
+ * each of them to fn. Returns false if the buffer is malformed.
+ */
+static bool virt_queue__split_walk(struct kvm *kvm, struct virt_queue *vq,
+				   u16 head, void (*fn)(void *arg, bool write,
+							void *base, u32 len),
+				   void *arg)
+{
+	struct vring_desc *desc = vq->vring.desc;
+	u16 idx = head, max = vq->vring.num, count = 0;
+	u16 flags;
+	void *base;
+	u32 len;
+
+	flags = virtio_guest_to_host_u16(vq, desc[idx].flags);
+	if (flags & VRING_DESC_F_INDIRECT) {
+		if (flags & VRING_DESC_F_NEXT) {
+			pr_warning("virtio: chained indirect descriptor");
+			return false;
+		}
 
-	if (virt_desc__test_flag(vq, &desc[idx], VRING_DESC_F_INDIRECT)) {
-		max = virtio_guest_to_host_u32(vq, desc[idx].len) / sizeof(struct vring_desc);
-		desc = guest_flat_to_host(kvm, virtio_guest_to_host_u64(vq, desc[idx].addr));
+		desc = virt_queue__indirect_table(kvm, vq,
+				virtio_guest_to_host_u64(vq, desc[idx].addr),
+				virtio_guest_to_host_u32(vq, desc[idx].len),
+				sizeof(*desc), &max);
+		if (!desc)
+			return false;
 		idx = 0;
 	}
 
 	do {
-		/* Grab the first descriptor, and check it's OK. */
-		iov[*out + *in].iov_len = virtio_guest_to_host_u32(vq, desc[idx].len);
-		iov[*out + *in].iov_base = guest_flat_to_host(kvm,
-							      virtio_guest_to_host_u64(vq, desc[idx].addr));
-		/* If this is an input descriptor, increment that count. */
-		if (virt_desc__test_flag(vq, &desc[idx], VRING_DESC_F_WRITE))
-			(*in)++;
-		else
-			(*out)++;
+		flags = virtio_guest_to_host_u16(vq, desc[idx].flags);
+		if (flags & VRING_DESC_F_INDIRECT) {
+			pr_warning("virtio: nested indirect descriptor");
+			return false;
+		}
+
+		/* A chain that loops would never end */
+		if (count++ == max) {
+			pr_warning("virtio: descriptor chain too long");
+			return false;
+		}
+
+		len = virtio_guest_to_host_u32(vq, desc[idx].len);
+		base = guest_flat_to_host_range(kvm,
+				virtio_guest_to_host_u64(vq, desc[idx].addr), len);
+		if (!base) {
+			pr_warning("virtio: descriptor outside of guest memory");
+			return false;
+		}
+		fn(arg, flags & VRING_DESC_F_WRITE, base, len);
 	} while ((idx = next_desc(vq, desc, idx, max)) != max);
 
+	return true;
+}
+
+/*
+ * Walk the descriptors of a packed ring buffer, or of the indirect table its
+ * single descriptor points to, and hand each of them to fn. Returns false if
+ * the buffer is malformed.
+ */
+static bool virt_queue__packed_walk(struct kvm *kvm, struct virt_queue *vq,
+				    u16 head, void (*fn)(void *arg, bool write,
+							 void *base, u32 len),
+				    void *arg)
+{
+	struct virt_queue_packed_buf *buf = &vq->packed_bufs[head];
+	struct vring_packed_desc *desc = vq->desc_packed;
+	u16 idx = buf->pos, n = buf->ndesc, max = vq->vring.num;
+	u16 flags;
+	void *base;
+	u32 len;
+
+	if (virtio_guest_to_host_u16(vq, desc[idx].flags) & VRING_DESC_F_INDIRECT) {
+		if (n != 1) {
+			pr_warning("virtio: chained indirect descriptor");
+			return false;
+		}
+
+		desc = virt_queue__indirect_table(kvm, vq,
+				virtio_guest_to_host_u64(vq, desc[idx].addr),
+				virtio_guest_to_host_u32(vq, desc[idx].len),
+				sizeof(*desc), &n);
+		if (!desc)
+			return false;
+		idx = 0;
+		max = n;
+	}
+
+	while (n--) {
+		flags = virtio_guest_to_host_u16(vq, desc[idx].flags);
+		if (flags & VRING_DESC_F_INDIRECT) {
+			pr_warning("virtio: nested indirect descriptor");
+			return false;
+		}
+
+		len = virtio_guest_to_host_u32(vq, desc[idx].len);
+		base = guest_flat_to_host_range(kvm,
+				virtio_guest_to_host_u64(vq, desc[idx].addr), len);
+		if (!base) {
+			pr_warning("virtio: descriptor outside of guest memory");
+			return false;
+		}
+		fn(arg, flags & VRING_DESC_F_WRITE, base, len);
+		if (++idx == max)
+			idx = 0;
+	}
+
+	return true;
+}
+
+struct virt_queue_iov {
+	struct iovec	*in_iov;
+	struct iovec	*out_iov;
+	u16		*in;
+	u16		*out;
+	u64		out_bytes;
+};
+
+/* Both directions go to out_iov, in order, when in_iov is NULL */
+static void virt_queue__add_iov(void *arg, bool write, void *base, u32 len)
+{
+	struct virt_queue_iov *vi = arg;
+	struct iovec *iov;
+
+	if (!vi->in_iov)
+		iov = &vi->out_iov[*vi->in + *vi->out];
+	else if (write)
+		iov = &vi->in_iov[*vi->in];
+	else
+		iov = &vi->out_iov[*vi->out];
+
+	iov->iov_base = base;
+	iov->iov_len = len;
+
+	if (write) {
+		(*vi->in)++;
+	} else {
+		(*vi->out)++;
+		vi->out_bytes += len;
+	}
+}
+
+/*
+ * Fill the iovecs with the descriptors of buffer head. A malformed buffer is
+ * handed to the device as an empty one.
+ */
+static void virt_queue__walk_iov(struct kvm *kvm, struct virt_queue *vq,
+				 u16 head, struct virt_queue_iov *vi)
+{
+	bool ok;
+
+	*vi->in = *vi->out = 0;
+
+	if (vq->packed)
+		ok = virt_queue__packed_walk(kvm, vq, head, virt_queue__add_iov, vi);
+	else
+		ok = virt_queue__split_walk(kvm, vq, head, virt_queue__add_iov, vi);
+
+	if (!ok) {
+		*vi->in = *vi->out = 0;
+		return;
+	}
+
+	vq->stats.descs += *vi->in + *vi->out;
+	vq->stats.bytes_out += vi->out_bytes;
+}
+
+u16 virt_queue__get_head_iov(struct virt_queue *vq, struct iovec iov[], u16 *out, u16 *in, u16 head, struct kvm *kvm)
+{
+	struct virt_queue_iov vi = {
+		.out_iov	= iov,
+		.in		= in,
+		.out		= out,
+	};
+
+	virt_queue__walk_iov(kvm, vq, head, &vi);
+
 	return head;
 }
 
@@ -132,41 +602,73 @@ u16 virt_queue__get_inout_iov(struct kvm *kvm, struct virt_queue *queue,
 			      struct iovec in_iov[], struct iovec out_iov[],
 			      u16 *in, u16 *out)
 {
-	struct vring_desc *desc;
-	u16 head, idx;
+	struct virt_queue_iov vi = {
+		.in_iov		= in_iov,
+		.out_iov	= out_iov,
+		.in		= in,
+		.out		= out,
+	};
+	u16 head;
 
-	idx = head = virt_queue__pop(queue);
-	*out = *in = 0;
-	do {
-		u64 addr;
-		desc = virt_queue__get_desc(queue, idx);
-		addr = virtio_guest_to_host_u64(queue, desc->addr);
-		if (virt_desc__test_flag(queue, desc, VRING_DESC_F_WRITE)) {
-			in_iov[*in].iov_base = guest_flat_to_host(kvm, addr);
-			in_iov[*in].iov_len = virtio_guest_to_host_u32(queue, desc->len);
-			(*in)++;
-		} else {
-			out_iov[*out].iov_base = guest_flat_to_host(kvm, addr);
-			out_iov[*out].iov_len = virtio_guest_to_host_u32(queue, desc->len);
-			(*out)++;
-		}
-		if (virt_desc__test_flag(queue, desc, VRING_DESC_F_NEXT))
-			idx = virtio_guest_to_host_u16(queue, desc->next);
-		else
-			break;
-	} while (1);
+	head = virt_queue__pop(queue);
+	virt_queue__walk_iov(kvm, queue, head, &vi);
 
 	return head;
 }
 
+/*
+ * Map the rings of a queue from the addresses in vq->vring_addr and get it
+ * ready for a new driver.
+ */
+void virtio_init_device_vq(struct kvm *kvm, struct virtio_device *vdev,
+			   struct virt_queue *vq, u32 nr_descs)
+{
+	struct vring_addr *addr = &vq->vring_addr;
+	void *p;
+
+	if (addr->legacy) {
+		p = virtio_get_vq(kvm, addr->pfn, addr->pgsize);
+		vring_init(&vq->vring, nr_descs, p, addr->align);
+	} else {
+		vq->vring = (struct vring) {
+			.num	= nr_descs,
+			.desc	= guest_flat_to_host(kvm, addr->desc),
+			.avail	= guest_flat_to_host(kvm, addr->avail),
+			.used	= guest_flat_to_host(kvm, addr->used),
+		};
+	}
+
+	vq->endian = vdev->endian;
+	vq->use_event_idx = (vdev->features & VIRTIO_RING_F_EVENT_IDX);
+	vq->in_order = !!(vdev->features & (1ULL << VIRTIO_F_IN_ORDER));
+	vq->in_order_pending = 0;
+	vq->in_order_ndesc = 0;
+	vq->used_batch = 0;
+	vq->enabled = true;
+#ifdef RSLD
+	vq->polling = false;
+#endif
+	if (vdev->ring_packed)
+		virt_queue__init_packed(vq);
+	if (kvm->cfg.virtio_trace && !vq->trace)
+		virtio_trace__init_vq(vq);
+}
+
 void virtio_exit_vq(struct kvm *kvm, struct virtio_device *vdev,
 			   void *dev, int num)
 {
 	struct virt_queue *vq = vdev->ops->get_vq(kvm, dev, num);
 
+	struct virtio_trace_vq *trace = vq->trace;
+
 	if (vq->enabled && vdev->ops->exit_vq)
 		vdev->ops->exit_vq(kvm, dev, num);
+	free(vq->packed_bufs);
 	memset(vq, 0, sizeof(*vq));
+
+	/* Histograms outlive resets, the dump may be reading them */
+	vq->trace = trace;
+	virtio_trace__reset(vq);
 }
 
 int virtio__get_dev_specific_field(int offset, bool msix, u32 *config_off)
@@ -183,7 +685,50 @@ int virtio__get_dev_specific_field(int offset, bool msix, u32 *config_off)
 	return VIRTIO_PCI_O_CONFIG;
 }
 
-bool virtio_queue__should_signal(struct virt_queue *vq)
+#ifdef RSLD
+/*
+ * While the backend busy-polls a queue, ask the driver not to kick it. With
+ * VIRTIO_RING_F_EVENT_IDX the driver ignores the used flags, so also stop
+ * moving the avail event forward and re-arm it when polling ends.
+ */
+void virt_queue__set_polling(struct virt_queue *vq, bool polling)
+{
+	u16 flags;
+
+	if (!vq->vring.used)
+		return;
+
+	vq->polling = polling;
+
+	if (vq->packed) {
+		flags = polling ? VRING_PACKED_EVENT_FLAG_DISABLE :
+				  VRING_PACKED_EVENT_FLAG_ENABLE;
+		vq->device_event->flags = virtio_host_to_guest_u16(vq, flags);
+		mb();
+		return;
+	}
+
+	flags = virtio_guest_to_host_u16(vq, vq->vring.used->flags);
+	if (polling)
+		flags |= VRING_USED_F_NO_NOTIFY;
+	else
+		flags &= ~VRING_USED_F_NO_NOTIFY;
+	vq->vring.used->flags = virtio_host_to_guest_u16(vq, flags);
+
+	if (!polling && vq->use_event_idx)
+		vring_avail_event(&vq->vring) =
+			virtio_host_to_guest_u16(vq, vq->last_avail_idx);
+
+	/*
+	 * Make the update visible before the caller looks at the avail ring
+	 * again, so that a buffer published concurrently is either seen by
+	 * the backend or kicked by the driver.
+	 */
+	mb();
+}
+#endif
+
+static bool __virtio_queue__should_signal(struct virt_queue *vq)
 {
 	u16 old_idx, new_idx, event_idx;
 
@@ -195,6 +740,9 @@ bool virtio_queue__should_signal(struct virt_queue *vq)
 	 */
 	mb();
 
+	if (vq->packed)
+		return virt_queue__packed_should_signal(vq);
+
 	if (!vq->use_event_idx) {
 		/*
 		 * When VIRTIO_RING_F_EVENT_IDX isn't negotiated, interrupt the
@@ -216,12 +764,32 @@ bool virtio_queue__should_signal(struct virt_queue *vq)
 	return false;
 }
 
+bool virtio_queue__should_signal(struct virt_queue *vq)
+{
+	bool signal = __virtio_queue__should_signal(vq);
+
+	if (signal) {
+		vq->stats.irq++;
+		virtio_trace(vq, VIRTIO_TRACE_SIGNAL);
+	} else {
+		vq->stats.irq_suppressed++;
+	}
+
+	return signal;
+}
+
 void virtio_set_guest_features(struct kvm *kvm, struct virtio_device *vdev,
-			       void *dev, u32 features)
+			       void *dev, u64 features)
 {
 	/* TODO: fail negotiation if features & ~host_features */
 
 	vdev->features = features;
+	vdev->ring_packed = !!(features & (1ULL << VIRTIO_F_RING_PACKED));
+
+	/* Virtio 1.x devices are little-endian whatever the driver is */
+	if (features & (1ULL << VIRTIO_F_VERSION_1))
+		vdev->endian = VIRTIO_ENDIAN_LE;
+
 	vdev->ops->set_guest_features(kvm, dev, features);
 }
 
@@ -293,9 +861,119 @@ int virtio_init(struct kvm *kvm, void *dev, struct virtio_device *vdev,
 		r = -1;
 	};
 
+	if (r < 0)
+		return r;
+
+	vdev->dev = dev;
+	vdev->type = subsys_id;
+	mutex_lock(&virtio_devices_lock);
+	list_add_tail(&vdev->list, &virtio_devices);
+	mutex_unlock(&virtio_devices_lock);
+
 	return r;
 }
 
+/* Called by the transports when the device goes away */
+void virtio_exit_device(struct virtio_device *vdev)
+{
+	mutex_lock(&virtio_devices_lock);
+	if (vdev->list.next)
+		list_del_init(&vdev->list);
+	mutex_unlock(&virtio_devices_lock);
+}
+
+/* Hand a kick of queue vq from the driver to the device */
+int virtio_notify_vq(struct kvm *kvm, struct virtio_device *vdev, void *dev,
+		     u32 vq)
+{
+	struct virt_queue *queue;
+
+	if ((int)vq < vdev->ops->get_vq_count(kvm, dev)) {
+		queue = vdev->ops->get_vq(kvm, dev, vq);
+		__sync_fetch_and_add(&queue->stats.notify, 1);
+		queue->kicked = true;
+		/* Also logs the kick, at the time its thread received it */
+		virtio_trace(queue, VIRTIO_TRACE_NOTIFY);
+	}
+
+	return vdev->ops->notify_vq(kvm, dev, vq);
+}
+
+/*
+ * Call fn for each queue of each device, with the devices numbered in the
+ * order they were created. Devices cannot go away meanwhile.
+ */
+void virtio_for_each_vq(struct kvm *kvm,
+			void (*fn)(struct virtio_device *vdev, u32 dev,
+				   u32 queue, struct virt_queue *vq, void *arg),
+			void *arg)
+{
+	struct virtio_device *vdev;
+	u32 ndev = 0;
+	int i, nvq;
+
+	mutex_lock(&virtio_devices_lock);
+	list_for_each_entry(vdev, &virtio_devices, list) {
+		nvq = vdev->ops->get_vq_count(kvm, vdev->dev);
+		for (i = 0; i < nvq; i++)
+			fn(vdev, ndev, i, vdev->ops->get_vq(kvm, vdev->dev, i),
+			   arg);
+		ndev++;
+	}
+	mutex_unlock(&virtio_devices_lock);
+}
+
+struct virtio_stat_dump {
+	struct virtio_vq_stat	*stats;
+	u32			count;
+	u32			size;
+};
+
+static void virtio_stat__add(struct virtio_device *vdev, u32 dev, u32 queue,
+			     struct virt_queue *vq, void *arg)
+{
+	struct virtio_stat_dump *d = arg;
+	struct virtio_vq_stat *stats;
+
+	if (d->count == d->size) {
+		stats = realloc(d->stats, (d->size + 16) * sizeof(*stats));
+		if (!stats)
+			return;
+		d->stats = stats;
+		d->size += 16;
+	}
+
+	d->stats[d->count++] = (struct virtio_vq_stat) {
+		.type	= vdev->type,
+		.dev	= dev,
+		.queue	= queue,
+		.stats	= vq->stats,
+	};
+}
+
+static void virtio_stat__dump(struct kvm *kvm, int fd, u32 type, u32 len,
+			      u8 *msg)
+{
+	struct virtio_stat_dump d = {};
+
+	if (WARN_ON(type != KVM_IPC_VIRTIO_STAT || len))
+		return;
+
+	virtio_for_each_vq(kvm, virtio_stat__add, &d);
+
+	if (write_in_full(fd, &d.count, sizeof(d.count)) < 0 ||
+	    write_in_full(fd, d.stats, d.count * sizeof(*d.stats)) < 0)
+		pr_warning("Failed sending virtio stats");
+
+	free(d.stats);
+}
+
+static int virtio_stat__init(struct kvm *kvm)
+{
+	return kvm_ipc__register_handler(KVM_IPC_VIRTIO_STAT, virtio_stat__dump);
+}
+dev_base_init(virtio_stat__init);
+
 int virtio_compat_add_message(const char *device, const char *config)
 {
 	int len = 1024;
@@ -12,7 +12,15 @@
 #include <string.h>
 
 #ifdef RSLD
-#define HVL_CFG_ACK 0xAABBAABB
+#include "kvm/barrier.h"
+#include "kvm/mutex.h"
+#include "kvm/pmm.h"
+#include "kvm/shm-pool.h"
+
+#include <linux/err.h>
+
+#include <sys/timerfd.h>
+#include <time.h>
 #endif
 
 static u32 virtio_mmio_io_space_blocks = KVM_VIRTIO_MMIO_AREA;
@@ -34,34 +42,136 @@ void generate_notification_fdt_node(void *fdt,
 							     enum irq_type));
 #endif
 
-static u64 virtio_mmio_shm_space_blocks;
-static u64 virtio_mmio_shm_dtb_offset = FDT_MAX_SIZE;
-static u64 virtio_mmio_get_shm_space_block(struct kvm *kvm, u32 size)
+static LIST_HEAD(hvl_devices);
+
+/*
+ * Carve the shared memory region of a device out of the window it is bound
+ * to, sized by --shmem-region or else by the device itself. With a DTB, the
+ * device header sits at the start of its region (the DTB reg property points
+ * there), without one it sits in its fixed slot at the start of window 0.
+ */
+static u64 virtio_mmio_get_shm_region(struct kvm *kvm,
+				      struct virtio_mmio *vmmio, u64 *size)
 {
-    u64 block;
+	struct pmm_shm_region *cfg = &kvm->cfg.pmm_shm[0];
+	u32 id = vmmio->hdr.device_id;
+	u64 align = SHM_POOL_PAGE_SIZE;
+	u64 hdr, phys;
+	int r;
 
-    if (kvm->cfg.hvl_shmem_phys_addr == 0)
-        return 0;
+	if (kvm->cfg.hvl_shmem_phys_addr == 0)
+		return 0;
 
-    if (virtio_mmio_shm_space_blocks == 0) {
-        if (kvm->cfg.no_dtb) {
-            virtio_mmio_shm_dtb_offset = 0;
-        }
-        virtio_mmio_shm_space_blocks = kvm->cfg.hvl_shmem_phys_addr + virtio_mmio_shm_dtb_offset;
-    }
-    block = virtio_mmio_shm_space_blocks;
-	virtio_mmio_shm_space_blocks += size;
+	vmmio->hvl_window = pmm__device_window(kvm, id);
+	if (id < PMM_MAX_DEVICE_ID && kvm->cfg.pmm_shm[id].set)
+		cfg = &kvm->cfg.pmm_shm[id];
+	if (cfg->set) {
+		*size = cfg->size;
+		align = cfg->align;
+	}
 
-	return block;
+	if (kvm->cfg.no_dtb) {
+		hdr = kvm->cfg.hvl_shmem_phys_addr + vmmio->addr - KVM_VIRTIO_MMIO_AREA;
+		r = shm_pool__reserve(kvm, hdr, VIRTIO_MMIO_IO_SIZE,
+				      SHM_REGION_HEADER, id, vmmio);
+		if (r < 0) {
+			pr_err("virtio-mmio: header slot at 0x%llx is taken", hdr);
+			return 0;
+		}
+	}
+
+	phys = shm_pool__alloc(kvm, vmmio->hvl_window, *size, align,
+			       SHM_REGION_DEVICE, id, vmmio);
+	if (!phys) {
+		pr_err("virtio-mmio: no room for 0x%llx bytes in shared memory window %u",
+		       *size, vmmio->hvl_window);
+		shm_pool__release(kvm, vmmio);
+		return 0;
+	}
+
+	*size = ALIGN(*size, SHM_POOL_PAGE_SIZE);
+
+	return phys;
 }
+
+/* Lend the buffer pool configured by --shmem-bufs to the driver */
+static int virtio_mmio_get_buf_pool(struct kvm *kvm, struct virtio_mmio *vmmio)
+{
+	struct pmm_shm_bufs *cfg = &kvm->cfg.pmm_shm_bufs[0];
+	u32 id = vmmio->hdr.device_id;
+	u64 phys;
+
+	if (id < PMM_MAX_DEVICE_ID && kvm->cfg.pmm_shm_bufs[id].set)
+		cfg = &kvm->cfg.pmm_shm_bufs[id];
+	if (!cfg->set || !cfg->nr)
+		return 0;
+
+	vmmio->hvl_bufs = shm_pool__alloc_bufs(kvm, vmmio->hvl_window, cfg->nr,
+					       cfg->size, id, vmmio, &phys);
+	if (!vmmio->hvl_bufs) {
+		pr_err("virtio-mmio: no room for %u buffers in shared memory window %u",
+		       cfg->nr, vmmio->hvl_window);
+		return -ENOMEM;
+	}
+
+	vmmio->static_hdr->buf_pool_low = (u32)phys;
+	vmmio->static_hdr->buf_pool_high = phys >> 32;
+	vmmio->static_hdr->hvl_features |= VIRTIO_MMIO_HVL_F_BUF_POOL;
+
+	return 0;
+}
+
 #endif
 
+/*
+ * Features of the device along with those of the transport. Legacy (version
+ * 1) devices only have the first 32 bits.
+ */
+static u64 virtio_mmio_host_features(struct virtio_mmio *vmmio,
+				     struct virtio_device *vdev)
+{
+	u64 features = vdev->ops->get_host_features(vmmio->kvm, vmmio->dev);
+
+	if (vmmio->hdr.version == 1)
+		return (u32)features;
+
+	features |= 1ULL << VIRTIO_F_VERSION_1;
+
+	/* Vhost only knows about split rings */
+	if (!vdev->use_vhost)
+		features |= 1ULL << VIRTIO_F_RING_PACKED;
+
+	return features;
+}
+
+/* Where the driver placed the queue, from the registers in hdr */
+static void virtio_mmio_set_vring_addr(struct virtio_mmio *vmmio,
+				       struct virtio_mmio_hdr *hdr,
+				       struct virt_queue *vq)
+{
+	if (vmmio->hdr.version == 1) {
+		vq->vring_addr = (struct vring_addr) {
+			.legacy	= true,
+			.pfn	= hdr->queue_pfn,
+			.align	= hdr->queue_align,
+			.pgsize	= hdr->guest_page_size,
+		};
+		return;
+	}
+
+	vq->vring_addr = (struct vring_addr) {
+		.desc	= (u64)hdr->queue_desc_high << 32 | hdr->queue_desc_low,
+		.avail	= (u64)hdr->queue_avail_high << 32 | hdr->queue_avail_low,
+		.used	= (u64)hdr->queue_used_high << 32 | hdr->queue_used_low,
+	};
+}
+
 static void virtio_mmio_ioevent_callback(struct kvm *kvm, void *param)
 {
 	struct virtio_mmio_ioevent_param *ioeventfd = param;
 	struct virtio_mmio *vmmio = ioeventfd->vdev->virtio;
 
-	ioeventfd->vdev->ops->notify_vq(kvm, vmmio->dev, ioeventfd->vq);
+	virtio_notify_vq(kvm, ioeventfd->vdev, vmmio->dev, ioeventfd->vq);
 }
 
 static int virtio_mmio_init_ioeventfd(struct kvm *kvm,
@@ -110,6 +220,163 @@ static int virtio_mmio_init_ioeventfd(struct kvm *kvm,
 	return 0;
 }
 
+#ifdef RSLD
+/*
+ * Signal moderation. All the shared memory devices raise the same
+ * notification (a mailbox kick, or hvl_irq), and the driver finds out which
+ * of them fired from their interrupt_state. A device with a non-zero
+ * hvl_coalesce_usecs thus only raises it once it collected
+ * hvl_coalesce_frames signals or when the oldest deferred signal is that old,
+ * and the notification then covers every device flagged in the meantime.
+ */
+static DEFINE_MUTEX(hvl_signal_lock);
+static struct ioevent *hvl_signal_timer;
+static u64 hvl_signal_deadline;
+
+static void virtio_mmio_hvl_raise(struct kvm *kvm)
+{
+	if (kvm->cfg.pmm)
+		notify_mbox(kvm);
+	else
+		kvm__irq_trigger(kvm, kvm->cfg.hvl_irq);
+}
+
+static void virtio_mmio_hvl_arm(u64 deadline)
+{
+	struct itimerspec its = {
+		.it_value	= {
+			.tv_sec		= deadline / 1000000000ULL,
+			.tv_nsec	= deadline % 1000000000ULL,
+		},
+	};
+
+	hvl_signal_deadline = deadline;
+	if (timerfd_settime(hvl_signal_timer->fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+		pr_warning("virtio-mmio: unable to arm the signal timer");
+}
+
+/* Called with hvl_signal_lock held */
+static void virtio_mmio_hvl_flush(struct kvm *kvm)
+{
+	struct virtio_mmio *vmmio;
+
+	list_for_each_entry(vmmio, &hvl_devices, hvl_list)
+		vmmio->hvl_pending_signals = 0;
+
+	if (hvl_signal_deadline)
+		virtio_mmio_hvl_arm(0);
+
+	/* The driver must see interrupt_state once notified */
+	wmb();
+	virtio_mmio_hvl_raise(kvm);
+}
+
+static void virtio_mmio_hvl_signal_timeout(struct kvm *kvm, void *param)
+{
+	u64 expirations;
+
+	if (read(hvl_signal_timer->fd, &expirations, sizeof(expirations)) < 0)
+		return;
+
+	mutex_lock(&hvl_signal_lock);
+	if (hvl_signal_deadline) {
+		hvl_signal_deadline = 0;
+		virtio_mmio_hvl_flush(kvm);
+	}
+	mutex_unlock(&hvl_signal_lock);
+}
+
+static int virtio_mmio_hvl_signal_timer_init(struct kvm *kvm)
+{
+	int fd;
+
+	if (hvl_signal_timer)
+		return 0;
+
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	hvl_signal_timer = malloc(sizeof(*hvl_signal_timer));
+	if (!hvl_signal_timer) {
+		close(fd);
+		return -ENOMEM;
+	}
+
+	*hvl_signal_timer = (struct ioevent) {
+		.io_addr	= PMM_NOTIFY_ADDR,
+		.fn		= virtio_mmio_hvl_signal_timeout,
+		.fn_kvm		= kvm,
+		.fd		= fd,
+		.datamatch	= PMM_IOEVENT_COALESCE,
+		.flags		= IOEVENTFD_FLAG_USER_POLL | IOEVENTFD_FLAG_NO_READ,
+	};
+
+	return ioeventfd__add_epoll_event(hvl_signal_timer, fd);
+}
+
+static void virtio_mmio_hvl_signal(struct kvm *kvm, struct virtio_mmio *vmmio,
+				   bool now)
+{
+	struct timespec ts;
+	u64 deadline;
+
+	if (!vmmio->hvl_coalesce_usecs) {
+		if (!hvl_signal_timer) {
+			virtio_mmio_hvl_raise(kvm);
+			return;
+		}
+		now = true;
+	}
+
+	mutex_lock(&hvl_signal_lock);
+
+	if (now || (vmmio->hvl_coalesce_frames &&
+		    ++vmmio->hvl_pending_signals >= vmmio->hvl_coalesce_frames)) {
+		virtio_mmio_hvl_flush(kvm);
+	} else {
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		deadline = (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec +
+			   (u64)vmmio->hvl_coalesce_usecs * 1000;
+		if (!hvl_signal_deadline || deadline < hvl_signal_deadline)
+			virtio_mmio_hvl_arm(deadline);
+	}
+
+	mutex_unlock(&hvl_signal_lock);
+}
+
+static int virtio_mmio_hvl_coalesce_init(struct kvm *kvm,
+					 struct virtio_mmio *vmmio)
+{
+	struct pmm_coalesce *c = &kvm->cfg.pmm_coalesce[0];
+	u32 id = vmmio->hdr.device_id;
+
+	if (id < PMM_MAX_DEVICE_ID && kvm->cfg.pmm_coalesce[id].set)
+		c = &kvm->cfg.pmm_coalesce[id];
+
+	vmmio->hvl_coalesce_usecs = c->usecs;
+	vmmio->hvl_coalesce_frames = c->frames;
+	vmmio->hvl_pending_signals = 0;
+
+	if (!c->usecs)
+		return 0;
+
+	return virtio_mmio_hvl_signal_timer_init(kvm);
+}
+
+/* The signal timer goes away with the last shared memory device */
+static void virtio_mmio_hvl_coalesce_exit(void)
+{
+	mutex_lock(&hvl_signal_lock);
+	if (hvl_signal_timer && list_empty(&hvl_devices)) {
+		ioeventfd__del_epoll_event(hvl_signal_timer);
+		hvl_signal_timer = NULL;
+		hvl_signal_deadline = 0;
+	}
+	mutex_unlock(&hvl_signal_lock);
+}
+#endif
+
 int virtio_mmio_signal_vq(struct kvm *kvm, struct virtio_device *vdev, u32 vq)
 {
 	struct virtio_mmio *vmmio = vdev->virtio;
@@ -119,10 +386,7 @@ int virtio_mmio_signal_vq(struct kvm *kvm, struct virtio_device *vdev, u32 vq)
 	if (kvm->cfg.rsld) {
 		if (vmmio->static_hdr != NULL)
 			vmmio->static_hdr->interrupt_state |= VIRTIO_MMIO_INT_VRING;
-		if (kvm->cfg.pmm)
-			notify_mbox(kvm);
-		else
-			kvm__irq_trigger(kvm, kvm->cfg.hvl_irq);
+		virtio_mmio_hvl_signal(kvm, vmmio, false);
 	} else {
 #endif
 	kvm__irq_trigger(vmmio->kvm, vmmio->irq);
@@ -149,13 +413,8 @@ int virtio_mmio_signal_config(struct kvm *kvm, struct virtio_device *vdev)
 	vmmio->hdr.interrupt_state |= VIRTIO_MMIO_INT_CONFIG;
 #ifdef RSLD
     vmmio->static_hdr->interrupt_state |= VIRTIO_MMIO_INT_CONFIG;
-	if (kvm->cfg.rsld) {
-		if (kvm->cfg.pmm) {
-			notify_mbox(kvm);
-		} else {
-			kvm__irq_trigger(kvm, kvm->cfg.hvl_irq);
-		}
-	}
+	if (kvm->cfg.rsld)
+		virtio_mmio_hvl_signal(kvm, vmmio, true);
 #else
 	kvm__irq_trigger(vmmio->kvm, vmmio->irq);
 #endif
@@ -204,15 +463,23 @@ static void virtio_mmio_config_in(struct kvm_cpu *vcpu,
 		ioport__write32(data, *(u32 *)(((void *)&vmmio->hdr) + addr));
 		break;
 	case VIRTIO_MMIO_HOST_FEATURES:
-		if (vmmio->hdr.host_features_sel == 0)
-			val = vdev->ops->get_host_features(vmmio->kvm,
-							   vmmio->dev);
+		if (vmmio->hdr.host_features_sel < 2)
+			val = virtio_mmio_host_features(vmmio, vdev) >>
+			      (32 * vmmio->hdr.host_features_sel);
 		ioport__write32(data, val);
 		break;
 	case VIRTIO_MMIO_QUEUE_PFN:
 		vq = vdev->ops->get_vq(vmmio->kvm, vmmio->dev,
 				       vmmio->hdr.queue_sel);
-		ioport__write32(data, vq->pfn);
+		ioport__write32(data, vq->vring_addr.pfn);
+		break;
+	case VIRTIO_MMIO_QUEUE_READY:
+		vq = vdev->ops->get_vq(vmmio->kvm, vmmio->dev,
+				       vmmio->hdr.queue_sel);
+		ioport__write32(data, vq->enabled);
+		break;
+	case VIRTIO_MMIO_CONFIG_GENERATION:
+		ioport__write32(data, 0);
 		break;
 	case VIRTIO_MMIO_QUEUE_NUM_MAX:
 		val = vdev->ops->get_size_vq(vmmio->kvm, vmmio->dev,
@@ -230,24 +497,42 @@ static void virtio_mmio_config_out(struct kvm_cpu *vcpu,
 {
 	struct virtio_mmio *vmmio = vdev->virtio;
 	struct kvm *kvm = vmmio->kvm;
+	struct virt_queue *vq;
+	unsigned int shift;
 	u32 val = 0;
 
 	switch (addr) {
 	case VIRTIO_MMIO_HOST_FEATURES_SEL:
 	case VIRTIO_MMIO_GUEST_FEATURES_SEL:
 	case VIRTIO_MMIO_QUEUE_SEL:
+	case VIRTIO_MMIO_QUEUE_DESC_LOW:
+	case VIRTIO_MMIO_QUEUE_DESC_HIGH:
+	case VIRTIO_MMIO_QUEUE_AVAIL_LOW:
+	case VIRTIO_MMIO_QUEUE_AVAIL_HIGH:
+	case VIRTIO_MMIO_QUEUE_USED_LOW:
+	case VIRTIO_MMIO_QUEUE_USED_HIGH:
 		val = ioport__read32(data);
 		*(u32 *)(((void *)&vmmio->hdr) + addr) = val;
 		break;
 	case VIRTIO_MMIO_STATUS:
-		vmmio->hdr.status = ioport__read32(data);
-		if (!vmmio->hdr.status) /* Sample endianness on reset */
+		val = ioport__read32(data);
+		if (!val) /* Sample endianness on reset */
 			vdev->endian = kvm_cpu__get_endianness(vcpu);
+		/* Version 2 drivers write both feature words first */
+		if (vmmio->hdr.version == 2 &&
+		    (val & ~vmmio->hdr.status & VIRTIO_CONFIG_S_FEATURES_OK))
+			virtio_set_guest_features(kvm, vdev, vmmio->dev,
+						  vdev->features);
+		vmmio->hdr.status = val;
 		virtio_notify_status(kvm, vdev, vmmio->dev, vmmio->hdr.status);
 		break;
 	case VIRTIO_MMIO_GUEST_FEATURES:
-		if (vmmio->hdr.guest_features_sel == 0) {
-			val = ioport__read32(data);
+		val = ioport__read32(data);
+		if (vmmio->hdr.version == 2 && vmmio->hdr.guest_features_sel < 2) {
+			shift = 32 * vmmio->hdr.guest_features_sel;
+			vdev->features &= ~(0xffffffffULL << shift);
+			vdev->features |= (u64)val << shift;
+		} else if (vmmio->hdr.guest_features_sel == 0) {
 			virtio_set_guest_features(vmmio->kvm, vdev,
 						  vmmio->dev, val);
 		}
@@ -267,22 +552,25 @@ static void virtio_mmio_config_out(struct kvm_cpu *vcpu,
 		vmmio->hdr.queue_align = val;
 		break;
 	case VIRTIO_MMIO_QUEUE_PFN:
+	case VIRTIO_MMIO_QUEUE_READY:
 		val = ioport__read32(data);
 		if (val) {
+			vq = vdev->ops->get_vq(vmmio->kvm, vmmio->dev,
+					       vmmio->hdr.queue_sel);
+			if (addr == VIRTIO_MMIO_QUEUE_PFN)
+				vmmio->hdr.queue_pfn = val;
+			virtio_mmio_set_vring_addr(vmmio, &vmmio->hdr, vq);
 			virtio_mmio_init_ioeventfd(vmmio->kvm, vdev,
 						   vmmio->hdr.queue_sel);
 			vdev->ops->init_vq(vmmio->kvm, vmmio->dev,
-					   vmmio->hdr.queue_sel,
-					   vmmio->hdr.guest_page_size,
-					   vmmio->hdr.queue_align,
-					   val);
+					   vmmio->hdr.queue_sel);
 		} else {
 			virtio_mmio_exit_vq(kvm, vdev, vmmio->hdr.queue_sel);
 		}
 		break;
 	case VIRTIO_MMIO_QUEUE_NOTIFY:
 		val = ioport__read32(data);
-		vdev->ops->notify_vq(vmmio->kvm, vmmio->dev, val);
+		virtio_notify_vq(vmmio->kvm, vdev, vmmio->dev, val);
 		break;
 	case VIRTIO_MMIO_INTERRUPT_ACK:
 		val = ioport__read32(data);
@@ -294,7 +582,92 @@ static void virtio_mmio_config_out(struct kvm_cpu *vcpu,
 }
 
 #ifdef RSLD
-#include <time.h>
+/*
+ * The frontend brackets its header updates with increments of the generation
+ * field (odd while it is writing, even once published) and rings the doorbell
+ * afterwards. Take a private copy of the header and give up if a writer is in
+ * the middle of an update: the doorbell that follows will bring us back.
+ */
+static bool virtio_mmio_hdr_snapshot(struct virtio_mmio *vmmio,
+				     struct virtio_mmio_hdr *snap)
+{
+	volatile u32 *gen = (void *)vmmio->static_hdr + VIRTIO_MMIO_HVL_GENERATION;
+	int retries = VIRTIO_MMIO_SNAPSHOT_RETRIES;
+	u32 start;
+
+	do {
+		start = *gen;
+		if (start & 1)
+			continue;
+
+		/* Read the fields only after the generation they belong to */
+		rmb();
+		memcpy(snap, vmmio->static_hdr, sizeof(*snap));
+		rmb();
+
+		if (*gen == start)
+			return true;
+	} while (--retries);
+
+	return false;
+}
+
+static void virtio_mmio_hvl_publish_features(struct virtio_mmio *vmmio,
+					     struct virtio_device *vdev)
+{
+	u64 features = virtio_mmio_host_features(vmmio, vdev);
+
+	/* Vhost only knows about split rings */
+	if (vdev->use_vhost)
+		vmmio->static_hdr->hvl_features &= ~VIRTIO_MMIO_HVL_F_RING_PACKED;
+
+	vmmio->static_hdr->host_features = (u32)features;
+	vmmio->static_hdr->host_features_high = features >> 32;
+}
+
+/* Set up the next queue, described by the header snapshot */
+static void virtio_mmio_hvl_init_vq(struct virtio_mmio *vmmio,
+				    struct virtio_mmio_hdr *shdr)
+{
+	struct virtio_device *vdev = vmmio->vdev;
+	struct kvm *kvm = vmmio->kvm;
+	int qidx = vmmio->num_vqs;
+	struct virt_queue *vq;
+	cpu_set_t cpus;
+	bool pinned;
+
+	vq = vdev->ops->get_vq(kvm, vmmio->dev, qidx);
+	virtio_mmio_set_vring_addr(vmmio, shdr, vq);
+	virtio_mmio_init_ioeventfd(kvm, vdev, qidx);
+	vmmio->hvl_avail_idx[qidx] = 0;
+
+	/* Queue workers started here run close to the window */
+	pinned = pmm__enter_window(kvm, vmmio->hvl_window, &cpus);
+	vdev->ops->init_vq(kvm, vmmio->dev, qidx);
+	if (pinned)
+		pmm__leave_window(&cpus);
+
+	vmmio->num_vqs++;
+}
+
+/*
+ * Tear down the queues of the previous driver instance, so that the next one
+ * sets them up again from queue 0. The device region and the buffer pool
+ * last as long as the device: the new driver may already be using them, and
+ * gets its buffers back through SHM_BUF_POOL_RESET.
+ */
+static void virtio_mmio_hvl_reclaim(struct kvm *kvm, struct virtio_mmio *vmmio)
+{
+	int i;
+
+	for (i = 0; i < vmmio->num_vqs; i++)
+		virtio_mmio_exit_vq(kvm, vmmio->vdev, i);
+
+	/* The same rings may well be set up again */
+	vmmio->num_vqs = 0;
+	vmmio->hdr.queue_pfn = 0;
+	vmmio->hdr.queue_ready = 0;
+}
 
 static void virtio_mmio_notification_out(struct kvm_cpu *vcpu,
 				   u64 addr, void *data, u32 len,
@@ -302,49 +675,69 @@ static void virtio_mmio_notification_out(struct kvm_cpu *vcpu,
 {
 	struct virtio_mmio *vmmio = vdev->virtio;
 	struct kvm *kvm = vmmio->kvm;
+	struct virtio_mmio_hdr shdr;
 	u32 val = 0;
-    static int qidx = 0;
     int i = 0;
 	int hvl_cfg_notif = 0;
 	int reinit = 0;
+	u64 features;
 
-#if 1
-	struct timespec tm = {0, 1000000L};
-	nanosleep(&tm, NULL);
-#endif
+	if (!virtio_mmio_hdr_snapshot(vmmio, &shdr))
+		return;
+
+	vmmio->hvl_generation = shdr.generation;
+	vmmio->hvl_doorbell = !!(shdr.hvl_driver_features &
+				 shdr.hvl_features &
+				 VIRTIO_MMIO_HVL_F_DOORBELL);
 
-	if ((vmmio->static_hdr->status != vmmio->hdr.status) && (vmmio->static_hdr->status == 0) &&
+	if ((shdr.status != vmmio->hdr.status) && (shdr.status == 0) &&
 		(vmmio->hdr.status & VIRTIO_CONFIG_S_DRIVER_OK)) {
 		//reinit
-		vmmio->hdr.status = vmmio->static_hdr->status;
+		vmmio->hdr.status = shdr.status;
 		vmmio->hdr.queue_sel = 0xff00ff00;
 		vmmio->static_hdr->queue_sel = ~vmmio->hdr.queue_sel;
 		reinit = 1;
 	}
 
-	if (vmmio->static_hdr->status < vmmio->hdr.status) {
+	if (shdr.status < vmmio->hdr.status) {
 		//reinit
-		vmmio->hdr.status = vmmio->static_hdr->status;
+		vmmio->hdr.status = shdr.status;
 		vmmio->hdr.queue_sel = 0xff00ff00;
 		vmmio->static_hdr->queue_sel = ~vmmio->hdr.queue_sel;
 		reinit = 1;
 	}
 
+	if (reinit)
+		virtio_mmio_hvl_reclaim(kvm, vmmio);
+
 	if (vmmio->hdr.status & VIRTIO_CONFIG_S_DRIVER_OK) {
-		if (vmmio->static_hdr->interrupt_ack) {
+		if (shdr.interrupt_ack) {
 			vmmio->static_hdr->interrupt_state = vmmio->hdr.interrupt_state = 0;
 			vmmio->static_hdr->interrupt_ack = 0;
 			return;
 		}
 	}
 
-    if (vmmio->static_hdr->guest_features != vmmio->hdr.guest_features) {
-		virtio_set_guest_features(kvm, vdev, vmmio->dev, vmmio->static_hdr->guest_features);
-        vmmio->hdr.guest_features = vmmio->static_hdr->guest_features;
-    }
+	if (vmmio->hdr.version == 1)
+		shdr.guest_features_high = 0;
+
+	if (shdr.guest_features != vmmio->hdr.guest_features ||
+	    shdr.guest_features_high != vmmio->hdr.guest_features_high) {
+		features = (u64)shdr.guest_features_high << 32 | shdr.guest_features;
+		virtio_set_guest_features(kvm, vdev, vmmio->dev, features);
+		vmmio->hdr.guest_features = shdr.guest_features;
+		vmmio->hdr.guest_features_high = shdr.guest_features_high;
+	}
+
+	/* The queue layout is settled before the driver sets up the queues */
+	if (!(vmmio->hdr.status & VIRTIO_CONFIG_S_DRIVER_OK))
+		vdev->ring_packed =
+			!!(vdev->features & (1ULL << VIRTIO_F_RING_PACKED)) ||
+			!!(shdr.hvl_driver_features & shdr.hvl_features &
+			   VIRTIO_MMIO_HVL_F_RING_PACKED);
 
-    if (vmmio->static_hdr->status != vmmio->hdr.status) {
-        vmmio->static_hdr->host_features = vdev->ops->get_host_features(vmmio->kvm, vmmio->dev);
+    if (shdr.status != vmmio->hdr.status) {
+		virtio_mmio_hvl_publish_features(vmmio, vdev);
         if (!vmmio->hdr.status) {
             if (kvm->cfg.pmm) {
 				vdev->endian = VIRTIO_ENDIAN_LE;
@@ -352,19 +745,22 @@ static void virtio_mmio_notification_out(struct kvm_cpu *vcpu,
 				vdev->endian = kvm_cpu__get_endianness(vcpu);
 			}
 		}
-        vmmio->hdr.status = vmmio->static_hdr->status;
+		if (kvm->cfg.pmm &&
+		    (shdr.status & ~vmmio->hdr.status & VIRTIO_CONFIG_S_DRIVER_OK))
+			pmm__phase("device %u driver ready", vmmio->hdr.device_id);
+        vmmio->hdr.status = shdr.status;
         virtio_notify_status(kvm, vdev, vmmio->dev, vmmio->hdr.status);
     }
 
     if (!(vmmio->hdr.status & VIRTIO_CONFIG_S_DRIVER_OK)) {
-        if (vmmio->static_hdr->queue_sel != vmmio->hdr.queue_sel) {
-			vmmio->hdr.queue_sel = vmmio->static_hdr->queue_sel;
+        if (shdr.queue_sel != vmmio->hdr.queue_sel) {
+			vmmio->hdr.queue_sel = shdr.queue_sel;
             vmmio->hdr.queue_num = 0xff00ff00;
         }
 
-		if ((vmmio->static_hdr->queue_num != vmmio->hdr.queue_num) &&
-			(vmmio->static_hdr->queue_num != HVL_CFG_ACK)) {
-			val = vmmio->static_hdr->queue_num;
+		if ((shdr.queue_num != vmmio->hdr.queue_num) &&
+			(shdr.queue_num != HVL_CFG_ACK)) {
+			val = shdr.queue_num;
 
 			if (val) {
 				vmmio->hdr.queue_num = val;
@@ -372,47 +768,257 @@ static void virtio_mmio_notification_out(struct kvm_cpu *vcpu,
 				       vmmio->num_vqs, val);
 			}
 		}
-		if ((vmmio->static_hdr->queue_pfn != vmmio->hdr.queue_pfn) &&
-			(vmmio->static_hdr->queue_pfn != HVL_CFG_ACK)) {
-            vmmio->hdr.queue_pfn = vmmio->static_hdr->queue_pfn;
-    		val = vmmio->static_hdr->queue_pfn;
-            qidx = vmmio->num_vqs;
+		if (vmmio->hdr.version == 1 &&
+		    (shdr.queue_pfn != vmmio->hdr.queue_pfn) &&
+			(shdr.queue_pfn != HVL_CFG_ACK)) {
+            vmmio->hdr.queue_pfn = shdr.queue_pfn;
+    		val = shdr.queue_pfn;
     		if (val) {
-    			virtio_mmio_init_ioeventfd(vmmio->kvm, vdev, qidx);
-    			vdev->ops->init_vq(vmmio->kvm, vmmio->dev,
-    					   vmmio->num_vqs,
-    					   vmmio->static_hdr->guest_page_size,
-    					   vmmio->static_hdr->queue_align,
-    					   val);
-                vmmio->num_vqs++;
+				virtio_mmio_hvl_init_vq(vmmio, &shdr);
 				hvl_cfg_notif = 1;
 				//signal completion
 				vmmio->static_hdr->queue_pfn = HVL_CFG_ACK;
             } else {
-    			virtio_mmio_exit_vq(kvm, vdev, qidx);
+    			virtio_mmio_exit_vq(kvm, vdev, vmmio->num_vqs);
     		}
+		} else if (vmmio->hdr.version == 2 &&
+			   (shdr.queue_ready != vmmio->hdr.queue_ready) &&
+			   (shdr.queue_ready != HVL_CFG_ACK)) {
+			/*
+			 * Every queue is made ready with the same value, so
+			 * the acknowledgement also stands for the last value
+			 * seen.
+			 */
+			if (shdr.queue_ready) {
+				virtio_mmio_hvl_init_vq(vmmio, &shdr);
+				hvl_cfg_notif = 1;
+				vmmio->hdr.queue_ready = HVL_CFG_ACK;
+				vmmio->static_hdr->queue_ready = HVL_CFG_ACK;
+			} else {
+				vmmio->hdr.queue_ready = 0;
+				virtio_mmio_exit_vq(kvm, vdev, vmmio->num_vqs);
+			}
         } else {
 			if (reinit) {
 				hvl_cfg_notif = 1;
 				vmmio->static_hdr->queue_pfn = HVL_CFG_ACK;
+				vmmio->static_hdr->queue_ready = HVL_CFG_ACK;
 			}
 		}
     }
 
-	if (hvl_cfg_notif)
+	if (hvl_cfg_notif) {
+		/* Publish the acknowledgement before raising the notification */
+		wmb();
 		notify_mbox(kvm);
+	}
 
-    if (vmmio->static_hdr->interrupt_state != vmmio->hdr.interrupt_state) {
-        vmmio->hdr.interrupt_state &= ~vmmio->static_hdr->interrupt_state;
+    if (shdr.interrupt_state != vmmio->hdr.interrupt_state) {
+        vmmio->hdr.interrupt_state &= ~shdr.interrupt_state;
         vmmio->static_hdr->interrupt_state = vmmio->hdr.interrupt_state;
     }
 
-    if (vmmio->hdr.status & VIRTIO_CONFIG_S_DRIVER_OK) {
+	/* Without the doorbell bitmap we cannot tell which queue was kicked */
+    if (!vmmio->hvl_doorbell && (vmmio->hdr.status & VIRTIO_CONFIG_S_DRIVER_OK)) {
         for (i = 0; i < vmmio->num_vqs; i++) {
-            vdev->ops->notify_vq(vmmio->kvm, vmmio->dev, i);
+            virtio_notify_vq(vmmio->kvm, vdev, vmmio->dev, i);
         }
     }
 }
+
+static void virtio_mmio_hvl_notify_pending(struct virtio_device *vdev)
+{
+	struct virtio_mmio *vmmio = vdev->virtio;
+	u32 *pending = (void *)vmmio->static_hdr + VIRTIO_MMIO_HVL_PENDING_VQS;
+	u32 vqs;
+	int vq;
+
+	if (!(vmmio->hdr.status & VIRTIO_CONFIG_S_DRIVER_OK))
+		return;
+
+	/* Claim the kicks published so far, later ones ring again */
+	vqs = __sync_fetch_and_and(pending, 0);
+
+	while (vqs) {
+		vq = __builtin_ffs(vqs) - 1;
+		vqs &= vqs - 1;
+
+		if (vq < vmmio->num_vqs)
+			virtio_notify_vq(vmmio->kvm, vdev, vmmio->dev, vq);
+	}
+}
+
+/* The driver asked for its buffers back after a reset */
+static void virtio_mmio_hvl_reset_bufs(struct kvm *kvm, struct virtio_mmio *vmmio)
+{
+	volatile u32 *state = &vmmio->hvl_bufs->state;
+
+	if (*state != SHM_BUF_POOL_RESET)
+		return;
+
+	rmb();
+	shm_buf_pool__reset(vmmio->hvl_bufs);
+	virtio_mmio_hvl_signal(kvm, vmmio, true);
+}
+
+/* Pick up whatever the driver of a shared memory device published */
+static void virtio_mmio_hvl_service(struct kvm_cpu *vcpu,
+				    struct virtio_mmio *vmmio)
+{
+	struct virtio_device *vdev = vmmio->vdev;
+	volatile u32 *gen;
+
+	if (vmmio->hvl_bufs)
+		virtio_mmio_hvl_reset_bufs(vcpu->kvm, vmmio);
+
+	gen = (void *)vmmio->static_hdr + VIRTIO_MMIO_HVL_GENERATION;
+	if (!vmmio->hvl_doorbell || *gen != vmmio->hvl_generation)
+		virtio_mmio_notification_out(vcpu, 0, NULL, 0, vdev);
+
+	if (vmmio->hvl_doorbell)
+		virtio_mmio_hvl_notify_pending(vdev);
+}
+
+static void virtio_mmio_hvl_work(struct kvm_cpu *vcpu, void *arg)
+{
+	virtio_mmio_hvl_service(vcpu, arg);
+}
+
+/*
+ * Whether the driver published anything since the device was last
+ * serviced. Racing with the worker of the device only costs a spurious
+ * kick, as the worker takes a fresh look each time it runs.
+ */
+static bool virtio_mmio_hvl_has_work(struct virtio_mmio *vmmio)
+{
+	volatile u32 *gen = (void *)vmmio->static_hdr + VIRTIO_MMIO_HVL_GENERATION;
+	volatile u32 *pending = (void *)vmmio->static_hdr + VIRTIO_MMIO_HVL_PENDING_VQS;
+
+	return !vmmio->hvl_doorbell || *gen != vmmio->hvl_generation ||
+	       *pending ||
+	       (vmmio->hvl_bufs && vmmio->hvl_bufs->state == SHM_BUF_POOL_RESET);
+}
+
+/*
+ * Doorbell handler for the devices living in the shared memory pool. Drivers
+ * that negotiated VIRTIO_MMIO_HVL_F_DOORBELL flag the queues they kicked, so
+ * an idle device costs two loads: its header generation and its bitmap.
+ * Devices with a worker of their own (--pmm-worker) are only kicked here.
+ */
+void virtio_mmio_hvl_notify(struct kvm_cpu *vcpu)
+{
+	struct virtio_mmio *vmmio;
+
+	list_for_each_entry(vmmio, &hvl_devices, hvl_list) {
+		if (!vmmio->hvl_worker)
+			virtio_mmio_hvl_service(vcpu, vmmio);
+		else if (virtio_mmio_hvl_has_work(vmmio))
+			pmm__worker_kick(vmmio->hvl_worker);
+	}
+}
+
+/*
+ * Kick a polled queue if its avail index moved since the last kick. Packed
+ * rings have no such index, there the next descriptor to consume, with the
+ * avail wrap counter on top, stands for it once it is available.
+ */
+static bool virtio_mmio_hvl_kick_avail(struct virtio_mmio *vmmio,
+				       struct virt_queue *vq, int i)
+{
+	struct virtio_device *vdev = vmmio->vdev;
+	u16 avail_idx;
+
+	if (vq->packed) {
+		if (!virt_queue__available_packed(vq))
+			return false;
+		avail_idx = vq->last_avail_idx | vq->avail_wrap << 15;
+	} else {
+		avail_idx = *(volatile u16 *)&vq->vring.avail->idx;
+	}
+	if (avail_idx == vmmio->hvl_avail_idx[i])
+		return false;
+
+	vmmio->hvl_avail_idx[i] = avail_idx;
+	/* Counted and traced like a doorbell kick */
+	virtio_notify_vq(vmmio->kvm, vdev, vmmio->dev, i);
+
+	return true;
+}
+
+static struct virt_queue *virtio_mmio_hvl_poll_vq(struct virtio_mmio *vmmio,
+						  int i)
+{
+	struct virtio_device *vdev = vmmio->vdev;
+	struct virt_queue *vq;
+
+	/*
+	 * Vhost owns the rings of its devices, and devices with a worker are
+	 * only serviced by it.
+	 */
+	if (vdev->use_vhost || vmmio->hvl_worker ||
+	    !(vmmio->hdr.status & VIRTIO_CONFIG_S_DRIVER_OK))
+		return NULL;
+
+	vq = vdev->ops->get_vq(vmmio->kvm, vmmio->dev, i);
+	if (!vq || !vq->vring.avail)
+		return NULL;
+
+	return vq;
+}
+
+/*
+ * Busy-poll pass over the shared memory queues, asking the drivers not to
+ * kick them. Header updates still come with a doorbell. Returns true if any
+ * queue had new buffers.
+ */
+bool virtio_mmio_hvl_poll(struct kvm_cpu *vcpu)
+{
+	struct virtio_mmio *vmmio;
+	struct virt_queue *vq;
+	bool work = false;
+	int i;
+
+	list_for_each_entry(vmmio, &hvl_devices, hvl_list) {
+		for (i = 0; i < vmmio->num_vqs; i++) {
+			vq = virtio_mmio_hvl_poll_vq(vmmio, i);
+			if (!vq)
+				continue;
+
+			if (!vq->polling)
+				virt_queue__set_polling(vq, true);
+
+			work |= virtio_mmio_hvl_kick_avail(vmmio, vq, i);
+		}
+	}
+
+	return work;
+}
+
+/*
+ * Hand the shared memory queues back to driver kicks. Buffers published
+ * before the drivers noticed are kicked here, in which case true is returned
+ * and the caller should rather keep polling.
+ */
+bool virtio_mmio_hvl_stop_polling(struct kvm_cpu *vcpu)
+{
+	struct virtio_mmio *vmmio;
+	struct virt_queue *vq;
+	bool work = false;
+	int i;
+
+	list_for_each_entry(vmmio, &hvl_devices, hvl_list) {
+		for (i = 0; i < vmmio->num_vqs; i++) {
+			vq = virtio_mmio_hvl_poll_vq(vmmio, i);
+			if (!vq || !vq->polling)
+				continue;
+
+			virt_queue__set_polling(vq, false);
+			work |= virtio_mmio_hvl_kick_avail(vmmio, vq, i);
+		}
+	}
+
+	return work;
+}
 #endif
 
 static void virtio_mmio_mmio_callback(struct kvm_cpu *vcpu,
@@ -543,7 +1149,7 @@ int virtio_mmio_init(struct kvm *kvm, void *dev, struct virtio_device *vdev,
 
 	vmmio->hdr = (struct virtio_mmio_hdr) {
 		.magic		= {'v', 'i', 'r', 't'},
-		.version	= 1,
+		.version	= kvm->cfg.virtio_modern ? 2 : 1,
 		.device_id	= subsys_id,
 		.vendor_id	= 0x4d564b4c , /* 'LKVM' */
 		.queue_num_max	= 256,
@@ -566,11 +1172,17 @@ int virtio_mmio_init(struct kvm *kvm, void *dev, struct virtio_device *vdev,
     if (vdev->ops->get_mem_size)
         vmmio_shm_size = vdev->ops->get_mem_size(vmmio->kvm, vmmio->dev);
 
-    vmmio_shm_phys_addr = virtio_mmio_get_shm_space_block(kvm, vmmio_shm_size);
+    vmmio_shm_phys_addr = virtio_mmio_get_shm_region(kvm, vmmio, &vmmio_shm_size);
     vdev->endian = VIRTIO_ENDIAN_LE;
 
+    if (kvm->cfg.hvl_shmem_phys_addr && !vmmio_shm_phys_addr) {
+        device__unregister(&vmmio->dev_hdr);
+        kvm__deregister_mmio(kvm, vmmio->addr);
+        return -ENOMEM;
+    }
+
     if (vmmio_shm_phys_addr != 0) {
-        vmmio_shm_addr = (u64)kvm->shmem_start + (vmmio_shm_phys_addr - kvm->cfg.hvl_shmem_phys_addr);
+        vmmio_shm_addr = (u64)shm_pool__to_host(kvm, vmmio_shm_phys_addr);
         vmmio->hdr.shm_len_low = virtio_host_to_guest_u32(vdev, (u32)vmmio_shm_size);
         vmmio->hdr.shm_len_high = virtio_host_to_guest_u32(vdev, vmmio_shm_size >> 32);
         vmmio->hdr.shm_base_low = virtio_host_to_guest_u32(vdev, (u32)vmmio_shm_phys_addr);
@@ -589,7 +1201,9 @@ int virtio_mmio_init(struct kvm *kvm, void *dev, struct virtio_device *vdev,
         vmmio->static_hdr = (struct virtio_mmio_hdr *)vmmio_hdr_addr;
         vmmio->static_hdr->guest_page_size = 0x1000;
         vmmio->static_hdr->queue_align = 0x1000;
-        vmmio->static_hdr->host_features = vdev->ops->get_host_features(vmmio->kvm, vmmio->dev);
+        vmmio->static_hdr->hvl_features = VIRTIO_MMIO_HVL_F_DOORBELL |
+                                          VIRTIO_MMIO_HVL_F_RING_PACKED;
+        virtio_mmio_hvl_publish_features(vmmio, vdev);
         vmmio->static_hdr->queue_num_max = vdev->ops->get_size_vq(vmmio->kvm, vmmio->dev, 0);
         vmmio->hdr.guest_page_size = 0x1000;
         vmmio->hdr.host_features = vmmio->static_hdr->host_features;
@@ -599,9 +1213,24 @@ int virtio_mmio_init(struct kvm *kvm, void *dev, struct virtio_device *vdev,
         vmmio->static_hdr->queue_num = ~vmmio->hdr.queue_num;
         vmmio->static_hdr->queue_pfn = 0;
 
+        vmmio->vdev = vdev;
+        vmmio->hvl_worker = pmm__worker_new(kvm, vmmio->hdr.device_id,
+                                            virtio_mmio_hvl_work, vmmio);
+        if (IS_ERR(vmmio->hvl_worker))
+            return PTR_ERR(vmmio->hvl_worker);
+        list_add_tail(&vmmio->hvl_list, &hvl_devices);
+
+        r = virtio_mmio_hvl_coalesce_init(kvm, vmmio);
+        if (r < 0)
+            return r;
+
+        r = virtio_mmio_get_buf_pool(kvm, vmmio);
+        if (r < 0)
+            return r;
+
         if (vdev->ops->get_config_size) {
             int config_size = vdev->ops->get_config_size(vmmio->kvm, vmmio->dev);
-            u8 *devcfg  = (u8 *)(vmmio_shm_addr + VIRTIO_MMIO_CONFIG);
+            u8 *devcfg  = (u8 *)(vmmio_hdr_addr + VIRTIO_MMIO_CONFIG);
             int i;
             for (i = 0; i < config_size; i++) {
                 devcfg[i] = vdev->ops->get_config(vmmio->kvm,
@@ -618,7 +1247,7 @@ int virtio_mmio_init(struct kvm *kvm, void *dev, struct virtio_device *vdev,
 	 */
 #ifdef RSLD
 	pr_debug("virtio-mmio.devices=0x%x@0x%llx [0x%x:0x%x]", VIRTIO_MMIO_IO_SIZE,
-			 (u64)vmmio->static_hdr - (u64)kvm->shmem_start + kvm->cfg.hvl_shmem_phys_addr,
+			 vmmio->static_hdr ? host_to_guest_flat(kvm, vmmio->static_hdr) : 0,
 			 vmmio->hdr.vendor_id, vmmio->hdr.device_id);
 #else
 	pr_debug("virtio-mmio.devices=0x%x@0x%x:%d", VIRTIO_MMIO_IO_SIZE,
@@ -643,8 +1272,18 @@ int virtio_mmio_exit(struct kvm *kvm, struct virtio_device *vdev)
 {
 	struct virtio_mmio *vmmio = vdev->virtio;
 
+	virtio_exit_device(vdev);
 	virtio_mmio_reset(kvm, vdev);
 	kvm__deregister_mmio(kvm, vmmio->addr);
+#ifdef RSLD
+	if (vmmio->static_hdr) {
+		if (vmmio->hvl_worker)
+			pmm__worker_free(vmmio->hvl_worker);
+		list_del(&vmmio->hvl_list);
+		virtio_mmio_hvl_coalesce_exit();
+		shm_pool__release(kvm, vmmio);
+	}
+#endif
 
 	return 0;
 }
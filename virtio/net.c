@@ -10,6 +10,13 @@
 #include "kvm/iovec.h"
 #include "kvm/strbuf.h"
 #include "kvm/ioeventfd.h"
+#include "kvm/vhost-user.h"
+#ifdef CONFIG_HAS_IO_URING
+#include "kvm/uring.h"
+#endif
+#ifdef CONFIG_HAS_AF_XDP
+#include "kvm/xsk.h"
+#endif
 
 #include <linux/vhost.h>
 #include <linux/virtio_net.h>
@@ -21,6 +28,7 @@
 
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
 
 #include <sys/socket.h>
 #include <sys/ioctl.h>
@@ -34,6 +42,8 @@
 
 #define VIRTIO_NET_QUEUE_SIZE		256
 #define VIRTIO_NET_NUM_QUEUES		8
+/* Frames the transmit threads take from the ring before completing them */
+#define VIRTIO_NET_TX_BATCH		64
 
 #ifdef RSLD
 struct virtio_vproxy_ioevent_param {
@@ -43,9 +53,19 @@ struct virtio_vproxy_ioevent_param {
 #endif
 struct net_dev;
 
+/* A frame of a transmit batch, len is set once it was sent */
+struct net_tx_frame {
+	struct iovec	*iov;
+	u16		out;
+	u16		head;
+	int		len;
+};
+
 struct net_dev_operations {
 	int (*rx)(struct iovec *iov, u16 in, struct net_dev *ndev);
 	int (*tx)(struct iovec *iov, u16 in, struct net_dev *ndev);
+	/* Send nr frames at once, optional, returns < 0 on error */
+	int (*tx_batch)(struct net_tx_frame *frames, int nr, struct net_dev *ndev);
 };
 
 struct net_dev_queue {
@@ -57,6 +77,14 @@ struct net_dev_queue {
 	pthread_cond_t			cond;
 	int				gsi;
 	int				irqfd;
+
+	/* With vhost-user, the rings of the data queues are in the backend */
+	int				kick_fd;
+	/* Polled by kvmtool, the call relay or the kick of the ctrl queue */
+	int				poll_fd;
+	struct ioevent			*poll_ev;
+	bool				ready;
+	bool				started;
 };
 
 struct net_dev {
@@ -70,7 +98,8 @@ struct net_dev {
 	u32			config_size;
 	u32			mem_size;
 #endif
-	u32				features, queue_pairs;
+	u64				features;
+	u32				queue_pairs;
 
 	int				vhost_fd;
 	int				tap_fd;
@@ -83,8 +112,16 @@ struct net_dev {
 	bool				tap_ufo;
 
 	int				mode;
+#ifdef CONFIG_HAS_IO_URING
+	/* Drives the data queues with engine=uring, NULL otherwise */
+	struct net_uring		*uring;
+#endif
 
 	struct uip_info			info;
+#ifdef CONFIG_HAS_AF_XDP
+	struct xsk_info			xsk;
+#endif
+	struct vhost_user		vu;
 	struct net_dev_operations	*ops;
 	struct kvm			*kvm;
 
@@ -98,7 +135,21 @@ static int compat_id = -1;
 
 static bool has_virtio_feature(struct net_dev *ndev, u32 feature)
 {
-	return ndev->features & (1 << feature);
+	return ndev->features & (1ULL << feature);
+}
+
+/* Virtio 1.x always has num_buffers, mergeable buffers or not */
+static bool virtio_net_hdr_has_num_buffers(struct net_dev *ndev)
+{
+	return has_virtio_feature(ndev, VIRTIO_NET_F_MRG_RXBUF) ||
+	       has_virtio_feature(ndev, VIRTIO_F_VERSION_1);
+}
+
+static size_t virtio_net_hdr_len(struct net_dev *ndev)
+{
+	return virtio_net_hdr_has_num_buffers(ndev) ?
+		sizeof(struct virtio_net_hdr_mrg_rxbuf) :
+		sizeof(struct virtio_net_hdr);
 }
 
 static void virtio_net_fix_tx_hdr(struct virtio_net_hdr *hdr, struct net_dev *ndev)
@@ -117,60 +168,101 @@ static void virtio_net_fix_rx_hdr(struct virtio_net_hdr *hdr, struct net_dev *nd
 	hdr->csum_offset	= virtio_host_to_guest_u16(&ndev->vdev, hdr->csum_offset);
 }
 
+/*
+ * The receive header is filled in place, so it must fit in the first buffer
+ * of the chain. A chain where it does not is malformed and is handed back
+ * empty.
+ */
+static bool virtio_net_rx_hdr_fits(struct net_dev *ndev, struct virt_queue *vq,
+				   u16 head, struct iovec *iov)
+{
+	if (iov[0].iov_len >= virtio_net_hdr_len(ndev))
+		return true;
+
+	pr_warning("virtio-net: rx buffer too short for the header");
+	virt_queue__set_used_elem(vq, head, 0);
+
+	return false;
+}
+
+/* Block until the driver makes receive buffers available */
+static void virtio_net_rx_wait(struct net_dev_queue *queue)
+{
+	struct virt_queue *vq = &queue->vq;
+
+	mutex_lock(&queue->lock);
+	while (!virt_queue__available(vq))
+		pthread_cond_wait(&queue->cond, &queue->lock.mutex);
+	mutex_unlock(&queue->lock);
+}
+
+/*
+ * Frames are read straight into the buffers of the guest. A frame that does
+ * not fit in the first buffer lands in spill: with mergeable buffers the
+ * rest of it is copied into as many more buffers as needed, without them it
+ * is truncated.
+ */
 static void *virtio_net_rx_thread(void *p)
 {
-	struct iovec iov[VIRTIO_NET_QUEUE_SIZE];
+	struct iovec iov[VIRTIO_NET_QUEUE_SIZE + 1];
 	struct net_dev_queue *queue = p;
 	struct virt_queue *vq = &queue->vq;
 	struct net_dev *ndev = queue->ndev;
+	unsigned char spill[MAX_PACKET_SIZE + sizeof(struct virtio_net_hdr_mrg_rxbuf)];
+	struct virtio_net_hdr_mrg_rxbuf *hdr;
 	struct kvm *kvm;
-	u16 out, in;
+	u16 out, in, num_buffers;
 	u16 head;
-	int len, copied;
+	int len, copied, size, iovsize;
+	bool mergeable;
 
 	kvm__set_thread_name("virtio-net-rx");
 
 	kvm = ndev->kvm;
 	while (1) {
-		mutex_lock(&queue->lock);
-		if (!virt_queue__available(vq))
-			pthread_cond_wait(&queue->cond, &queue->lock.mutex);
-		mutex_unlock(&queue->lock);
+		virtio_net_rx_wait(queue);
 
 		while (virt_queue__available(vq)) {
-			unsigned char buffer[MAX_PACKET_SIZE + sizeof(struct virtio_net_hdr_mrg_rxbuf)];
-			struct iovec dummy_iov = {
-				.iov_base = buffer,
-				.iov_len  = sizeof(buffer),
-			};
-			struct virtio_net_hdr_mrg_rxbuf *hdr;
-			u16 num_buffers;
-
-			len = ndev->ops->rx(&dummy_iov, 1, ndev);
+			mergeable = has_virtio_feature(ndev, VIRTIO_NET_F_MRG_RXBUF);
+
+			head = virt_queue__get_iov(vq, iov, &out, &in, kvm);
+			if (!virtio_net_rx_hdr_fits(ndev, vq, head, iov)) {
+				if (virtio_queue__should_signal(vq))
+					ndev->vdev.ops->signal_vq(kvm, &ndev->vdev, queue->id);
+				continue;
+			}
+
+			hdr = iov[0].iov_base;
+			size = iov_size(iov, in);
+			iov[in].iov_base = spill;
+			iov[in].iov_len = sizeof(spill);
+
+			len = ndev->ops->rx(iov, in + 1, ndev);
 			if (len < 0) {
 				pr_warning("%s: rx on vq %u failed (%d), exiting thread\n",
 						__func__, queue->id, len);
 				goto out_err;
 			}
 
-			copied = num_buffers = 0;
-			head = virt_queue__get_iov(vq, iov, &out, &in, kvm);
-			hdr = iov[0].iov_base;
-			while (copied < len) {
-				size_t iovsize = min_t(size_t, len - copied, iov_size(iov, in));
+			copied = min(len, size);
+			num_buffers = 0;
+			virt_queue__set_used_elem_no_update(vq, head, copied, num_buffers++);
+
+			while (mergeable && copied < len) {
+				if (!virt_queue__available(vq)) {
+					virt_queue__ring_full(vq);
+					virtio_net_rx_wait(queue);
+				}
 
-				memcpy_toiovec(iov, buffer + copied, iovsize);
+				head = virt_queue__get_iov(vq, iov, &out, &in, kvm);
+				iovsize = min_t(int, len - copied, iov_size(iov, in));
+				memcpy_toiovec(iov, spill + copied - size, iovsize);
 				copied += iovsize;
 				virt_queue__set_used_elem_no_update(vq, head, iovsize, num_buffers++);
-				if (copied == len)
-					break;
-				while (!virt_queue__available(vq))
-					sleep(0);
-				head = virt_queue__get_iov(vq, iov, &out, &in, kvm);
 			}
 
 			virtio_net_fix_rx_hdr(&hdr->hdr, ndev);
-			if (has_virtio_feature(ndev, VIRTIO_NET_F_MRG_RXBUF))
+			if (virtio_net_hdr_has_num_buffers(ndev))
 				hdr->num_buffers = virtio_host_to_guest_u16(vq, num_buffers);
 
 			virt_queue__used_idx_advance(vq, num_buffers);
@@ -187,16 +279,67 @@ out_err:
 
 }
 
+static int virtio_net_tx_frames(struct net_tx_frame *frames, int nr,
+				struct net_dev *ndev)
+{
+	int i;
+
+	if (ndev->ops->tx_batch)
+		return ndev->ops->tx_batch(frames, nr, ndev);
+
+	for (i = 0; i < nr; i++) {
+		frames[i].len = ndev->ops->tx(frames[i].iov, frames[i].out, ndev);
+		if (frames[i].len < 0)
+			return frames[i].len;
+	}
+
+	return 0;
+}
+
+/*
+ * Take a batch of up to VIRTIO_NET_TX_BATCH frames off the ring, which must
+ * have one available. iov holds VIRTIO_NET_QUEUE_SIZE * 2 entries, and a
+ * batch ends before they could run out for the next chain.
+ */
+static int virtio_net_tx_gather(struct net_dev_queue *queue,
+				struct net_tx_frame *frames, struct iovec *iov)
+{
+	struct virt_queue *vq = &queue->vq;
+	struct net_dev *ndev = queue->ndev;
+	struct net_tx_frame *frame;
+	u16 in, used = 0;
+	int nr = 0;
+
+	do {
+		frame = &frames[nr++];
+		frame->iov = &iov[used];
+		frame->head = virt_queue__get_iov(vq, frame->iov, &frame->out,
+						  &in, ndev->kvm);
+		/* Only a header that fits in the first buffer is fixed up in place */
+		if (frame->out &&
+		    frame->iov[0].iov_len >= sizeof(struct virtio_net_hdr))
+			virtio_net_fix_tx_hdr(frame->iov[0].iov_base, ndev);
+		used += frame->out + in;
+	} while (nr < VIRTIO_NET_TX_BATCH &&
+		 used <= VIRTIO_NET_QUEUE_SIZE &&
+		 virt_queue__available(vq));
+
+	return nr;
+}
+
+/*
+ * Frames are taken from the ring in batches, sent together, and completed
+ * with a single used index update and at most one interrupt per batch.
+ */
 static void *virtio_net_tx_thread(void *p)
 {
-	struct iovec iov[VIRTIO_NET_QUEUE_SIZE];
+	struct iovec iov[VIRTIO_NET_QUEUE_SIZE * 2];
+	struct net_tx_frame frames[VIRTIO_NET_TX_BATCH];
 	struct net_dev_queue *queue = p;
 	struct virt_queue *vq = &queue->vq;
 	struct net_dev *ndev = queue->ndev;
 	struct kvm *kvm;
-	u16 out, in;
-	u16 head;
-	int len;
+	int i, nr, r;
 
 	kvm__set_thread_name("virtio-net-tx");
 
@@ -209,22 +352,23 @@ static void *virtio_net_tx_thread(void *p)
 		mutex_unlock(&queue->lock);
 
 		while (virt_queue__available(vq)) {
-			struct virtio_net_hdr *hdr;
-			head = virt_queue__get_iov(vq, iov, &out, &in, kvm);
-			hdr = iov[0].iov_base;
-			virtio_net_fix_tx_hdr(hdr, ndev);
-			len = ndev->ops->tx(iov, out, ndev);
-			if (len < 0) {
+			nr = virtio_net_tx_gather(queue, frames, iov);
+
+			r = virtio_net_tx_frames(frames, nr, ndev);
+			if (r < 0) {
 				pr_warning("%s: tx on vq %u failed (%d)\n",
-						__func__, queue->id, errno);
+						__func__, queue->id, r);
 				goto out_err;
 			}
 
-			virt_queue__set_used_elem(vq, head, len);
-		}
+			for (i = 0; i < nr; i++)
+				virt_queue__set_used_elem_in_order(vq, frames[i].head,
+								   frames[i].len);
 
-		if (virtio_queue__should_signal(vq))
-			ndev->vdev.ops->signal_vq(kvm, &ndev->vdev, queue->id);
+			virt_queue__used_in_order_flush(vq);
+			if (virtio_queue__should_signal(vq))
+				ndev->vdev.ops->signal_vq(kvm, &ndev->vdev, queue->id);
+		}
 	}
 
 out_err:
@@ -232,6 +376,543 @@ out_err:
 	return NULL;
 }
 
+#ifdef CONFIG_HAS_IO_URING
+/*
+ * The io_uring engine (engine=uring) drives all the data queues of a tap
+ * device from a single thread. Kicks of the driver land on an eventfd,
+ * watched by a multishot poll request. Each receive queue has one read in
+ * flight, straight into the buffers of the guest, so that frames complete
+ * in ring order. A transmit batch is submitted as a chain of linked writes,
+ * which keeps its frames in order on the wire, and is completed once the
+ * whole chain is done. When the guest memory could be registered with the
+ * ring, chains of a single buffer use the fixed buffer requests. A read that
+ * finds the tap device empty is retried once a poll request reports it
+ * readable.
+ */
+#define NET_URING_KICK			0
+#define NET_URING_RX			1
+#define NET_URING_TX			2
+#define NET_URING_RX_POLL		3
+#define NET_URING_DATA(op, vq, i)	((u64)(op) << 32 | (u64)(vq) << 16 | (i))
+
+/* The guest memory is registered in chunks no larger than this */
+#define NET_URING_BUF_MAX		(1ULL << 30)
+
+enum {
+	NET_URING_RX_IDLE,
+	/* A chain was taken off the ring, its read is not submitted yet */
+	NET_URING_RX_READY,
+	NET_URING_RX_BUSY,
+	/* The frame is waiting for more buffers to merge into */
+	NET_URING_RX_MERGE,
+	/* The read found nothing, the tap device must be polled first */
+	NET_URING_RX_EMPTY,
+	NET_URING_RX_POLLING,
+};
+
+struct net_uring_rx {
+	int				state;
+	u16				head;
+	u16				in;
+	u16				num_buffers;
+	int				size;
+	int				len;
+	int				copied;
+	struct virtio_net_hdr_mrg_rxbuf	*hdr;
+	struct iovec			iov[VIRTIO_NET_QUEUE_SIZE + 1];
+	unsigned char			spill[MAX_PACKET_SIZE + sizeof(struct virtio_net_hdr_mrg_rxbuf)];
+};
+
+struct net_uring_tx {
+	int				nr;
+	/* Frames of the batch that have been given a submission entry */
+	int				queued;
+	int				inflight;
+	struct net_tx_frame		frames[VIRTIO_NET_TX_BATCH];
+	struct iovec			iov[VIRTIO_NET_QUEUE_SIZE * 2];
+};
+
+struct net_uring {
+	struct uring			ring;
+	pthread_t			thread;
+	bool				running;
+	bool				stop;
+	int				kick_fd;
+
+	/* Registered guest memory, none when nr_bufs is 0 */
+	struct iovec			*bufs;
+	unsigned int			nr_bufs;
+
+	bool				active[VIRTIO_NET_NUM_QUEUES * 2];
+	bool				signal[VIRTIO_NET_NUM_QUEUES * 2];
+	struct net_uring_rx		*rx;
+	struct net_uring_tx		*tx;
+};
+
+/* Index of the registered buffer that holds iov, or -1 */
+static int virtio_net_uring_buf(struct net_uring *nu, struct iovec *iov)
+{
+	unsigned int i;
+	void *start;
+
+	for (i = 0; i < nu->nr_bufs; i++) {
+		start = nu->bufs[i].iov_base;
+		if (iov->iov_base >= start &&
+		    iov->iov_base + iov->iov_len <= start + nu->bufs[i].iov_len)
+			return i;
+	}
+
+	return -1;
+}
+
+static int virtio_net_uring_add_bank(struct kvm *kvm,
+				     struct kvm_mem_bank *bank, void *data)
+{
+	struct net_uring *nu = data;
+	struct iovec *bufs;
+	u64 off, len;
+
+	for (off = 0; off < bank->size; off += len) {
+		len = min_t(u64, bank->size - off, NET_URING_BUF_MAX);
+		bufs = realloc(nu->bufs, (nu->nr_bufs + 1) * sizeof(*bufs));
+		if (!bufs)
+			return -ENOMEM;
+
+		nu->bufs = bufs;
+		nu->bufs[nu->nr_bufs++] = (struct iovec) {
+			.iov_base	= bank->host_addr + off,
+			.iov_len	= len,
+		};
+	}
+
+	return 0;
+}
+
+/* Registering pins the guest memory, requests still work without it */
+static void virtio_net_uring_register(struct net_dev *ndev)
+{
+	struct net_uring *nu = ndev->uring;
+	int r;
+
+	r = kvm__for_each_mem_bank(ndev->kvm, KVM_MEM_TYPE_RAM,
+				   virtio_net_uring_add_bank, nu);
+	if (!r)
+		r = uring__register_buffers(&nu->ring, nu->bufs, nu->nr_bufs);
+	if (r < 0) {
+		pr_info("virtio-net: guest memory not registered with io_uring (%d)",
+			r);
+		free(nu->bufs);
+		nu->bufs = NULL;
+		nu->nr_bufs = 0;
+	}
+}
+
+/* Copy the rest of the frame from spill into more buffers, true once done */
+static bool virtio_net_uring_rx_merge(struct net_dev *ndev, u32 vq)
+{
+	struct net_uring_rx *rx = &ndev->uring->rx[vq / 2];
+	struct virt_queue *queue = &ndev->queues[vq].vq;
+	u16 out, in, head;
+	int iovsize;
+
+	while (rx->copied < rx->len) {
+		if (!virt_queue__available(queue))
+			return false;
+
+		head = virt_queue__get_iov(queue, rx->iov, &out, &in, ndev->kvm);
+		iovsize = min_t(int, rx->len - rx->copied, iov_size(rx->iov, in));
+		memcpy_toiovec(rx->iov, rx->spill + rx->copied - rx->size, iovsize);
+		rx->copied += iovsize;
+		virt_queue__set_used_elem_no_update(queue, head, iovsize,
+						    rx->num_buffers++);
+	}
+
+	virtio_net_fix_rx_hdr(&rx->hdr->hdr, ndev);
+	if (virtio_net_hdr_has_num_buffers(ndev))
+		rx->hdr->num_buffers = virtio_host_to_guest_u16(queue,
+								rx->num_buffers);
+
+	virt_queue__used_idx_advance(queue, rx->num_buffers);
+	ndev->uring->signal[vq] = true;
+
+	return true;
+}
+
+static void virtio_net_uring_rx_submit(struct net_dev *ndev, u32 vq)
+{
+	struct net_uring *nu = ndev->uring;
+	struct net_uring_rx *rx = &nu->rx[vq / 2];
+	struct virt_queue *queue = &ndev->queues[vq].vq;
+	struct io_uring_sqe *sqe;
+	u16 out;
+	int buf = -1;
+
+	switch (rx->state) {
+	case NET_URING_RX_MERGE:
+		if (!virtio_net_uring_rx_merge(ndev, vq))
+			return;
+		rx->state = NET_URING_RX_IDLE;
+		/* fall through */
+	case NET_URING_RX_IDLE:
+		do {
+			if (!virt_queue__available(queue))
+				return;
+
+			rx->head = virt_queue__get_iov(queue, rx->iov, &out,
+						       &rx->in, ndev->kvm);
+			if (virtio_net_rx_hdr_fits(ndev, queue, rx->head, rx->iov))
+				break;
+			nu->signal[vq] = true;
+		} while (1);
+
+		rx->hdr = rx->iov[0].iov_base;
+		rx->size = iov_size(rx->iov, rx->in);
+		rx->iov[rx->in].iov_base = rx->spill;
+		rx->iov[rx->in].iov_len = sizeof(rx->spill);
+		rx->state = NET_URING_RX_READY;
+		/* fall through */
+	case NET_URING_RX_READY:
+		break;
+	case NET_URING_RX_EMPTY:
+		sqe = uring__get_sqe(&nu->ring);
+		if (!sqe)
+			return;
+
+		sqe->opcode		= IORING_OP_POLL_ADD;
+		sqe->fd			= ndev->tap_fd;
+		sqe->poll32_events	= POLLIN;
+		sqe->user_data		= NET_URING_DATA(NET_URING_RX_POLL, vq, 0);
+		rx->state = NET_URING_RX_POLLING;
+		return;
+	default:
+		return;
+	}
+
+	sqe = uring__get_sqe(&nu->ring);
+	if (!sqe)
+		return;
+
+	/* Without mergeable buffers, whatever does not fit is dropped anyway */
+	if (rx->in == 1 && !has_virtio_feature(ndev, VIRTIO_NET_F_MRG_RXBUF))
+		buf = virtio_net_uring_buf(nu, &rx->iov[0]);
+
+	if (buf >= 0) {
+		sqe->opcode	= IORING_OP_READ_FIXED;
+		sqe->addr	= (unsigned long)rx->iov[0].iov_base;
+		sqe->len	= rx->iov[0].iov_len;
+		sqe->buf_index	= buf;
+	} else {
+		sqe->opcode	= IORING_OP_READV;
+		sqe->addr	= (unsigned long)rx->iov;
+		sqe->len	= rx->in + 1;
+	}
+	sqe->fd		= ndev->tap_fd;
+	sqe->user_data	= NET_URING_DATA(NET_URING_RX, vq, 0);
+
+	rx->state = NET_URING_RX_BUSY;
+}
+
+static void virtio_net_uring_rx_done(struct net_dev *ndev, u32 vq, int res)
+{
+	struct net_uring_rx *rx = &ndev->uring->rx[vq / 2];
+	struct virt_queue *queue = &ndev->queues[vq].vq;
+
+	if (res == -EINTR) {
+		rx->state = NET_URING_RX_READY;
+		return;
+	}
+
+	if (res == -EAGAIN) {
+		rx->state = NET_URING_RX_EMPTY;
+		return;
+	}
+
+	if (res < 0) {
+		pr_warning("%s: rx on vq %u failed (%d), stopping queue",
+			   __func__, vq, res);
+		ndev->uring->active[vq] = false;
+		return;
+	}
+
+	rx->copied = min(res, rx->size);
+	rx->len = has_virtio_feature(ndev, VIRTIO_NET_F_MRG_RXBUF) ?
+		  res : rx->copied;
+	rx->num_buffers = 0;
+	virt_queue__set_used_elem_no_update(queue, rx->head, rx->copied,
+					    rx->num_buffers++);
+
+	if (virtio_net_uring_rx_merge(ndev, vq)) {
+		rx->state = NET_URING_RX_IDLE;
+	} else {
+		virt_queue__ring_full(queue);
+		rx->state = NET_URING_RX_MERGE;
+	}
+}
+
+static void virtio_net_uring_rx_polled(struct net_dev *ndev, u32 vq, int res)
+{
+	struct net_uring_rx *rx = &ndev->uring->rx[vq / 2];
+
+	if (res < 0 && res != -EINTR) {
+		pr_warning("%s: poll on vq %u failed (%d), stopping queue",
+			   __func__, vq, res);
+		ndev->uring->active[vq] = false;
+		return;
+	}
+
+	rx->state = NET_URING_RX_READY;
+}
+
+static void virtio_net_uring_tx_submit(struct net_dev *ndev, u32 vq)
+{
+	struct net_uring *nu = ndev->uring;
+	struct net_uring_tx *tx = &nu->tx[vq / 2];
+	struct net_dev_queue *queue = &ndev->queues[vq];
+	struct io_uring_sqe *sqe, *prev = NULL;
+	struct net_tx_frame *frame;
+	int i, buf;
+
+	if (tx->inflight)
+		return;
+
+	if (tx->queued == tx->nr) {
+		if (!virt_queue__available(&queue->vq))
+			return;
+
+		tx->nr = virtio_net_tx_gather(queue, tx->frames, tx->iov);
+		tx->queued = 0;
+	}
+
+	/*
+	 * When the ring is full, the chain is cut short and the rest of the
+	 * batch is submitted once it completed, which keeps the frames in order.
+	 */
+	for (i = tx->queued; i < tx->nr; i++) {
+		frame = &tx->frames[i];
+		sqe = uring__get_sqe(&nu->ring);
+		if (!sqe) {
+			if (prev)
+				prev->flags &= ~IOSQE_IO_LINK;
+			break;
+		}
+
+		buf = frame->out == 1 ? virtio_net_uring_buf(nu, frame->iov) : -1;
+		if (buf >= 0) {
+			sqe->opcode	= IORING_OP_WRITE_FIXED;
+			sqe->addr	= (unsigned long)frame->iov[0].iov_base;
+			sqe->len	= frame->iov[0].iov_len;
+			sqe->buf_index	= buf;
+		} else {
+			sqe->opcode	= IORING_OP_WRITEV;
+			sqe->addr	= (unsigned long)frame->iov;
+			sqe->len	= frame->out;
+		}
+		sqe->fd		= ndev->tap_fd;
+		sqe->user_data	= NET_URING_DATA(NET_URING_TX, vq, i);
+		if (i < tx->nr - 1)
+			sqe->flags = IOSQE_IO_LINK;
+		prev = sqe;
+	}
+
+	tx->inflight = i - tx->queued;
+	tx->queued = i;
+}
+
+static void virtio_net_uring_tx_done(struct net_dev *ndev, u32 vq, u32 i,
+				     int res)
+{
+	struct net_uring_tx *tx = &ndev->uring->tx[vq / 2];
+	struct virt_queue *queue = &ndev->queues[vq].vq;
+
+	tx->frames[i].len = max(res, 0);
+
+	/* The rest of a chain is cancelled when one of its writes fails */
+	if (res < 0 && res != -ECANCELED) {
+		pr_warning("%s: tx on vq %u failed (%d), stopping queue",
+			   __func__, vq, res);
+		ndev->uring->active[vq] = false;
+	}
+
+	if (--tx->inflight)
+		return;
+
+	if (tx->queued < tx->nr) {
+		if (ndev->uring->active[vq])
+			return;
+
+		/* Frames that were never sent go back with nothing written */
+		for (i = tx->queued; i < (u32)tx->nr; i++)
+			tx->frames[i].len = 0;
+		tx->queued = tx->nr;
+	}
+
+	for (i = 0; i < (u32)tx->nr; i++)
+		virt_queue__set_used_elem_in_order(queue, tx->frames[i].head,
+						   tx->frames[i].len);
+
+	virt_queue__used_in_order_flush(queue);
+	ndev->uring->signal[vq] = true;
+}
+
+static void *virtio_net_uring_thread(void *p)
+{
+	struct net_dev *ndev = p;
+	struct net_uring *nu = ndev->uring;
+	struct io_uring_cqe *cqe;
+	struct io_uring_sqe *sqe;
+	bool polling = false;
+	eventfd_t kicks;
+	u32 vq, flags;
+	u64 data;
+	int r, res;
+
+	kvm__set_thread_name("virtio-net-uring");
+
+	while (!nu->stop) {
+		sqe = polling ? NULL : uring__get_sqe(&nu->ring);
+		if (sqe) {
+			sqe->opcode		= IORING_OP_POLL_ADD;
+			sqe->fd			= nu->kick_fd;
+			sqe->poll32_events	= POLLIN;
+			sqe->len		= IORING_POLL_ADD_MULTI;
+			sqe->user_data		= NET_URING_DATA(NET_URING_KICK, 0, 0);
+			polling = true;
+		}
+
+		for (vq = 0; vq < ndev->queue_pairs * 2; vq++) {
+			if (!nu->active[vq])
+				continue;
+
+			if (vq & 1)
+				virtio_net_uring_tx_submit(ndev, vq);
+			else
+				virtio_net_uring_rx_submit(ndev, vq);
+		}
+
+		/*
+		 * EBUSY means that the completion ring overflowed and EAGAIN
+		 * that the kernel ran short of memory: reap what completed
+		 * and submit again.
+		 */
+		r = uring__submit(&nu->ring, 1);
+		if (r < 0 && r != -EINTR && r != -EBUSY && r != -EAGAIN) {
+			pr_err("%s: io_uring failed (%d), exiting thread",
+			       __func__, r);
+			break;
+		}
+
+		while ((cqe = uring__peek_cqe(&nu->ring))) {
+			data	= cqe->user_data;
+			res	= cqe->res;
+			flags	= cqe->flags;
+			uring__cqe_seen(&nu->ring);
+
+			vq = (data >> 16) & 0xffff;
+			switch (data >> 32) {
+			case NET_URING_KICK:
+				eventfd_read(nu->kick_fd, &kicks);
+				/* Older kernels only have single shot polls */
+				if (!(flags & IORING_CQE_F_MORE))
+					polling = false;
+				break;
+			case NET_URING_RX:
+				virtio_net_uring_rx_done(ndev, vq, res);
+				break;
+			case NET_URING_RX_POLL:
+				virtio_net_uring_rx_polled(ndev, vq, res);
+				break;
+			case NET_URING_TX:
+				virtio_net_uring_tx_done(ndev, vq, data & 0xffff,
+							 res);
+				break;
+			}
+		}
+
+		/* At most one interrupt per queue for all that completed */
+		for (vq = 0; vq < ndev->queue_pairs * 2; vq++) {
+			if (!nu->signal[vq])
+				continue;
+
+			nu->signal[vq] = false;
+			if (virtio_queue__should_signal(&ndev->queues[vq].vq))
+				ndev->vdev.ops->signal_vq(ndev->kvm, &ndev->vdev,
+							  vq);
+		}
+	}
+
+	return NULL;
+}
+
+static void virtio_net_uring_start(struct net_dev *ndev)
+{
+	struct net_uring *nu = ndev->uring;
+	u32 i;
+	int r;
+
+	if (nu->running)
+		return;
+
+	/* The kick poll, a read per receive queue and a batch per transmit */
+	r = uring__init(&nu->ring,
+			1 + ndev->queue_pairs * (1 + VIRTIO_NET_TX_BATCH));
+	if (r < 0)
+		die("virtio-net: io_uring setup failed (%d)", r);
+
+	virtio_net_uring_register(ndev);
+
+	for (i = 0; i < ndev->queue_pairs; i++) {
+		nu->rx[i].state = NET_URING_RX_IDLE;
+		nu->tx[i].nr = 0;
+		nu->tx[i].queued = 0;
+		nu->tx[i].inflight = 0;
+	}
+	memset(nu->signal, 0, sizeof(nu->signal));
+
+	nu->stop = false;
+	if (pthread_create(&nu->thread, NULL, virtio_net_uring_thread, ndev))
+		die_perror("virtio-net: io_uring thread");
+	nu->running = true;
+}
+
+/* Closing the ring cancels whatever is still in flight */
+static void virtio_net_uring_stop(struct net_dev *ndev)
+{
+	struct net_uring *nu = ndev->uring;
+
+	if (!nu->running)
+		return;
+
+	nu->stop = true;
+	eventfd_write(nu->kick_fd, 1);
+	pthread_join(nu->thread, NULL);
+
+	uring__exit(&nu->ring);
+	free(nu->bufs);
+	nu->bufs = NULL;
+	nu->nr_bufs = 0;
+	nu->running = false;
+}
+
+static void virtio_net_uring_init(struct net_dev *ndev)
+{
+	struct net_uring *nu;
+
+	nu = calloc(1, sizeof(*nu));
+	if (nu)
+		nu->rx = calloc(ndev->queue_pairs, sizeof(*nu->rx));
+	if (nu && nu->rx)
+		nu->tx = calloc(ndev->queue_pairs, sizeof(*nu->tx));
+	if (!nu || !nu->tx)
+		die("Failed allocating the io_uring engine");
+
+	nu->kick_fd = eventfd(0, EFD_NONBLOCK);
+	if (nu->kick_fd < 0)
+		die_perror("virtio-net: io_uring kick eventfd");
+
+	ndev->uring = nu;
+}
+#endif
+
 static virtio_net_ctrl_ack virtio_net_handle_mq(struct kvm* kvm, struct net_dev *ndev, struct virtio_net_ctrl_hdr *ctrl)
 {
 	/* Not much to do here */
@@ -341,9 +1022,7 @@ static bool virtio_net__tap_init(struct net_dev *ndev)
 	const struct virtio_net_params *params = ndev->params;
 	bool skipconf = !!params->tapif;
 
-	hdr_len = has_virtio_feature(ndev, VIRTIO_NET_F_MRG_RXBUF) ?
-			sizeof(struct virtio_net_hdr_mrg_rxbuf) :
-			sizeof(struct virtio_net_hdr);
+	hdr_len = virtio_net_hdr_len(ndev);
 	if (ioctl(ndev->tap_fd, TUNSETVNETHDRSZ, &hdr_len) < 0)
 		pr_warning("Config tap device TUNSETVNETHDRSZ error");
 
@@ -493,6 +1172,149 @@ static struct net_dev_operations uip_ops = {
 	.tx	= uip_ops_tx,
 };
 
+#ifdef CONFIG_HAS_AF_XDP
+static inline int xsk_ops_tx(struct iovec *iov, u16 out, struct net_dev *ndev)
+{
+	int len = xsk_tx(iov, out, &ndev->xsk);
+
+	xsk_tx_flush(&ndev->xsk);
+
+	return len;
+}
+
+static inline int xsk_ops_rx(struct iovec *iov, u16 in, struct net_dev *ndev)
+{
+	return xsk_rx(iov, in, &ndev->xsk);
+}
+
+/* The whole batch goes on the tx ring before waking up the kernel once */
+static int xsk_ops_tx_batch(struct net_tx_frame *frames, int nr,
+			    struct net_dev *ndev)
+{
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		frames[i].len = xsk_tx(frames[i].iov, frames[i].out, &ndev->xsk);
+		if (frames[i].len < 0)
+			return frames[i].len;
+	}
+
+	xsk_tx_flush(&ndev->xsk);
+
+	return 0;
+}
+
+static struct net_dev_operations xsk_ops = {
+	.rx		= xsk_ops_rx,
+	.tx		= xsk_ops_tx,
+	.tx_batch	= xsk_ops_tx_batch,
+};
+#endif
+
+/*
+ * Run fn from the ioeventfd thread whenever fd is signalled. The event is
+ * only polled, it has no guest address to register with KVM.
+ */
+static void virtio_net__vhost_user_poll(struct net_dev *ndev,
+					struct net_dev_queue *queue, int fd,
+					void (*fn)(struct kvm *kvm, void *ptr))
+{
+	struct ioevent *ioev;
+
+	if (fd < 0)
+		die_perror("vhost-user: failed creating an eventfd");
+
+	ioev = malloc(sizeof(*ioev));
+	if (ioev == NULL)
+		die("vhost-user: out of memory");
+
+	*ioev = (struct ioevent) {
+		.fn		= fn,
+		.fn_kvm		= ndev->kvm,
+		.fn_ptr		= queue,
+		.fd		= fd,
+		.flags		= IOEVENTFD_FLAG_USER_POLL,
+	};
+
+	ioeventfd__add_epoll_event(ioev, fd);
+	queue->poll_ev = ioev;
+	queue->poll_fd = fd;
+}
+
+static void virtio_net__vhost_user_unpoll(struct net_dev_queue *queue)
+{
+	if (!queue->poll_ev)
+		return;
+
+	ioeventfd__del_epoll_event(queue->poll_ev);
+	queue->poll_ev = NULL;
+	queue->poll_fd = 0;
+}
+
+/* Used by the backend until the queue has an irqfd, e.g. with virtio-mmio */
+static void virtio_net__vhost_user_call(struct kvm *kvm, void *param)
+{
+	struct net_dev_queue *queue = param;
+	struct net_dev *ndev = queue->ndev;
+
+	ndev->vdev.ops->signal_vq(kvm, &ndev->vdev, queue->id);
+}
+
+/* The ctrl queue stays in kvmtool, but its kick isn't polled for vhost */
+static void virtio_net__vhost_user_ctrl_kick(struct kvm *kvm, void *param)
+{
+	struct net_dev_queue *queue = param;
+
+	virtio_net_handle_callback(kvm, queue->ndev, queue->id);
+}
+
+/*
+ * Hand the data queues to the backend, now that the driver has set them all
+ * up and the features are final.
+ */
+static void virtio_net__vhost_user_start(struct net_dev *ndev)
+{
+	struct vhost_user *vu = &ndev->vu;
+	struct net_dev_queue *queue;
+	u32 i;
+
+	if (vhost_user__set_features(vu, ndev->features & vu->features) < 0)
+		die("vhost-user: failed setting the features");
+
+	if (vhost_user__set_mem_table(vu, ndev->kvm) < 0)
+		die("vhost-user: failed sharing the guest memory");
+
+	for (i = 0; i < ndev->queue_pairs * 2; i++) {
+		queue = &ndev->queues[i];
+		if (!queue->ready)
+			continue;
+
+		if (!queue->kick_fd)
+			die("vhost-user: queue %u has no ioeventfd", i);
+
+		if (!queue->irqfd)
+			virtio_net__vhost_user_poll(ndev, queue, eventfd(0, 0),
+						    virtio_net__vhost_user_call);
+
+		if (vhost_user__start_vring(vu, i, &queue->vq, queue->kick_fd,
+					    queue->irqfd ?: queue->poll_fd) < 0)
+			die("vhost-user: failed starting queue %u", i);
+
+		queue->started = true;
+	}
+}
+
+static void virtio_net__vhost_user_stop_queue(struct net_dev *ndev,
+					      struct net_dev_queue *queue)
+{
+	if (queue->started &&
+	    vhost_user__stop_vring(&ndev->vu, queue->id) < 0)
+		pr_warning("vhost-user: failed stopping queue %d", queue->id);
+
+	virtio_net__vhost_user_unpoll(queue);
+	queue->started = queue->ready = false;
+}
+
 static u8 *get_config(struct kvm *kvm, void *dev)
 {
 	struct net_dev *ndev = dev;
@@ -500,9 +1322,9 @@ static u8 *get_config(struct kvm *kvm, void *dev)
 	return ((u8 *)(&ndev->config));
 }
 
-static u32 get_host_features(struct kvm *kvm, void *dev)
+static u64 get_host_features(struct kvm *kvm, void *dev)
 {
-	u32 features;
+	u64 features;
 	struct net_dev *ndev = dev;
 
 	features = 1UL << VIRTIO_NET_F_MAC
@@ -527,6 +1349,25 @@ static u32 get_host_features(struct kvm *kvm, void *dev)
 		features |= (1UL << VIRTIO_NET_F_HOST_UFO
 				| 1UL << VIRTIO_NET_F_GUEST_UFO);
 
+	/* Frames go through single UMEM frames, which are not segmented */
+	if (ndev->mode == NET_MODE_XDP)
+		features &= ~(1UL << VIRTIO_NET_F_CSUM
+			      | 1UL << VIRTIO_NET_F_HOST_TSO4
+			      | 1UL << VIRTIO_NET_F_HOST_TSO6
+			      | 1UL << VIRTIO_NET_F_GUEST_TSO4
+			      | 1UL << VIRTIO_NET_F_GUEST_TSO6);
+
+	/* Every queue is processed in order, but vhost has no such promise */
+	if (!ndev->vhost_fd)
+		features |= 1ULL << VIRTIO_F_IN_ORDER;
+
+	/* The backend processes the data queues, and kvmtool the rest */
+	if (ndev->mode == NET_MODE_VHOST_USER)
+		features &= ndev->vu.features
+			    | 1UL << VIRTIO_NET_F_MAC
+			    | 1UL << VIRTIO_NET_F_CTRL_VQ
+			    | 1UL << VIRTIO_NET_F_MQ;
+
 	return features;
 }
 
@@ -547,10 +1388,13 @@ static int virtio_net__vhost_set_features(struct net_dev *ndev)
 			has_virtio_feature(ndev, VIRTIO_NET_F_MRG_RXBUF))
 		features |= 1UL << VIRTIO_NET_F_MRG_RXBUF;
 
+	if (has_virtio_feature(ndev, VIRTIO_F_VERSION_1))
+		features |= 1ULL << VIRTIO_F_VERSION_1;
+
 	return ioctl(ndev->vhost_fd, VHOST_SET_FEATURES, &features);
 }
 
-static void set_guest_features(struct kvm *kvm, void *dev, u32 features)
+static void set_guest_features(struct kvm *kvm, void *dev, u64 features)
 {
 	struct net_dev *ndev = dev;
 	struct virtio_net_config *conf = &ndev->config;
@@ -561,7 +1405,7 @@ static void set_guest_features(struct kvm *kvm, void *dev, u32 features)
 	conf->max_virtqueue_pairs = virtio_host_to_guest_u16(&ndev->vdev,
 							     conf->max_virtqueue_pairs);
 
-	if (ndev->tap_fd >= 0) {
+	if (ndev->mode == NET_MODE_TAP && ndev->tap_fd >= 0) {
 		int offload = 0;
 		if (has_virtio_feature(ndev, VIRTIO_NET_F_GUEST_CSUM))
 			offload |= TUN_F_TSO6;
@@ -590,10 +1434,18 @@ static void virtio_net_start(struct net_dev *ndev)
 		if (ndev->vhost_fd &&
 				virtio_net__vhost_set_features(ndev) != 0)
 			die_perror("VHOST_SET_FEATURES failed");
+#ifdef CONFIG_HAS_IO_URING
+		if (ndev->uring)
+			virtio_net_uring_start(ndev);
+#endif
+#ifdef CONFIG_HAS_AF_XDP
+	} else if (ndev->mode == NET_MODE_XDP) {
+		ndev->xsk.vnet_hdr_len = virtio_net_hdr_len(ndev);
+#endif
+	} else if (ndev->mode == NET_MODE_VHOST_USER) {
+		virtio_net__vhost_user_start(ndev);
 	} else {
-		ndev->info.vnet_hdr_len = has_virtio_feature(ndev, VIRTIO_NET_F_MRG_RXBUF) ?
-						sizeof(struct virtio_net_hdr_mrg_rxbuf) :
-						sizeof(struct virtio_net_hdr);
+		ndev->info.vnet_hdr_len = virtio_net_hdr_len(ndev);
 		uip_init(&ndev->info);
 	}
 }
@@ -601,9 +1453,13 @@ static void virtio_net_start(struct net_dev *ndev)
 static void virtio_net_stop(struct net_dev *ndev)
 {
 	/* Undo whatever start() did */
+#ifdef CONFIG_HAS_IO_URING
+	if (ndev->uring)
+		virtio_net_uring_stop(ndev);
+#endif
 	if (ndev->mode == NET_MODE_TAP)
 		virtio_net__tap_exit(ndev);
-	else
+	else if (ndev->mode == NET_MODE_USER)
 		uip_exit(&ndev->info);
 }
 
@@ -628,15 +1484,13 @@ static void virtio_vproxy__ioevent_callback(struct kvm *kvm, void *param)
 }
 #endif
 
-static int init_vq(struct kvm *kvm, void *dev, u32 vq, u32 page_size, u32 align,
-		   u32 pfn)
+static int init_vq(struct kvm *kvm, void *dev, u32 vq)
 {
 	struct vhost_vring_state state = { .index = vq };
 	struct net_dev_queue *net_queue;
 	struct vhost_vring_addr addr;
 	struct net_dev *ndev = dev;
 	struct virt_queue *queue;
-	void *p;
 	int r;
 
 	compat__remove_message(compat_id);
@@ -645,16 +1499,12 @@ static int init_vq(struct kvm *kvm, void *dev, u32 vq, u32 page_size, u32 align,
 	net_queue->id	= vq;
 	net_queue->ndev	= ndev;
 	queue		= &net_queue->vq;
-	queue->pfn	= pfn;
-	p		= virtio_get_vq(kvm, queue->pfn, page_size);
-
 
 #ifdef RSLD
-	vring_init(&queue->vring, queue->num, p, align);
+	virtio_init_device_vq(kvm, &ndev->vdev, queue, queue->num);
 #else
-	vring_init(&queue->vring, VIRTIO_NET_QUEUE_SIZE, p, align);
+	virtio_init_device_vq(kvm, &ndev->vdev, queue, VIRTIO_NET_QUEUE_SIZE);
 #endif
-	virtio_init_device_vq(&ndev->vdev, queue);
 
 	mutex_init(&net_queue->lock);
 	pthread_cond_init(&net_queue->cond, NULL);
@@ -663,7 +1513,21 @@ static int init_vq(struct kvm *kvm, void *dev, u32 vq, u32 page_size, u32 align,
 			       net_queue);
 
 		return 0;
+	} else if (ndev->mode == NET_MODE_VHOST_USER) {
+		if (queue->endian != VIRTIO_ENDIAN_HOST)
+			die("vhost-user requires the same endianness in guest and host");
+
+		/* The backend takes the ring over when the device starts */
+		net_queue->ready = true;
+		return 0;
 	} else if (ndev->vhost_fd == 0 ) {
+#ifdef CONFIG_HAS_IO_URING
+		/* The engine starts along with the device */
+		if (ndev->uring) {
+			ndev->uring->active[vq] = true;
+			return 0;
+		}
+#endif
 		if (vq & 1)
 			pthread_create(&net_queue->thread, NULL,
 				       virtio_net_tx_thread, net_queue);
@@ -775,6 +1639,12 @@ static void exit_vq(struct kvm *kvm, void *dev, u32 vq)
 	struct net_dev *ndev = dev;
 	struct net_dev_queue *queue = &ndev->queues[vq];
 
+	/* The backend lets go of the ring before its irqfd goes away */
+	if (ndev->mode == NET_MODE_VHOST_USER) {
+		virtio_net__vhost_user_stop_queue(ndev, queue);
+		queue->kick_fd = 0;
+	}
+
 	if (!is_ctrl_vq(ndev, vq) && queue->gsi) {
 		irq__del_irqfd(kvm, queue->gsi, queue->irqfd);
 		close(queue->irqfd);
@@ -791,6 +1661,18 @@ static void exit_vq(struct kvm *kvm, void *dev, u32 vq)
 		return;
 	}
 
+	if (ndev->mode == NET_MODE_VHOST_USER && !is_ctrl_vq(ndev, vq))
+		return;
+
+#ifdef CONFIG_HAS_IO_URING
+	/* The engine comes back when the device restarts */
+	if (ndev->uring && !is_ctrl_vq(ndev, vq)) {
+		virtio_net_uring_stop(ndev);
+		ndev->uring->active[vq] = false;
+		return;
+	}
+#endif
+
 	/*
 	 * Threads are waiting on cancellation points (readv or
 	 * pthread_cond_wait) and should stop gracefully.
@@ -806,6 +1688,28 @@ static void notify_vq_gsi(struct kvm *kvm, void *dev, u32 vq, u32 gsi)
 	struct vhost_vring_file file;
 	int r;
 
+	if (ndev->mode == NET_MODE_VHOST_USER && !is_ctrl_vq(ndev, vq)) {
+		r = eventfd(0, 0);
+		if (r < 0)
+			die_perror("vhost-user: failed creating an eventfd");
+		if (irq__add_irqfd(kvm, gsi, r, -1) < 0)
+			die_perror("KVM_IRQFD failed");
+
+		/* A running backend switches over before the old irqfd goes */
+		if (queue->started &&
+		    vhost_user__set_vring_call(&ndev->vu, vq, r) < 0)
+			die("vhost-user: failed setting the call fd of queue %u", vq);
+
+		if (queue->gsi) {
+			irq__del_irqfd(kvm, queue->gsi, queue->irqfd);
+			close(queue->irqfd);
+		}
+
+		queue->irqfd = r;
+		queue->gsi = gsi;
+		return;
+	}
+
 	if (ndev->vhost_fd == 0)
 		return;
 
@@ -840,6 +1744,21 @@ static void notify_vq_eventfd(struct kvm *kvm, void *dev, u32 vq, u32 efd)
 	};
 	int r;
 
+	if (ndev->mode == NET_MODE_VHOST_USER) {
+		struct net_dev_queue *queue = &ndev->queues[vq];
+
+		if (!is_ctrl_vq(ndev, vq)) {
+			queue->kick_fd = efd;
+			return;
+		}
+
+		/* The transport closes efd, and may not poll it */
+		virtio_net__vhost_user_unpoll(queue);
+		virtio_net__vhost_user_poll(ndev, queue, dup(efd),
+					    virtio_net__vhost_user_ctrl_kick);
+		return;
+	}
+
 	if (ndev->vhost_fd == 0 || is_ctrl_vq(ndev, vq))
 		return;
 #ifdef RSLD
@@ -873,6 +1792,20 @@ static int notify_vq(struct kvm *kvm, void *dev, u32 vq)
     }
 #endif
 
+#ifdef CONFIG_HAS_IO_URING
+	if (ndev->uring && !is_ctrl_vq(ndev, vq)) {
+		eventfd_write(ndev->uring->kick_fd, 1);
+		return 0;
+	}
+#endif
+
+	/* Forward a kick that didn't go through the ioeventfd */
+	if (ndev->mode == NET_MODE_VHOST_USER && !is_ctrl_vq(ndev, vq)) {
+		if (ndev->queues[vq].kick_fd)
+			eventfd_write(ndev->queues[vq].kick_fd, 1);
+		return 0;
+	}
+
 	virtio_net_handle_callback(kvm, ndev, vq);
 
 	return 0;
@@ -976,8 +1909,6 @@ static void virtio_net__vhost_init(struct kvm *kvm, struct net_dev *ndev)
 	if (r != 0)
 		die_perror("VHOST_SET_MEM_TABLE failed");
 
-	ndev->vdev.use_vhost = true;
-
 	free(mem);
 }
 
@@ -1001,11 +1932,20 @@ static int set_net_param(struct kvm *kvm, struct virtio_net_params *p,
 			p->mode = NET_MODE_USER;
 		} else if (!strncmp(val, "tap", 3)) {
 			p->mode = NET_MODE_TAP;
+		} else if (!strncmp(val, "xdp", 3)) {
+#ifndef CONFIG_HAS_AF_XDP
+			die("AF_XDP is not supported by this build");
+#endif
+			p->mode = NET_MODE_XDP;
+		} else if (!strncmp(val, "vhost-user", 10)) {
+			/* The backend maps the guest memory from its fds */
+			kvm->cfg.mem_shared = true;
+			p->mode = NET_MODE_VHOST_USER;
 		} else if (!strncmp(val, "none", 4)) {
 			kvm->cfg.no_net = 1;
 			return -1;
 		} else
-			die("Unknown network mode %s, please use user, tap or none", kvm->cfg.network);
+			die("Unknown network mode %s, please use user, tap, xdp, vhost-user or none", kvm->cfg.network);
 	} else if (strcmp(param, "script") == 0) {
 		p->script = strdup(val);
 	} else if (strcmp(param, "downscript") == 0) {
@@ -1018,12 +1958,27 @@ static int set_net_param(struct kvm *kvm, struct virtio_net_params *p,
 		p->trans = strdup(val);
 	} else if (strcmp(param, "tapif") == 0) {
 		p->tapif = strdup(val);
+	} else if (strcmp(param, "xdpif") == 0) {
+		p->xdpif = strdup(val);
+	} else if (strcmp(param, "socket") == 0) {
+		p->socket = strdup(val);
+	} else if (strcmp(param, "xdp_queue") == 0) {
+		p->xdp_queue = atoi(val);
+	} else if (strcmp(param, "busy_poll") == 0) {
+		p->busy_poll = atoi(val);
 	} else if (strcmp(param, "vhost") == 0) {
 		p->vhost = atoi(val);
 	} else if (strcmp(param, "fd") == 0) {
 		p->fd = atoi(val);
 	} else if (strcmp(param, "mq") == 0) {
 		p->mq = atoi(val);
+	} else if (strcmp(param, "engine") == 0) {
+		if (!strcmp(val, "thread"))
+			p->engine = NET_ENGINE_THREAD;
+		else if (!strcmp(val, "uring"))
+			p->engine = NET_ENGINE_URING;
+		else
+			die("Unknown network engine %s, please use thread or uring", val);
 	}
 #ifdef RSLD
 	else if (strcmp(param, "vproxy") == 0) {
@@ -1123,6 +2078,46 @@ static int virtio_net__init_one(struct virtio_net_params *params)
 		ndev->ops = &tap_ops;
 		if (!virtio_net__tap_create(ndev))
 			die_perror("You have requested a TAP device, but creation of one has failed because");
+#ifdef CONFIG_HAS_AF_XDP
+	} else if (ndev->mode == NET_MODE_XDP) {
+		if (!params->xdpif)
+			die("AF_XDP needs a host interface, please use xdpif");
+		if (params->vhost)
+			die("AF_XDP cannot be used with vhost");
+
+		/* A single socket is bound, to a single queue */
+		if (ndev->queue_pairs > 1) {
+			pr_warning("virtio-net: AF_XDP supports a single queue pair");
+			ndev->queue_pairs = 1;
+			ndev->config.max_virtqueue_pairs = 0;
+		}
+
+		ndev->ops = &xsk_ops;
+		r = xsk_init(&ndev->xsk, params->xdpif, params->xdp_queue,
+			     params->busy_poll);
+		if (r < 0)
+			die("Failed binding AF_XDP to %s queue %d: %s", params->xdpif,
+			    params->xdp_queue, strerror(-r));
+#endif
+	} else if (ndev->mode == NET_MODE_VHOST_USER) {
+		if (!params->socket)
+			die("vhost-user needs the socket of a backend, please use socket");
+		if (params->vhost)
+			die("vhost-user cannot be used with vhost");
+
+		r = vhost_user__init(&ndev->vu, params->socket);
+		if (r < 0)
+			die("Failed connecting to the vhost-user backend at %s: %s",
+			    params->socket, strerror(-r));
+
+		/* Queue pairs beyond those of the backend aren't offered */
+		if (ndev->queue_pairs > ndev->vu.queue_num) {
+			ndev->queue_pairs = max(1U, ndev->vu.queue_num);
+			if (ndev->queue_pairs == 1)
+				ndev->config.max_virtqueue_pairs = 0;
+			else
+				ndev->config.max_virtqueue_pairs = ndev->queue_pairs;
+		}
 	} else {
 		ndev->info.host_ip		= ntohl(inet_addr(params->host_ip));
 		ndev->info.guest_ip		= ntohl(inet_addr(params->guest_ip));
@@ -1132,6 +2127,16 @@ static int virtio_net__init_one(struct virtio_net_params *params)
 		uip_static_init(&ndev->info);
 	}
 
+	if (params->engine == NET_ENGINE_URING) {
+		if (ndev->mode != NET_MODE_TAP || params->vhost)
+			die("The uring network engine needs a tap device without vhost");
+#ifdef CONFIG_HAS_IO_URING
+		virtio_net_uring_init(ndev);
+#else
+		die("The uring network engine is not supported by this build");
+#endif
+	}
+
 	*ops = net_dev_virtio_ops;
 
 	if (params->trans) {
@@ -1148,6 +2153,14 @@ static int virtio_net__init_one(struct virtio_net_params *params)
 	ndev->config_size = sizeof(struct virtio_net_config);
     ndev->mem_size = 0x80000;
 #endif
+	/*
+	 * The transport publishes the features from virtio_init() on, and they
+	 * depend on who owns the rings. Vhost-user owns the data queues, whose
+	 * kicks aren't polled.
+	 */
+	ndev->vdev.use_vhost = params->vhost ||
+			       ndev->mode == NET_MODE_VHOST_USER;
+
 	r = virtio_init(params->kvm, ndev, &ndev->vdev, ops, trans,
 			PCI_DEVICE_ID_VIRTIO_NET, VIRTIO_ID_NET, PCI_CLASS_NET);
 	if (r < 0) {
@@ -1216,6 +2229,20 @@ int virtio_net__exit(struct kvm *kvm)
 			virtio_net_exec_script(params->downscript, ndev->tap_name);
 
 		list_del(&ndev->list);
+#ifdef CONFIG_HAS_AF_XDP
+		if (ndev->mode == NET_MODE_XDP)
+			xsk_exit(&ndev->xsk);
+#endif
+		if (ndev->mode == NET_MODE_VHOST_USER)
+			vhost_user__exit(&ndev->vu);
+#ifdef CONFIG_HAS_IO_URING
+		if (ndev->uring) {
+			close(ndev->uring->kick_fd);
+			free(ndev->uring->rx);
+			free(ndev->uring->tx);
+			free(ndev->uring);
+		}
+#endif
 		free(ndev);
 	}
 	return 0;
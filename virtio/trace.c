@@ -0,0 +1,288 @@
+/*
+ * Latency tracing of the virtqueues (--virtio-trace).
+ *
+ * The points of virtio_trace_point are stamped as a request goes through a
+ * queue. Each stamp lands in a ring of the thread that took it, and the time
+ * since the previous point of the same queue is added to a log2 histogram
+ * of that queue. Nothing is locked on the way: a queue point is only stamped
+ * by one side of the queue, and a ring only by its thread. KVM_IPC_VIRTIO_TRACE
+ * dumps the histograms and the rings, whose latest entries may be torn.
+ */
+#include <sys/syscall.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/list.h>
+
+#include "kvm/barrier.h"
+#include "kvm/kvm.h"
+#include "kvm/kvm-ipc.h"
+#include "kvm/mutex.h"
+#include "kvm/read-write.h"
+#include "kvm/util.h"
+#include "kvm/util-init.h"
+#include "kvm/virtio.h"
+
+/* Events kept by each thread, a power of two */
+#define VIRTIO_TRACE_RING_SIZE	256
+
+struct virtio_trace_vq {
+	u64	last[VIRTIO_TRACE_NR];
+	u64	buckets[VIRTIO_TRACE_NR][VIRTIO_TRACE_BUCKETS];
+};
+
+struct virtio_trace_ring {
+	struct list_head	list;
+	pid_t			tid;
+	u32			head;
+	struct {
+		u64			ts;
+		struct virt_queue	*vq;
+		u16			point;
+	} ev[VIRTIO_TRACE_RING_SIZE];
+};
+
+static bool virtio_trace_enabled;
+static LIST_HEAD(virtio_trace_rings);
+static DEFINE_MUTEX(virtio_trace_rings_lock);
+
+static __thread struct virtio_trace_ring *virtio_trace_ring;
+/* When this thread last received a kick, the time of the kicks it hands on */
+static __thread u64 virtio_trace_wake_ts;
+
+static u64 virtio_trace__now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static struct virtio_trace_ring *virtio_trace__thread_ring(void)
+{
+	struct virtio_trace_ring *ring = virtio_trace_ring;
+
+	if (ring)
+		return ring;
+
+	/* Threads live as long as the guest, their ring as well */
+	ring = calloc(1, sizeof(*ring));
+	if (!ring)
+		return NULL;
+
+	ring->tid = syscall(SYS_gettid);
+	mutex_lock(&virtio_trace_rings_lock);
+	list_add_tail(&ring->list, &virtio_trace_rings);
+	mutex_unlock(&virtio_trace_rings_lock);
+
+	return virtio_trace_ring = ring;
+}
+
+static void virtio_trace__account(struct virtio_trace_vq *t,
+				  enum virtio_trace_point point, u64 from,
+				  u64 to)
+{
+	u64 delta = to - from;
+	int bucket = 0;
+
+	if (!from || from > to)
+		return;
+
+	if (delta)
+		bucket = min(64 - __builtin_clzll(delta),
+			     VIRTIO_TRACE_BUCKETS - 1);
+	t->buckets[point][bucket]++;
+}
+
+static void virtio_trace__log(struct virt_queue *vq,
+			      enum virtio_trace_point point, u64 ts)
+{
+	struct virtio_trace_ring *ring;
+	u32 slot;
+
+	ring = virtio_trace__thread_ring();
+	if (!ring)
+		return;
+
+	slot = ring->head & (VIRTIO_TRACE_RING_SIZE - 1);
+	ring->ev[slot].ts = ts;
+	ring->ev[slot].vq = vq;
+	ring->ev[slot].point = point;
+	wmb();
+	ring->head++;
+}
+
+void __virtio_trace(struct virt_queue *vq, enum virtio_trace_point point)
+{
+	struct virtio_trace_vq *t = vq->trace;
+	u64 now, *last = t->last;
+
+	now = virtio_trace__now();
+
+	switch (point) {
+	case VIRTIO_TRACE_KICK:
+		break;
+	case VIRTIO_TRACE_NOTIFY:
+		/*
+		 * The kick was received before the queue it was for was known:
+		 * it dates from the wakeup of this thread, or from now when
+		 * the kick trapped into it.
+		 */
+		last[VIRTIO_TRACE_KICK] = virtio_trace_wake_ts ?: now;
+		virtio_trace__log(vq, VIRTIO_TRACE_KICK, last[VIRTIO_TRACE_KICK]);
+		virtio_trace__account(t, point, last[VIRTIO_TRACE_KICK], now);
+		break;
+	case VIRTIO_TRACE_POP:
+		/* Only the first buffer after a kick waited for the backend */
+		if (last[VIRTIO_TRACE_NOTIFY] > last[VIRTIO_TRACE_POP])
+			virtio_trace__account(t, point,
+					      last[VIRTIO_TRACE_NOTIFY], now);
+		break;
+	case VIRTIO_TRACE_SIGNAL:
+		if (last[VIRTIO_TRACE_KICK] > last[VIRTIO_TRACE_SIGNAL])
+			virtio_trace__account(t, VIRTIO_TRACE_KICK,
+					      last[VIRTIO_TRACE_KICK], now);
+		if (last[VIRTIO_TRACE_USED] > last[VIRTIO_TRACE_SIGNAL])
+			virtio_trace__account(t, point,
+					      last[VIRTIO_TRACE_USED], now);
+		break;
+	default:
+		virtio_trace__account(t, point, last[point - 1], now);
+		break;
+	}
+	last[point] = now;
+
+	virtio_trace__log(vq, point, now);
+}
+
+/*
+ * Called by the threads that receive kicks, when they do: the ioeventfd
+ * loop, the PMM doorbell and poller, and the PMM workers.
+ */
+void virtio_trace__wakeup(void)
+{
+	if (virtio_trace_enabled)
+		virtio_trace_wake_ts = virtio_trace__now();
+}
+
+void virtio_trace__init_vq(struct virt_queue *vq)
+{
+	vq->trace = calloc(1, sizeof(*vq->trace));
+	if (!vq->trace)
+		pr_warning("virtio: not enough memory to trace a queue");
+}
+
+/* The queue starts over, its histograms carry on */
+void virtio_trace__reset(struct virt_queue *vq)
+{
+	if (vq->trace)
+		memset(vq->trace->last, 0, sizeof(vq->trace->last));
+}
+
+struct virtio_trace_dump {
+	struct virtio_trace_hist	*hists;
+	u32				nr_hists;
+	struct virtio_trace_event	*events;
+	u32				nr_events;
+	struct virtio_trace_ring	*ring;
+	u32				from, to;
+};
+
+static void virtio_trace__add_hist(struct virtio_device *vdev, u32 dev,
+				   u32 queue, struct virt_queue *vq, void *arg)
+{
+	struct virtio_trace_dump *d = arg;
+	struct virtio_trace_hist *h;
+
+	if (!vq->trace)
+		return;
+
+	h = realloc(d->hists, (d->nr_hists + 1) * sizeof(*h));
+	if (!h)
+		return;
+	d->hists = h;
+
+	h = &d->hists[d->nr_hists++];
+	*h = (struct virtio_trace_hist) {
+		.type	= vdev->type,
+		.dev	= dev,
+		.queue	= queue,
+	};
+	memcpy(h->buckets, vq->trace->buckets, sizeof(h->buckets));
+}
+
+/* Name the queue of each ring entry being dumped */
+static void virtio_trace__name_events(struct virtio_device *vdev, u32 dev,
+				      u32 queue, struct virt_queue *vq,
+				      void *arg)
+{
+	struct virtio_trace_dump *d = arg;
+	struct virtio_trace_ring *ring = d->ring;
+	u32 i, slot;
+
+	for (i = d->from; i != d->to; i++) {
+		slot = i & (VIRTIO_TRACE_RING_SIZE - 1);
+		if (ring->ev[slot].vq != vq)
+			continue;
+
+		d->events[d->nr_events++] = (struct virtio_trace_event) {
+			.ts	= ring->ev[slot].ts,
+			.tid	= ring->tid,
+			.type	= vdev->type,
+			.dev	= dev,
+			.queue	= queue,
+			.point	= ring->ev[slot].point,
+		};
+	}
+}
+
+static void virtio_trace__dump(struct kvm *kvm, int fd, u32 type, u32 len,
+			       u8 *msg)
+{
+	struct virtio_trace_dump d = {};
+	struct virtio_trace_ring *ring;
+	u32 nr_rings = 0;
+
+	if (WARN_ON(type != KVM_IPC_VIRTIO_TRACE || len))
+		return;
+
+	virtio_for_each_vq(kvm, virtio_trace__add_hist, &d);
+
+	mutex_lock(&virtio_trace_rings_lock);
+	list_for_each_entry(ring, &virtio_trace_rings, list)
+		nr_rings++;
+
+	d.events = calloc(nr_rings * VIRTIO_TRACE_RING_SIZE, sizeof(*d.events));
+	if (d.events) {
+		list_for_each_entry(ring, &virtio_trace_rings, list) {
+			d.ring = ring;
+			d.to = ring->head;
+			rmb();
+			d.from = d.to > VIRTIO_TRACE_RING_SIZE ?
+				 d.to - VIRTIO_TRACE_RING_SIZE : 0;
+			virtio_for_each_vq(kvm, virtio_trace__name_events, &d);
+		}
+	}
+	mutex_unlock(&virtio_trace_rings_lock);
+
+	if (write_in_full(fd, &d.nr_hists, sizeof(d.nr_hists)) < 0 ||
+	    write_in_full(fd, d.hists, d.nr_hists * sizeof(*d.hists)) < 0 ||
+	    write_in_full(fd, &d.nr_events, sizeof(d.nr_events)) < 0 ||
+	    write_in_full(fd, d.events, d.nr_events * sizeof(*d.events)) < 0)
+		pr_warning("Failed sending virtio trace");
+
+	free(d.hists);
+	free(d.events);
+}
+
+static int virtio_trace__init(struct kvm *kvm)
+{
+	virtio_trace_enabled = kvm->cfg.virtio_trace;
+
+	return kvm_ipc__register_handler(KVM_IPC_VIRTIO_TRACE,
+					 virtio_trace__dump);
+}
+dev_base_init(virtio_trace__init);
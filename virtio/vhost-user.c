@@ -0,0 +1,333 @@
+/*
+ * vhost-user frontend: hands the rings of a device to a backend process
+ * listening on a UNIX socket, such as a userspace switch. The messages and
+ * their order follow the vhost-user specification of QEMU. Only the split
+ * ring layout and the requests needed by virtio-net are supported.
+ */
+#include "kvm/vhost-user.h"
+
+#include "kvm/kvm.h"
+#include "kvm/read-write.h"
+#include "kvm/strbuf.h"
+#include "kvm/util.h"
+#include "kvm/virtio.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static int vhost_user__send(struct vhost_user *vu, struct vhost_user_msg *msg,
+			    int *fds, int nr_fds)
+{
+	char cbuf[CMSG_SPACE(sizeof(int) * VHOST_USER_MAX_REGIONS)];
+	struct iovec iov = {
+		.iov_base	= msg,
+		.iov_len	= VHOST_USER_HDR_SIZE + msg->size,
+	};
+	struct msghdr mh = {
+		.msg_iov	= &iov,
+		.msg_iovlen	= 1,
+	};
+	struct cmsghdr *cmsg;
+	ssize_t r;
+
+	msg->flags = VHOST_USER_VERSION;
+
+	if (nr_fds) {
+		memset(cbuf, 0, sizeof(cbuf));
+		mh.msg_control = cbuf;
+		mh.msg_controllen = CMSG_SPACE(sizeof(int) * nr_fds);
+		cmsg = CMSG_FIRSTHDR(&mh);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nr_fds);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nr_fds);
+	}
+
+	do {
+		r = sendmsg(vu->sock, &mh, MSG_NOSIGNAL);
+	} while (r < 0 && errno == EINTR);
+
+	if (r < 0)
+		return -errno;
+
+	return r == (ssize_t)iov.iov_len ? 0 : -EIO;
+}
+
+static int vhost_user__recv(struct vhost_user *vu, u32 request,
+			    struct vhost_user_msg *msg, u32 size)
+{
+	if (read_in_full(vu->sock, msg, VHOST_USER_HDR_SIZE) !=
+	    (ssize_t)VHOST_USER_HDR_SIZE)
+		return -EIO;
+
+	if (msg->request != request || !(msg->flags & VHOST_USER_FLAG_REPLY) ||
+	    msg->size != size)
+		return -EPROTO;
+
+	if (read_in_full(vu->sock, &msg->payload, size) != (ssize_t)size)
+		return -EIO;
+
+	return 0;
+}
+
+/* Send msg, and read the reply into it when reply_size is not negative */
+static int vhost_user__request(struct vhost_user *vu,
+			       struct vhost_user_msg *msg, int *fds,
+			       int nr_fds, int reply_size)
+{
+	u32 request = msg->request;
+	int r;
+
+	mutex_lock(&vu->mutex);
+	r = vhost_user__send(vu, msg, fds, nr_fds);
+	if (!r && reply_size >= 0)
+		r = vhost_user__recv(vu, request, msg, reply_size);
+	mutex_unlock(&vu->mutex);
+
+	return r;
+}
+
+static int vhost_user__get_u64(struct vhost_user *vu, u32 request, u64 *val)
+{
+	struct vhost_user_msg msg = {
+		.request	= request,
+	};
+	int r;
+
+	r = vhost_user__request(vu, &msg, NULL, 0, sizeof(msg.payload.u64));
+	if (!r)
+		*val = msg.payload.u64;
+
+	return r;
+}
+
+static int vhost_user__set_u64(struct vhost_user *vu, u32 request, u64 val)
+{
+	struct vhost_user_msg msg = {
+		.request	= request,
+		.size		= sizeof(msg.payload.u64),
+		.payload.u64	= val,
+	};
+
+	return vhost_user__request(vu, &msg, NULL, 0, -1);
+}
+
+static int vhost_user__set_state(struct vhost_user *vu, u32 request,
+				 u32 index, u32 num)
+{
+	struct vhost_user_msg msg = {
+		.request	= request,
+		.size		= sizeof(msg.payload.state),
+		.payload.state	= {
+			.index	= index,
+			.num	= num,
+		},
+	};
+
+	return vhost_user__request(vu, &msg, NULL, 0, -1);
+}
+
+static int vhost_user__set_vring_fd(struct vhost_user *vu, u32 request,
+				    u32 index, int fd)
+{
+	struct vhost_user_msg msg = {
+		.request	= request,
+		.size		= sizeof(msg.payload.u64),
+		.payload.u64	= index,
+	};
+
+	return vhost_user__request(vu, &msg, &fd, 1, -1);
+}
+
+int vhost_user__init(struct vhost_user *vu, const char *path)
+{
+	struct sockaddr_un addr = {
+		.sun_family	= AF_UNIX,
+	};
+	struct vhost_user_msg msg;
+	u64 queue_num;
+	int r;
+
+	memset(vu, 0, sizeof(*vu));
+	mutex_init(&vu->mutex);
+	vu->queue_num = 1;
+
+	if (strlcpy(addr.sun_path, path, sizeof(addr.sun_path)) >=
+	    sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+
+	vu->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (vu->sock < 0)
+		return -errno;
+
+	if (connect(vu->sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		r = -errno;
+		goto err;
+	}
+
+	msg = (struct vhost_user_msg) {
+		.request	= VHOST_USER_SET_OWNER,
+	};
+	r = vhost_user__request(vu, &msg, NULL, 0, -1);
+	if (!r)
+		r = vhost_user__get_u64(vu, VHOST_USER_GET_FEATURES,
+					&vu->features);
+	if (r)
+		goto err;
+
+	if (!(vu->features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES)))
+		return 0;
+
+	/* Of the protocol extensions, only several queue pairs are used */
+	r = vhost_user__get_u64(vu, VHOST_USER_GET_PROTOCOL_FEATURES,
+				&vu->protocol_features);
+	if (r)
+		goto err;
+
+	vu->protocol_features &= 1ULL << VHOST_USER_PROTOCOL_F_MQ;
+	r = vhost_user__set_u64(vu, VHOST_USER_SET_PROTOCOL_FEATURES,
+				vu->protocol_features);
+	if (!r && vu->protocol_features) {
+		r = vhost_user__get_u64(vu, VHOST_USER_GET_QUEUE_NUM,
+					&queue_num);
+		if (!r)
+			vu->queue_num = queue_num;
+	}
+	if (r)
+		goto err;
+
+	return 0;
+
+err:
+	close(vu->sock);
+	vu->sock = -1;
+	return r;
+}
+
+void vhost_user__exit(struct vhost_user *vu)
+{
+	if (vu->sock >= 0)
+		close(vu->sock);
+	vu->sock = -1;
+}
+
+int vhost_user__set_features(struct vhost_user *vu, u64 features)
+{
+	/* Keeps the protocol extensions, which were agreed on already */
+	features |= vu->features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES);
+
+	return vhost_user__set_u64(vu, VHOST_USER_SET_FEATURES, features);
+}
+
+struct vhost_user_mem {
+	struct vhost_user_msg	msg;
+	int			fds[VHOST_USER_MAX_REGIONS];
+};
+
+static int vhost_user__add_bank(struct kvm *kvm, struct kvm_mem_bank *bank,
+				void *data)
+{
+	struct vhost_user_mem *mem = data;
+	u32 i = mem->msg.payload.memory.nregions;
+	u64 offset;
+	int fd;
+
+	if (i == VHOST_USER_MAX_REGIONS)
+		return -ENOSPC;
+
+	fd = mmap_shared_fd(bank->host_addr, &offset);
+	if (fd < 0)
+		return -EINVAL;
+
+	mem->msg.payload.memory.regions[i] = (struct vhost_user_region) {
+		.guest_phys_addr	= bank->guest_phys_addr,
+		.memory_size		= bank->size,
+		.userspace_addr		= (unsigned long)bank->host_addr,
+		.mmap_offset		= offset,
+	};
+	mem->fds[i] = fd;
+	mem->msg.payload.memory.nregions++;
+
+	return 0;
+}
+
+int vhost_user__set_mem_table(struct vhost_user *vu, struct kvm *kvm)
+{
+	struct vhost_user_mem mem = {
+		.msg.request	= VHOST_USER_SET_MEM_TABLE,
+	};
+	u32 nregions;
+	int r;
+
+	r = kvm__for_each_mem_bank(kvm, KVM_MEM_TYPE_RAM, vhost_user__add_bank,
+				   &mem);
+	if (r)
+		return r;
+
+	/* Only the regions in use are sent */
+	nregions = mem.msg.payload.memory.nregions;
+	mem.msg.size = offsetof(typeof(mem.msg.payload), memory.regions[nregions]);
+
+	return vhost_user__request(vu, &mem.msg, mem.fds, nregions, -1);
+}
+
+/*
+ * The ring starts over at index 0, since the device was reset. The kick is
+ * sent last, as it starts the backend on the ring.
+ */
+int vhost_user__start_vring(struct vhost_user *vu, u32 index,
+			    struct virt_queue *vq, int kick_fd, int call_fd)
+{
+	struct vhost_user_msg msg = {
+		.request	= VHOST_USER_SET_VRING_ADDR,
+		.size		= sizeof(msg.payload.addr),
+		.payload.addr	= {
+			.index		= index,
+			.desc_user_addr	= (unsigned long)vq->vring.desc,
+			.avail_user_addr = (unsigned long)vq->vring.avail,
+			.used_user_addr	= (unsigned long)vq->vring.used,
+		},
+	};
+	int r;
+
+	r = vhost_user__set_state(vu, VHOST_USER_SET_VRING_NUM, index,
+				  vq->vring.num);
+	if (!r)
+		r = vhost_user__set_state(vu, VHOST_USER_SET_VRING_BASE, index, 0);
+	if (!r)
+		r = vhost_user__request(vu, &msg, NULL, 0, -1);
+	if (!r)
+		r = vhost_user__set_vring_call(vu, index, call_fd);
+	if (!r)
+		r = vhost_user__set_vring_fd(vu, VHOST_USER_SET_VRING_KICK,
+					     index, kick_fd);
+	if (!r && (vu->features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES)))
+		r = vhost_user__set_state(vu, VHOST_USER_SET_VRING_ENABLE,
+					  index, 1);
+
+	return r;
+}
+
+/* The backend stops processing the ring once it has replied */
+int vhost_user__stop_vring(struct vhost_user *vu, u32 index)
+{
+	struct vhost_user_msg msg = {
+		.request	= VHOST_USER_GET_VRING_BASE,
+		.size		= sizeof(msg.payload.state),
+		.payload.state	= {
+			.index	= index,
+		},
+	};
+
+	return vhost_user__request(vu, &msg, NULL, 0, sizeof(msg.payload.state));
+}
+
+int vhost_user__set_vring_call(struct vhost_user *vu, u32 index, int fd)
+{
+	return vhost_user__set_vring_fd(vu, VHOST_USER_SET_VRING_CALL, index,
+					fd);
+}
@@ -56,12 +56,12 @@ static u8 *get_config(struct kvm *kvm, void *dev) {
 	return ((u8*)(&vdev->config));
 }
 
-static u32 get_host_features(struct kvm *kvm, void *dev) {
+static u64 get_host_features(struct kvm *kvm, void *dev) {
 	struct vsock_dev *vdev = dev;
 	return vdev->features;
 }
 
-static void set_guest_features(struct kvm *kvm, void *dev, u32 features) {
+static void set_guest_features(struct kvm *kvm, void *dev, u64 features) {
 	struct vsock_dev *vdev = dev;
 
 	u64 nfeatures = features;
@@ -100,12 +100,10 @@ static void virtio_vproxy__ioevent_callback(struct kvm *kvm, void *param)
     p->vdev->ops->signal_vq(kvm, p->vdev, p->vq);
 }
 
-static int init_vq(struct kvm *kvm, void *dev, u32 vq, u32 page_size, u32 align,
-		u32 pfn) {
+static int init_vq(struct kvm *kvm, void *dev, u32 vq) {
 	compat__remove_message(compat_id);
 
 	int ret = 0;
-	void *p = NULL;
 	u32 gsi = 0;
 	int use_vsock_call_proxy = 0;
 	struct vsock_dev *vdev = dev;
@@ -116,10 +114,7 @@ static int init_vq(struct kvm *kvm, void *dev, u32 vq, u32 page_size, u32 align,
 	use_vsock_call_proxy = 1;
 #endif
 
-	queue->pfn = pfn;
-	p = virtio_get_vq(kvm, queue->pfn, page_size);
-
-	vring_init(&queue->vring, VIRTIO_VSOCK_QUEUE_SIZE, p, align);
+	virtio_init_device_vq(kvm, &vdev->dev, queue, VIRTIO_VSOCK_QUEUE_SIZE);
 
 	if (vq > 1) {
 		// TODO(chirantan): Implement the event virtqueue
@@ -376,6 +371,9 @@ int virtio_vsock_init(struct kvm *kvm) {
 	vdev->mem_size = 0x10000;
 #endif
 
+	/* Known before the transport publishes the features */
+	vdev->dev.use_vhost = true;
+
 	ret = virtio_init(kvm, vdev, &vdev->dev, &vsock_dev_virtio_ops,
 			  trans, PCI_DEVICE_ID_VIRTIO_VSOCK,
 			  VIRTIO_ID_VSOCK, PCI_CLASS_VSOCK);
@@ -437,8 +435,6 @@ int virtio_vsock_init(struct kvm *kvm) {
 		goto vhost_cleanup;
 	}
 
-	vdev->dev.use_vhost = true;
-
 	if (compat_id == -1) {
 		compat_id = virtio_compat_add_message("virtio-vsock",
 						      "CONFIG_VIRTIO_VSOCKETS");
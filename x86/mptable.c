@@ -90,6 +90,12 @@ int mptable__init(struct kvm *kvm)
 	unsigned int ioapicid;
 	void *last_addr;
 
+#ifdef RSLD
+	/* No guest memory to place the table in */
+	if (kvm->cfg.pmm)
+		return 0;
+#endif
+
 	/* That is where MP table will be in guest memory */
 	real_mpc_table = ALIGN(MB_BIOS_BEGIN + bios_rom_size, 16);
 